@@ -0,0 +1,61 @@
+#include "KeyCollisions.h"
+#include <algorithm>
+
+void CKeyCollisionIndex::Add(unsigned int hash, std::wstring_view name, unsigned int row) {
+    m_entries.push_back({ hash, row, (unsigned int)m_names.size(), (unsigned int)name.size() });
+    m_names.append(name);
+}
+
+std::vector<KeyCollision> CKeyCollisionIndex::FindCollisions() const {
+    std::vector<KeyCollision> collisions;
+    std::vector<Entry> entries = m_entries;
+    std::sort(entries.begin(), entries.end(), [](Entry const &a, Entry const &b) {
+        return a.hash < b.hash || (a.hash == b.hash && a.row < b.row);
+        });
+    auto Name = [this](Entry const &entry) {
+        return std::wstring_view(m_names).substr(entry.nameOffset, entry.nameLength);
+    };
+    size_t groupStart = 0;
+    while (groupStart < entries.size()) {
+        size_t groupEnd = groupStart + 1;
+        bool differentNames = false;
+        while (groupEnd < entries.size() && entries[groupEnd].hash == entries[groupStart].hash) {
+            if (Name(entries[groupEnd]) != Name(entries[groupStart]))
+                differentNames = true;
+            groupEnd++;
+        }
+        // the same key repeated on several rows is a duplicate, not a collision
+        if (differentNames) {
+            KeyCollision collision;
+            collision.hash = entries[groupStart].hash;
+            for (size_t i = groupStart; i < groupEnd; i++) {
+                std::wstring_view name = Name(entries[i]);
+                bool seen = std::any_of(collision.keys.begin(), collision.keys.end(), [name](auto const &key) {
+                    return key.first == name;
+                    });
+                if (!seen)
+                    collision.keys.emplace_back(std::wstring(name), entries[i].row);
+            }
+            collisions.push_back(std::move(collision));
+        }
+        groupStart = groupEnd;
+    }
+    return collisions;
+}
+
+bool CKeyCollisionIndex::Empty() const {
+    return m_entries.empty();
+}
+
+void CKeyCollisionIndex::Clear() {
+    m_entries.clear();
+    m_names.clear();
+}
+
+void CKeyCollisionIndex::FindNames(std::map<unsigned int, std::wstring> &names) const {
+    for (auto const &entry : m_entries) {
+        auto it = names.find(entry.hash);
+        if (it != names.end() && it->second.empty())
+            it->second.assign(m_names, entry.nameOffset, entry.nameLength);
+    }
+}
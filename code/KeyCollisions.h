@@ -0,0 +1,32 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+
+class KeyCollision {
+public:
+    unsigned int hash = 0;
+    std::vector<std::pair<std::wstring, unsigned int>> keys; // key name, source row of its first occurrence
+};
+
+// Collects every (hash, key name, source row) seen while importing or resolving keys and finds
+// the hashes shared by different key names. Adding is an append to two flat buffers, the
+// grouping is done once in FindCollisions.
+class CKeyCollisionIndex {
+    struct Entry {
+        unsigned int hash;
+        unsigned int row;
+        unsigned int nameOffset;
+        unsigned int nameLength;
+    };
+    std::vector<Entry> m_entries;
+    std::wstring m_names;
+public:
+    void Add(unsigned int hash, std::wstring_view name, unsigned int row);
+    std::vector<KeyCollision> FindCollisions() const;
+    // sets each empty name in names to the first name added for its hash
+    void FindNames(std::map<unsigned int, std::wstring> &names) const;
+    bool Empty() const;
+    void Clear();
+};
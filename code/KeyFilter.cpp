@@ -0,0 +1,99 @@
+#include "KeyFilter.h"
+#include "utils.h"
+
+bool CKeyFilter::MatchGlob(std::wstring_view glob, std::wstring_view name) {
+    auto Lower = [](wchar_t c) {
+        return (c >= L'A' && c <= L'Z') ? (wchar_t)(c + 0x20) : c;
+    };
+    // on a mismatch the last * takes one more character
+    size_t g = 0, n = 0;
+    size_t starGlob = std::wstring_view::npos, starName = 0;
+    while (n < name.size()) {
+        if (g < glob.size() && glob[g] == L'*') {
+            starGlob = g++;
+            starName = n;
+        }
+        else if (g < glob.size() && (glob[g] == L'?' || Lower(glob[g]) == Lower(name[n]))) {
+            g++;
+            n++;
+        }
+        else if (starGlob != std::wstring_view::npos) {
+            g = starGlob + 1;
+            n = ++starName;
+        }
+        else
+            return false;
+    }
+    while (g < glob.size() && glob[g] == L'*')
+        g++;
+    return g == glob.size();
+}
+
+void CKeyFilter::AddGlob(std::wstring const &glob) {
+    m_globs.push_back(glob);
+}
+
+bool CKeyFilter::AddRegex(std::wstring const &pattern) {
+    try {
+        m_regexes.emplace_back(pattern, std::regex_constants::ECMAScript | std::regex_constants::optimize);
+    }
+    catch (std::regex_error const &) {
+        return false;
+    }
+    return true;
+}
+
+void CKeyFilter::UseHashList() {
+    m_bHashList = true;
+}
+
+void CKeyFilter::AddHash(unsigned int hash) {
+    m_bHashList = true;
+    m_hashes.insert(hash);
+}
+
+bool CKeyFilter::AddCategory(std::wstring const &name) {
+    std::pair<wchar_t const *, eKeyCategory> categories[] = {
+        { L"other", KEYCAT_NONE },
+        { L"hash", KEYCAT_HASH },
+        { L"mail", KEYCAT_MAIL },
+        { L"tm09", KEYCAT_TM09 },
+        { L"help", KEYCAT_HELP },
+        { L"achievement", KEYCAT_ACHIEVEMENT },
+        { L"reward", KEYCAT_REWARD },
+        { L"character", KEYCAT_CHARACTER },
+        { L"3dmatchhint", KEYCAT_3DMATCHHINT }
+    };
+    std::wstring lowerName = ToLower(name);
+    for (auto const &[categoryName, category] : categories) {
+        if (lowerName == categoryName) {
+            m_categories |= 1u << category;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CKeyFilter::IsEmpty() const {
+    return m_globs.empty() && m_regexes.empty() && !m_bHashList && m_categories == 0;
+}
+
+bool CKeyFilter::Matches(TranslationKey const &key, unsigned int hash) const {
+    if (m_bHashList && !m_hashes.contains(hash))
+        return false;
+    if (m_categories != 0 && !(m_categories & (1u << key.category)))
+        return false;
+    if (!m_globs.empty() && std::none_of(m_globs.begin(), m_globs.end(), [&key](std::wstring const &glob) {
+        return MatchGlob(glob, key.name);
+        }))
+    {
+        return false;
+    }
+    if (!m_regexes.empty() && std::none_of(m_regexes.begin(), m_regexes.end(), [&key](std::wregex const &regex) {
+        return std::regex_search(key.name.begin(), key.name.end(), regex);
+        }))
+    {
+        return false;
+    }
+    return true;
+}
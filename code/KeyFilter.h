@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <regex>
+#include <unordered_set>
+#include "TranslationKeyComparator.h"
+
+// Selection of exported keys by name globs (* and ?, case-insensitive) and regular expressions, explicit
+// hashes and key categories. A key is selected if it matches one criterion of each kind that is set;
+// an empty filter selects every key. Only names and hashes are looked at, nothing has to be decoded.
+class CKeyFilter {
+    std::vector<std::wstring> m_globs;
+    std::vector<std::wregex> m_regexes;
+    std::unordered_set<unsigned int> m_hashes;
+    bool m_bHashList = false;
+    unsigned int m_categories = 0; // 1 << eKeyCategory of each selected category
+public:
+    static bool MatchGlob(std::wstring_view glob, std::wstring_view name);
+    void AddGlob(std::wstring const &glob);
+    // returns false on an invalid regular expression
+    bool AddRegex(std::wstring const &pattern);
+    // selects the hashes given with AddHash only, even if none is given
+    void UseHashList();
+    void AddHash(unsigned int hash);
+    // returns false for an unknown category name
+    bool AddCategory(std::wstring const &name);
+    bool IsEmpty() const;
+    bool Matches(TranslationKey const &key, unsigned int hash) const;
+};
@@ -0,0 +1,425 @@
+#include "KeyRecovery.h"
+#include "Text.h"
+#include "TextFileTable.h"
+#include "message.h"
+#include "utils.h"
+#include <algorithm>
+#include <mutex>
+#include <set>
+
+// 65599^n and 65599^-n mod 2^32 for every name length
+struct HashPowers {
+    std::vector<unsigned int> powers;
+    std::vector<unsigned int> inversePowers;
+
+    HashPowers() {
+        // Newton's iteration doubles the correct low bits of the inverse of an odd number
+        unsigned int inverse = 65599;
+        for (unsigned int i = 0; i < 5; i++)
+            inverse *= 2 - 65599 * inverse;
+        powers.resize(CKeyRecovery::MAX_NAME_LENGTH + 1);
+        inversePowers.resize(CKeyRecovery::MAX_NAME_LENGTH + 1);
+        powers[0] = inversePowers[0] = 1;
+        for (unsigned int i = 1; i <= CKeyRecovery::MAX_NAME_LENGTH; i++) {
+            powers[i] = powers[i - 1] * 65599;
+            inversePowers[i] = inversePowers[i - 1] * inverse;
+        }
+    }
+};
+
+static HashPowers const &GetHashPowers() {
+    static HashPowers hashPowers;
+    return hashPowers;
+}
+
+// hash and length of the combination of slots [first, last) with the given index, the last slot varying fastest;
+// digits gets the option of each slot
+static void CombineSlots(CKeyRecovery::Template const &t, size_t first, size_t last, unsigned long long index,
+    unsigned int *digits, unsigned int &hash, unsigned int &length)
+{
+    for (size_t s = last; s > first; s--) {
+        size_t count = t.slots[s - 1].size();
+        digits[s - 1] = (unsigned int)(index % count);
+        index /= count;
+    }
+    HashPowers const &hashPowers = GetHashPowers();
+    hash = 0;
+    length = 0;
+    for (size_t s = first; s < last; s++) {
+        CKeyRecovery::Option const &option = t.slots[s][digits[s]];
+        unsigned int optionLength = (unsigned int)option.text.size();
+        if (length + optionLength > CKeyRecovery::MAX_NAME_LENGTH) {
+            length = CKeyRecovery::MAX_NAME_LENGTH + 1;
+            return;
+        }
+        hash = hash * hashPowers.powers[optionLength] + option.hash;
+        length += optionLength;
+    }
+}
+
+// text of the slots [first, last) with the given options, into a buffer reused for every match
+static void SlotsText(CKeyRecovery::Template const &t, size_t first, size_t last, unsigned int const *digits, std::wstring &text) {
+    text.clear();
+    for (size_t s = first; s < last; s++)
+        text += t.slots[s][digits[s]].text;
+}
+
+// a higher score, then an earlier template, then the name
+static bool IsBetter(float score, unsigned int templateIndex, std::wstring_view name, CKeyRecovery::Candidate const &other) {
+    if (score != other.score)
+        return score > other.score;
+    if (templateIndex != other.templateIndex)
+        return templateIndex < other.templateIndex;
+    return name < other.name;
+}
+
+void CKeyRecovery::AddOption(Slot &slot, std::wstring const &text) {
+    slot.push_back({ text, CText::GetHash(text) });
+}
+
+bool CKeyRecovery::ParseSlot(std::wstring_view spec, std::filesystem::path const &baseFolder, Slot &slot) const {
+    if (spec == L"known") {
+        for (auto const &fragment : m_knownFragments)
+            AddOption(slot, fragment);
+        return true;
+    }
+    if (spec.starts_with(L'@')) {
+        TextFileTable words;
+        if (!words.Read(baseFolder / std::filesystem::path(spec.substr(1)), L'\t'))
+            return false;
+        for (unsigned int r = 0; r < words.NumRows(); r++) {
+            std::wstring word = (words.NumColumns(r) > 0) ? std::wstring(words.Cell(0, r)) : std::wstring();
+            Trim(word);
+            if (!word.empty())
+                AddOption(slot, word);
+        }
+        return true;
+    }
+    // a range is two numbers, both prefixed with x for hexadecimal
+    size_t dash = spec.find(L'-');
+    if (dash != std::wstring_view::npos && dash > 0 && dash + 1 < spec.size()) {
+        std::wstring_view from = spec.substr(0, dash), to = spec.substr(dash + 1);
+        bool hex = from[0] == L'x' && to[0] == L'x';
+        if (hex) {
+            from.remove_prefix(1);
+            to.remove_prefix(1);
+        }
+        auto ParseNumber = [hex](std::wstring_view str, unsigned long long &value) {
+            value = 0;
+            if (str.empty() || str.size() > 9)
+                return false;
+            for (wchar_t c : str) {
+                unsigned int digit = 16;
+                if (c >= L'0' && c <= L'9')
+                    digit = c - L'0';
+                else if (hex && (c | 0x20) >= L'a' && (c | 0x20) <= L'f')
+                    digit = (c | 0x20) - L'a' + 10;
+                if (digit >= (hex ? 16u : 10u))
+                    return false;
+                value = value * (hex ? 16 : 10) + digit;
+            }
+            return true;
+        };
+        unsigned long long first = 0, last = 0;
+        if (ParseNumber(from, first) && ParseNumber(to, last)) {
+            if (first > last || last - first >= MAX_TABLE_SIZE)
+                return false;
+            size_t width = (from.size() > 1 && from[0] == L'0') ? from.size() : 0;
+            for (unsigned long long value = first; value <= last; value++) {
+                std::wstring text;
+                unsigned long long rest = value;
+                do {
+                    unsigned int digit = (unsigned int)(rest % (hex ? 16 : 10));
+                    text += (wchar_t)(digit < 10 ? (L'0' + digit) : (L'A' + digit - 10));
+                    rest /= (hex ? 16 : 10);
+                } while (rest);
+                while (text.size() < width)
+                    text += L'0';
+                std::reverse(text.begin(), text.end());
+                AddOption(slot, text);
+            }
+            return true;
+        }
+    }
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(L'|', start);
+        if (end == std::wstring_view::npos)
+            end = spec.size();
+        AddOption(slot, std::wstring(spec.substr(start, end - start)));
+        start = end + 1;
+    }
+    return true;
+}
+
+void CKeyRecovery::SetKnownNames(std::vector<std::wstring> const &names) {
+    m_knownNames = names;
+    m_knownFragments.clear();
+    m_knownFragmentSet.clear();
+    for (auto const &name : names) {
+        size_t start = 0;
+        while (start < name.size()) {
+            size_t end = name.find(L'_', start);
+            if (end == std::wstring::npos)
+                end = name.size();
+            if (end > start)
+                m_knownFragmentSet.emplace(name.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    // numbers are left to ranges, as {known} options they would multiply the false matches
+    for (auto const &fragment : m_knownFragmentSet) {
+        if (!IsNumber(fragment))
+            m_knownFragments.push_back(fragment);
+    }
+    std::sort(m_knownFragments.begin(), m_knownFragments.end());
+}
+
+bool CKeyRecovery::AddTemplate(std::wstring_view pattern, std::filesystem::path const &baseFolder) {
+    Template t;
+    t.pattern = pattern;
+    std::wstring literal;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] == L'}')
+            return false;
+        if (pattern[i] != L'{') {
+            literal += pattern[i];
+            continue;
+        }
+        size_t end = pattern.find(L'}', i + 1);
+        if (end == std::wstring_view::npos)
+            return false;
+        if (!literal.empty()) {
+            t.slots.emplace_back();
+            AddOption(t.slots.back(), literal);
+            literal.clear();
+        }
+        t.slots.emplace_back();
+        if (!ParseSlot(pattern.substr(i + 1, end - i - 1), baseFolder, t.slots.back()))
+            return false;
+        i = end;
+    }
+    if (!literal.empty()) {
+        t.slots.emplace_back();
+        AddOption(t.slots.back(), literal);
+    }
+    if (!t.slots.empty())
+        m_templates.push_back(std::move(t));
+    return true;
+}
+
+bool CKeyRecovery::ReadGrammar(std::filesystem::path const &path) {
+    TextFileTable grammar;
+    if (!grammar.Read(path, L'\t'))
+        return false;
+    for (unsigned int r = 0; r < grammar.NumRows(); r++) {
+        std::wstring line = (grammar.NumColumns(r) > 0) ? std::wstring(grammar.Cell(0, r)) : std::wstring();
+        Trim(line);
+        if (line.empty() || line[0] == L'#')
+            continue;
+        if (!AddTemplate(line, path.parent_path()))
+            return ErrorMessage(Format(L"Invalid key template in line %d: %s", r + 1, line));
+    }
+    return true;
+}
+
+void CKeyRecovery::AddTemplatesFromKnownNames() {
+    std::set<std::wstring> patterns;
+    for (auto const &name : m_knownNames) {
+        std::wstring pattern;
+        bool hasNumber = false;
+        for (size_t i = 0; i < name.size();) {
+            if (name[i] < L'0' || name[i] > L'9') {
+                pattern += name[i++];
+                continue;
+            }
+            size_t end = i;
+            while (end < name.size() && name[end] >= L'0' && name[end] <= L'9')
+                end++;
+            size_t width = end - i;
+            if (width > 6) {
+                pattern.append(name, i, width);
+                i = end;
+                continue;
+            }
+            // 12 gives {0-99}, 012 gives {000-999}
+            pattern += L'{';
+            pattern += (name[i] == L'0' && width > 1) ? std::wstring(width, L'0') : std::wstring(L"0");
+            pattern += L'-';
+            pattern += std::wstring(width, L'9');
+            pattern += L'}';
+            hasNumber = true;
+            i = end;
+        }
+        if (hasNumber)
+            patterns.insert(pattern);
+    }
+    for (auto const &pattern : patterns)
+        AddTemplate(pattern);
+}
+
+size_t CKeyRecovery::NumTemplates() const {
+    return m_templates.size();
+}
+
+std::vector<unsigned int> const &CKeyRecovery::GetSkippedTemplates() const {
+    return m_skippedTemplates;
+}
+
+void CKeyRecovery::AddCandidate(CandidateSet &found, size_t targetIndex, unsigned int hash, std::wstring_view name,
+    unsigned int templateIndex) const
+{
+    float score = Score(name);
+    std::lock_guard<std::mutex> lock(found.mutexes[targetIndex]);
+    std::vector<Candidate> &best = found.best[targetIndex];
+    // a name found by several templates is kept for the first one
+    for (auto const &candidate : best) {
+        if (candidate.name == name)
+            return;
+    }
+    found.numFound[targetIndex]++;
+    auto position = std::find_if(best.begin(), best.end(), [&](Candidate const &candidate) {
+        return IsBetter(score, templateIndex, name, candidate);
+        });
+    if (position == best.end() && best.size() >= found.maxPerHash)
+        return;
+    best.insert(position, { hash, std::wstring(name), templateIndex, score });
+    if (best.size() > found.maxPerHash)
+        best.pop_back();
+}
+
+bool CKeyRecovery::Search(Template const &t, std::vector<unsigned int> const &targets, unsigned int templateIndex,
+    CandidateSet &found) const
+{
+    size_t numSlots = t.slots.size();
+    std::vector<double> suffixCounts(numSlots + 1, 1.0); // combinations of slots [s, numSlots)
+    for (size_t s = numSlots; s > 0; s--) {
+        if (t.slots[s - 1].empty())
+            return true;
+        suffixCounts[s - 1] = suffixCounts[s] * (double)t.slots[s - 1].size();
+    }
+    // the whole template against the target set, or P = slots [0, split) in a table and Q = the rest looked up
+    size_t split = numSlots;
+    double bestWork = suffixCounts[0];
+    double prefixCount = 1.0;
+    for (size_t s = 1; s < numSlots; s++) {
+        prefixCount *= (double)t.slots[s - 1].size();
+        double work = prefixCount + suffixCounts[s] * (double)targets.size();
+        if (prefixCount <= (double)MAX_TABLE_SIZE && work < bestWork) {
+            bestWork = work;
+            split = s;
+        }
+    }
+    if (bestWork > (double)MAX_WORK)
+        return false;
+    if (split == numSlots) {
+        ParallelFor((size_t)suffixCounts[0], [&](size_t begin, size_t end) {
+            std::vector<unsigned int> digits(numSlots);
+            std::wstring name;
+            for (size_t index = begin; index < end; index++) {
+                unsigned int hash = 0, length = 0;
+                CombineSlots(t, 0, numSlots, index, digits.data(), hash, length);
+                if (length > MAX_NAME_LENGTH)
+                    continue;
+                auto target = std::lower_bound(targets.begin(), targets.end(), hash);
+                if (target != targets.end() && *target == hash) {
+                    SlotsText(t, 0, numSlots, digits.data(), name);
+                    AddCandidate(found, target - targets.begin(), hash, name, templateIndex);
+                }
+            }
+        }, 4096);
+        return true;
+    }
+    // (hash, index) of every P, sorted, with the start of each range of equal top 16 bits
+    size_t numPrefixes = (size_t)(suffixCounts[0] / suffixCounts[split]);
+    std::vector<std::pair<unsigned int, unsigned int>> table(numPrefixes);
+    ParallelFor(numPrefixes, [&](size_t begin, size_t end) {
+        std::vector<unsigned int> digits(numSlots);
+        for (size_t index = begin; index < end; index++) {
+            unsigned int hash = 0, length = 0;
+            CombineSlots(t, 0, split, index, digits.data(), hash, length);
+            table[index] = { hash, (unsigned int)index };
+        }
+    }, 4096);
+    std::sort(table.begin(), table.end());
+    std::vector<unsigned int> buckets(65537, 0);
+    for (auto const &[hash, index] : table)
+        buckets[(hash >> 16) + 1]++;
+    for (size_t b = 1; b < buckets.size(); b++)
+        buckets[b] += buckets[b - 1];
+    HashPowers const &hashPowers = GetHashPowers();
+    ParallelFor((size_t)suffixCounts[split], [&](size_t begin, size_t end) {
+        std::vector<unsigned int> digits(numSlots);
+        std::wstring name;
+        for (size_t index = begin; index < end; index++) {
+            unsigned int suffixHash = 0, suffixLength = 0;
+            CombineSlots(t, split, numSlots, index, digits.data(), suffixHash, suffixLength);
+            if (suffixLength > MAX_NAME_LENGTH)
+                continue;
+            unsigned int inversePower = hashPowers.inversePowers[suffixLength];
+            for (size_t targetIndex = 0; targetIndex < targets.size(); targetIndex++) {
+                unsigned int target = targets[targetIndex];
+                unsigned int prefixHash = (target - suffixHash) * inversePower;
+                auto first = table.begin() + buckets[prefixHash >> 16];
+                auto last = table.begin() + buckets[(prefixHash >> 16) + 1];
+                for (auto it = std::lower_bound(first, last, std::make_pair(prefixHash, 0u)); it != last && it->first == prefixHash; ++it) {
+                    unsigned int prefixLength = 0, hash = 0;
+                    CombineSlots(t, 0, split, it->second, digits.data(), hash, prefixLength);
+                    if (prefixLength + suffixLength <= MAX_NAME_LENGTH) {
+                        SlotsText(t, 0, numSlots, digits.data(), name);
+                        AddCandidate(found, targetIndex, target, name, templateIndex);
+                    }
+                }
+            }
+        }
+    }, 64);
+    return true;
+}
+
+float CKeyRecovery::Score(std::wstring_view name) const {
+    // numbers count as known fragments
+    unsigned int numFragments = 0, numKnown = 0;
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t end = name.find(L'_', start);
+        if (end == std::wstring_view::npos)
+            end = name.size();
+        if (end > start) {
+            std::wstring_view fragment = name.substr(start, end - start);
+            numFragments++;
+            if (IsNumber(fragment) || m_knownFragmentSet.contains(fragment))
+                numKnown++;
+        }
+        start = end + 1;
+    }
+    return numFragments ? ((float)numKnown / (float)numFragments) : 0.0f;
+}
+
+std::vector<CKeyRecovery::Candidate> CKeyRecovery::Recover(std::vector<unsigned int> const &hashes, unsigned int maxCandidatesPerHash) {
+    std::vector<unsigned int> targets = hashes;
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    m_skippedTemplates.clear();
+    std::vector<Candidate> result;
+    if (targets.empty())
+        return result;
+    CandidateSet found;
+    found.best.resize(targets.size());
+    found.numFound.resize(targets.size());
+    found.mutexes = std::vector<std::mutex>(targets.size());
+    found.maxPerHash = maxCandidatesPerHash;
+    for (unsigned int i = 0; i < m_templates.size(); i++) {
+        if (!Search(m_templates[i], targets, i, found))
+            m_skippedTemplates.push_back(i);
+    }
+    for (size_t k = 0; k < targets.size(); k++) {
+        for (auto &candidate : found.best[k]) {
+            candidate.score /= (float)found.numFound[k];
+            result.push_back(std::move(candidate));
+        }
+    }
+    std::sort(result.begin(), result.end(), [](Candidate const &a, Candidate const &b) {
+        return IsBetter(a.score, a.templateIndex, a.name, b);
+        });
+    return result;
+}
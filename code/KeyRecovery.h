@@ -0,0 +1,84 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <filesystem>
+#include <mutex>
+
+// Finds key names for unresolved hashes from name templates. A template is a sequence of slots, each a list of
+// options: literal text, {a|b|c} alternatives, {0-999} decimal and {x0-xFF} hexadecimal ranges (zero-padded to
+// the width of the first bound if it starts with 0), {@file} one option per line of a file and {known} the
+// '_'-separated non-numeric fragments of the resolved key names.
+// CText::GetHash is h * 65599 + c mod 2^32, so the hash of a name split into P + Q is hash(P) * 65599^|Q| + hash(Q)
+// and hash(P) = (target - hash(Q)) * 65599^-|Q|. Each template is split where the work is smallest: the hashes of
+// all P are put in a sorted table and every Q is looked up for every target hash, a meet in the middle. Small
+// templates are enumerated whole and looked up in the target set.
+class CKeyRecovery {
+public:
+    static const unsigned long long MAX_TABLE_SIZE = 1ull << 25; // P hashes kept in memory
+    static const unsigned long long MAX_WORK = 1ull << 34; // hashes computed and looked up for one template
+    static const unsigned int MAX_NAME_LENGTH = 1024;
+
+    struct Option {
+        std::wstring text;
+        unsigned int hash; // CText::GetHash(text)
+    };
+    typedef std::vector<Option> Slot;
+
+    struct Template {
+        std::vector<Slot> slots;
+        std::wstring pattern;
+    };
+
+    struct Candidate {
+        unsigned int hash;
+        std::wstring name;
+        unsigned int templateIndex;
+        float score;
+    };
+private:
+    // lets the fragment set be searched with views of a name
+    struct FragmentHash {
+        using is_transparent = void;
+        size_t operator()(std::wstring_view str) const { return std::hash<std::wstring_view>()(str); }
+    };
+
+    // the best names found so far for each target hash, shared by the search threads. A match only builds a
+    // candidate if it ranks among the best, so false matches of large templates take no memory
+    struct CandidateSet {
+        std::vector<std::vector<Candidate>> best; // per target, best first, score not yet divided
+        std::vector<unsigned long long> numFound; // per target, all names found
+        std::vector<std::mutex> mutexes;          // per target
+        unsigned int maxPerHash = 0;
+    };
+
+    std::vector<Template> m_templates;
+    std::vector<std::wstring> m_knownNames;
+    std::vector<std::wstring> m_knownFragments;
+    std::unordered_set<std::wstring, FragmentHash, std::equal_to<>> m_knownFragmentSet;
+    std::vector<unsigned int> m_skippedTemplates;
+
+    static void AddOption(Slot &slot, std::wstring const &text);
+    bool ParseSlot(std::wstring_view spec, std::filesystem::path const &baseFolder, Slot &slot) const;
+    // returns false if the template is too large to search
+    bool Search(Template const &t, std::vector<unsigned int> const &targets, unsigned int templateIndex, CandidateSet &found) const;
+    void AddCandidate(CandidateSet &found, size_t targetIndex, unsigned int hash, std::wstring_view name, unsigned int templateIndex) const;
+    float Score(std::wstring_view name) const;
+public:
+    // fragments for {known} and for the ranking
+    void SetKnownNames(std::vector<std::wstring> const &names);
+    // returns false on a syntax error
+    bool AddTemplate(std::wstring_view pattern, std::filesystem::path const &baseFolder = std::filesystem::path());
+    // one template per line, empty lines and lines starting with # are skipped; reports the line of an error
+    bool ReadGrammar(std::filesystem::path const &path);
+    // a template for every resolved name with numbers, each digit run replaced with a range of its width
+    void AddTemplatesFromKnownNames();
+    size_t NumTemplates() const;
+    // templates skipped by the last Recover as too large, by index
+    std::vector<unsigned int> const &GetSkippedTemplates() const;
+    // names for the hashes, best first: per hash, the share of fragments seen in resolved names divided by the
+    // number of names found for it, then the order of the templates. Only the best maxCandidatesPerHash names of
+    // each hash are kept while searching
+    std::vector<Candidate> Recover(std::vector<unsigned int> const &hashes, unsigned int maxCandidatesPerHash);
+};
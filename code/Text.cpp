@@ -1,10 +1,83 @@
 #include "Text.h"
 #include <list>
 #include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <string_view>
 #include "utils.h"
 #include "message.h"
 
-unsigned int CText::m_characterMap[65536];
+CTextFileWriter::~CTextFileWriter() {
+    Close();
+}
+
+bool CTextFileWriter::Open(wchar_t const *filePath) {
+    Close();
+    m_hFile = CreateFileW(filePath, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    if (!m_pBuffer)
+        m_pBuffer = std::make_unique<unsigned char[]>(BUFFER_SIZE);
+    m_nBufferUsed = 0;
+    m_bitBuffer = 0;
+    m_nNumBufferedBits = 0;
+    m_bFailed = false;
+    return true;
+}
+
+bool CTextFileWriter::Close() {
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    bool success = FlushBits() && Flush();
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    return success;
+}
+
+bool CTextFileWriter::Flush() {
+    if (m_nBufferUsed != 0 && !m_bFailed) {
+        DWORD written = 0;
+        if (!WriteFile(m_hFile, m_pBuffer.get(), (DWORD)m_nBufferUsed, &written, nullptr) || written != m_nBufferUsed)
+            m_bFailed = true;
+    }
+    m_nBufferUsed = 0;
+    return !m_bFailed;
+}
+
+bool CTextFileWriter::Write(void const *data, size_t size) {
+    unsigned char const *bytes = (unsigned char const *)data;
+    while (size > 0 && !m_bFailed) {
+        if (m_nBufferUsed == BUFFER_SIZE)
+            Flush();
+        size_t chunkSize = (size < BUFFER_SIZE - m_nBufferUsed) ? size : (BUFFER_SIZE - m_nBufferUsed);
+        memcpy(&m_pBuffer[m_nBufferUsed], bytes, chunkSize);
+        m_nBufferUsed += chunkSize;
+        bytes += chunkSize;
+        size -= chunkSize;
+    }
+    return !m_bFailed;
+}
+
+bool CTextFileWriter::WriteZeros(size_t size) {
+    while (size > 0 && !m_bFailed) {
+        if (m_nBufferUsed == BUFFER_SIZE)
+            Flush();
+        size_t chunkSize = (size < BUFFER_SIZE - m_nBufferUsed) ? size : (BUFFER_SIZE - m_nBufferUsed);
+        memset(&m_pBuffer[m_nBufferUsed], 0, chunkSize);
+        m_nBufferUsed += chunkSize;
+        size -= chunkSize;
+    }
+    return !m_bFailed;
+}
+
+bool CTextFileWriter::FlushBits() {
+    // the last byte is padded with zero bits
+    unsigned int numBytes = (m_nNumBufferedBits + 7) / 8;
+    unsigned int word = (unsigned int)m_bitBuffer;
+    m_bitBuffer = 0;
+    m_nNumBufferedBits = 0;
+    return Write(&word, numBytes);
+}
 
 CTextMultibyteStrings::~CTextMultibyteStrings() {
     Clear();
@@ -41,26 +114,6 @@ bool CTextMultibyteStrings::Read(HANDLE fileHandle) {
     return true;
 }
 
-bool CTextMultibyteStrings::Write(HANDLE fileHandle) const {
-    if (fileHandle == INVALID_HANDLE_VALUE)
-        return false;
-    DWORD written = 0;
-    unsigned int magic = 'MBST';
-    unsigned int byteSize = (m_bitOffset / 8) + 1;
-    if (WriteFile(fileHandle, &magic, 4, &written, nullptr) &&
-        WriteFile(fileHandle, &m_bitOffset, 4, &written, nullptr) &&
-        WriteFile(fileHandle, &byteSize, 4, &written, nullptr))
-    {
-        if (m_bitOffset == 0) {
-            unsigned char data = 0;
-            return WriteFile(fileHandle, &data, 1, &written, nullptr);
-        }
-        else
-            return WriteFile(fileHandle, m_pData, byteSize, &written, nullptr);
-    }
-    return false;
-}
-
 unsigned char CTextMultibyteStrings::GetBitAt(unsigned int offset) const {
     unsigned int byteIndex = offset / 8;
     unsigned int bitIndex = offset % 8;
@@ -69,23 +122,27 @@ unsigned char CTextMultibyteStrings::GetBitAt(unsigned int offset) const {
     return (m_pData[byteIndex] >> bitIndex) & 1;
 }
 
+bool CTextMultibyteStrings::Reserve(unsigned int numBytes) {
+    if (numBytes <= m_nDataSize)
+        return true;
+    unsigned int newSize = (std::max)(numBytes, m_nDataSize + 0x100000); // +1MB at least
+    unsigned char *newData = new unsigned char[newSize]();
+    if (!newData)
+        return false;
+    if (m_pData) {
+        memcpy(newData, m_pData, m_nDataSize);
+        delete[] m_pData;
+    }
+    m_pData = newData;
+    m_nDataSize = newSize;
+    return true;
+}
+
 bool CTextMultibyteStrings::WriteBits(unsigned int value, unsigned char numBits) {
     if (numBits == 0 || numBits > 32)
         return false;
-    unsigned int requiredBits = m_bitOffset + numBits;
-    unsigned int requiredBytes = (requiredBits + 7) / 8;
-    if (requiredBytes > m_nDataSize) {
-        unsigned int newSize = m_nDataSize + 0x100000; // +1MB
-        unsigned char *newData = new unsigned char[newSize]();
-        if (!newData)
-            return false;
-        if (m_pData) {
-            memcpy(newData, m_pData, m_nDataSize);
-            delete[] m_pData;
-        }
-        m_pData = newData;
-        m_nDataSize = newSize;
-    }
+    if (!Reserve((m_bitOffset + numBits + 7) / 8))
+        return false;
     unsigned int byteIndex = m_bitOffset / 8;
     unsigned int bitIndex = m_bitOffset % 8;
     for (int i = numBits - 1; i >= 0; --i) {
@@ -100,6 +157,46 @@ bool CTextMultibyteStrings::WriteBits(unsigned int value, unsigned char numBits)
     return true;
 }
 
+bool CTextMultibyteStrings::CopyBits(CTextMultibyteStrings const &source, unsigned int offset, unsigned int numBits) {
+    if (numBits == 0)
+        return true;
+    if (!Reserve((unsigned int)(((unsigned long long)m_bitOffset + numBits + 7) / 8)))
+        return false;
+    // the data past m_bitOffset is zeroed, the bits are ORed in; bits holds up to 56 bits in stream order
+    auto AppendBits = [this](unsigned long long bits, unsigned int count) {
+        unsigned int byteIndex = m_bitOffset / 8;
+        unsigned int bitIndex = m_bitOffset % 8;
+        bits = (bits & ((1ull << count) - 1)) << bitIndex;
+        for (unsigned int b = 0; b < (bitIndex + count + 7) / 8; b++)
+            m_pData[byteIndex + b] |= (unsigned char)(bits >> (8 * b));
+        m_bitOffset += count;
+    };
+    if (offset % 8 == m_bitOffset % 8) {
+        // both sides are at the same bit of a byte - only the bits before the first and after the last whole byte
+        // are shifted, the bytes in between are copied as they are
+        unsigned int headBits = (std::min)((8 - offset % 8) % 8, numBits);
+        if (headBits) {
+            AppendBits(source.PeekBits(offset), headBits);
+            offset += headBits;
+            numBits -= headBits;
+        }
+        unsigned int numBytes = numBits / 8;
+        unsigned int sourceByte = offset / 8;
+        if (sourceByte < source.m_nDataSize)
+            memcpy(m_pData + m_bitOffset / 8, source.m_pData + sourceByte, (std::min)(numBytes, source.m_nDataSize - sourceByte));
+        m_bitOffset += numBytes * 8;
+        offset += numBytes * 8;
+        numBits -= numBytes * 8;
+    }
+    while (numBits > 0) {
+        unsigned int count = (std::min)(numBits, 56u);
+        AppendBits(source.PeekBits(offset), count);
+        offset += count;
+        numBits -= count;
+    }
+    return true;
+}
+
 CHuffChunk::CHuffChunk() {
     frequency = 0;
     character = 0;
@@ -116,7 +213,7 @@ CHuffChunk::CHuffChunk(wchar_t Character, unsigned int Frequency) {
     LeftLeaf = 0xFFFF;
 }
 
-bool CHuffChunk::IsLast() {
+bool CHuffChunk::IsLast() const {
     return RightLeaf == 0xFFFF;
 }
 
@@ -132,24 +229,33 @@ void CTextHuffman::Clear() {
     m_nNumHuffmanChunks = 0;
     m_nNumUniqueCharacters = 0;
     m_nRootLeaf = 0xFFFF;
+    m_canonical.Clear();
 }
 
-unsigned short CTextHuffman::GetRootLeaf() {
+unsigned short CTextHuffman::GetRootLeaf() const {
     return m_nRootLeaf;
 }
 
 CHuffChunk *CTextHuffman::GetChunk(unsigned short chunkIndex) {
     if (chunkIndex < m_nNumHuffmanChunks && m_pHuffChunks)
         return &m_pHuffChunks[chunkIndex];
-    static CHuffChunk DUMMY_CHUNK(0, 0);
+    thread_local CHuffChunk DUMMY_CHUNK;
+    DUMMY_CHUNK = CHuffChunk(0, 0);
+    return &DUMMY_CHUNK;
+}
+
+CHuffChunk const *CTextHuffman::GetChunk(unsigned short chunkIndex) const {
+    if (chunkIndex < m_nNumHuffmanChunks && m_pHuffChunks)
+        return &m_pHuffChunks[chunkIndex];
+    static const CHuffChunk DUMMY_CHUNK(0, 0);
     return &DUMMY_CHUNK;
 }
 
-CharacterInfo *CTextHuffman::FindCharacterInfo(wchar_t ch) {
-    static CharacterInfo DUMMY_CHARACTER_INFO;
+CharacterInfo const *CTextHuffman::FindCharacterInfo(wchar_t ch) const {
+    static const CharacterInfo DUMMY_CHARACTER_INFO;
     if (!m_pCharactersInfo)
         return &DUMMY_CHARACTER_INFO;
-    auto it = std::find_if(m_pCharactersInfo, &m_pCharactersInfo[m_nNumUniqueCharacters], [ch](CharacterInfo &c) {
+    auto it = std::find_if(m_pCharactersInfo, &m_pCharactersInfo[m_nNumUniqueCharacters], [ch](CharacterInfo const &c) {
         return c.character == ch;
         });
     if (it == &m_pCharactersInfo[m_nNumUniqueCharacters])
@@ -157,7 +263,7 @@ CharacterInfo *CTextHuffman::FindCharacterInfo(wchar_t ch) {
     return it;
 }
 
-CHuffChunk *CTextHuffman::GetNextLeaf(unsigned short *currLeaf, unsigned char bit) {
+CHuffChunk const *CTextHuffman::GetNextLeaf(unsigned short *currLeaf, unsigned char bit) const {
     if (bit & 1)
         *currLeaf = GetChunk(*currLeaf)->LeftLeaf;
     else
@@ -190,109 +296,468 @@ bool CTextHuffman::Read(HANDLE fileHandle) {
     return true;
 }
 
-bool CTextHuffman::Write(HANDLE hFile) {
-    if (hFile == INVALID_HANDLE_VALUE)
-        return false;
-    DWORD written = 0;
+bool CTextHuffman::Write(CTextFileWriter &file) const {
     unsigned int magic = 'HUFF';
-    return WriteFile(hFile, &magic, 4, &written, nullptr) &&
-        WriteFile(hFile, &m_nNumHuffmanChunks, 2, &written, nullptr) &&
-        WriteFile(hFile, &m_nRootLeaf, 2, &written, nullptr) &&
-        WriteFile(hFile, &m_nNumUniqueCharacters, 2, &written, nullptr) &&
-        WriteFile(hFile, m_pHuffChunks, 12 * m_nNumHuffmanChunks, &written, nullptr) &&
-        WriteFile(hFile, m_pCharactersInfo, 8 * m_nNumUniqueCharacters, &written, nullptr);
-}
-
-void CTextHuffman::GenerateHuffmanCodes(unsigned short nodeIndex, unsigned short &outIndex) {
-    CHuffChunk *chunk = GetChunk(nodeIndex);
-    if (chunk->IsLast() && m_pCharactersInfo && outIndex < m_nNumUniqueCharacters) {
-        CharacterInfo &info = m_pCharactersInfo[outIndex];
-        info.character = chunk->character;
-        info.codeBits = 0;
-        info.codeLength = 0;
-        unsigned short current = nodeIndex;
-        while (current != 0xFFFF) {
-            unsigned short parent = GetChunk(current)->ParentLeaf;
-            if (parent != 0xFFFF) {
-                CHuffChunk *parentChunk = GetChunk(parent);
-                if (parentChunk->LeftLeaf == current)
-                    info.codeBits |= (1 << info.codeLength);
-                ++info.codeLength;
+    return file.Write(&magic, 4) &&
+        file.Write(&m_nNumHuffmanChunks, 2) &&
+        file.Write(&m_nRootLeaf, 2) &&
+        file.Write(&m_nNumUniqueCharacters, 2) &&
+        file.Write(m_pHuffChunks, 12 * m_nNumHuffmanChunks) &&
+        file.Write(m_pCharactersInfo, 8 * m_nNumUniqueCharacters);
+}
+
+bool CTextHuffman::GenerateTreeCodes(std::vector<CharacterInfo> &codes) const {
+    codes.clear();
+    if (!m_pHuffChunks || m_nRootLeaf >= m_nNumHuffmanChunks)
+        return false;
+    struct PendingNode {
+        unsigned short index;
+        unsigned char codeLength;
+        unsigned int codeBits;
+    };
+    std::vector<PendingNode> pending = { { m_nRootLeaf, 0, 0 } };
+    unsigned int numVisited = 0;
+    while (!pending.empty()) {
+        PendingNode node = pending.back();
+        pending.pop_back();
+        if (++numVisited > m_nNumHuffmanChunks)
+            return false;
+        CHuffChunk const &chunk = m_pHuffChunks[node.index];
+        if (chunk.IsLast()) {
+            if (node.codeLength == 0)
+                return false;
+            CharacterInfo info;
+            info.character = chunk.character;
+            info.codeBits = node.codeBits;
+            info.codeLength = node.codeLength;
+            codes.push_back(info);
+            continue;
+        }
+        if (node.codeLength == CCanonicalHuffman::MAX_CODE_LENGTH ||
+            chunk.LeftLeaf >= m_nNumHuffmanChunks || chunk.RightLeaf >= m_nNumHuffmanChunks)
+        {
+            return false;
+        }
+        unsigned char childLength = node.codeLength + 1;
+        pending.push_back({ chunk.RightLeaf, childLength, node.codeBits << 1 });
+        pending.push_back({ chunk.LeftLeaf, childLength, (node.codeBits << 1) | 1 });
+    }
+    std::sort(codes.begin(), codes.end(), [](const CharacterInfo &a, const CharacterInfo &b) {
+        return a.character < b.character;
+        });
+    for (size_t i = 1; i < codes.size(); i++) {
+        if (codes[i].character == codes[i - 1].character)
+            return false;
+    }
+    return true;
+}
+
+bool CTextHuffman::GenerateCanonicalCodes() {
+    m_canonical.Clear();
+    std::vector<CharacterInfo> treeCodes;
+    if (!GenerateTreeCodes(treeCodes))
+        return false;
+    // the tree is only decoded with the canonical tables when it assigns exactly the canonical codes
+    std::vector<CharacterInfo> canonicalCodes = treeCodes;
+    if (!m_canonical.Build(canonicalCodes.data(), (unsigned int)canonicalCodes.size()))
+        return false;
+    for (size_t i = 0; i < treeCodes.size(); i++) {
+        if (canonicalCodes[i].codeBits != treeCodes[i].codeBits) {
+            m_canonical.Clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CTextHuffman::BuildTreeFromCodes(unsigned int const *frequencies) {
+    unsigned int numCharacters = m_nNumUniqueCharacters;
+    if (!m_pCharactersInfo || numCharacters < 2)
+        return false;
+    unsigned int numChunks = numCharacters * 2 - 1;
+    CHuffChunk *chunks = new CHuffChunk[numChunks];
+    unsigned short rootLeaf = numCharacters;
+    unsigned short nextNode = rootLeaf + 1;
+    for (unsigned short i = 0; i < numCharacters; i++) {
+        CharacterInfo const &info = m_pCharactersInfo[i];
+        chunks[i] = CHuffChunk(info.character, frequencies ? frequencies[i] : 0);
+        unsigned short node = rootLeaf;
+        for (int bit = info.codeLength - 1; bit >= 0; bit--) {
+            chunks[node].frequency += chunks[i].frequency;
+            unsigned short &child = ((info.codeBits >> bit) & 1) ? chunks[node].LeftLeaf : chunks[node].RightLeaf;
+            if (bit == 0) {
+                if (child != 0xFFFF) {
+                    delete[] chunks;
+                    return false;
+                }
+                child = i;
+                chunks[i].ParentLeaf = node;
+            }
+            else {
+                if (child == 0xFFFF) {
+                    if (nextNode >= numChunks) {
+                        delete[] chunks;
+                        return false;
+                    }
+                    child = nextNode++;
+                    chunks[child].ParentLeaf = node;
+                }
+                else if (child < numCharacters) {
+                    delete[] chunks;
+                    return false;
+                }
+                node = child;
             }
-            current = parent;
         }
-        outIndex++;
     }
-    else {
-        if (chunk->RightLeaf != 0xFFFF)
-            GenerateHuffmanCodes(chunk->RightLeaf, outIndex);
-        if (chunk->LeftLeaf != 0xFFFF)
-            GenerateHuffmanCodes(chunk->LeftLeaf, outIndex);
+    if (nextNode != numChunks) {
+        delete[] chunks;
+        return false;
     }
+    delete[] m_pHuffChunks;
+    m_pHuffChunks = chunks;
+    m_nNumHuffmanChunks = numChunks;
+    m_nRootLeaf = rootLeaf;
+    return true;
 }
 
 bool CTextHuffman::Pack(unsigned int *characterMap) {
     Clear();
     if (!characterMap)
         return false;
+    std::vector<unsigned int> frequencies;
+    std::vector<wchar_t> characters;
     for (unsigned int c = 0; c < 65536; c++) {
-        if (characterMap[c])
-            m_nNumUniqueCharacters++;
+        if (characterMap[c]) {
+            characters.push_back((wchar_t)c);
+            frequencies.push_back(characterMap[c]);
+        }
     }
-    if (m_nNumUniqueCharacters < 2 || m_nNumUniqueCharacters >= 32768)
+    unsigned int numCharacters = (unsigned int)characters.size();
+    if (numCharacters < 2 || numCharacters >= 32768)
         return false;
-    m_nNumHuffmanChunks = m_nNumUniqueCharacters;
-    m_pHuffChunks = new CHuffChunk[m_nNumUniqueCharacters * 2];
-    std::list<unsigned short> huffList;
-    unsigned int leafNumber = 0;
-    for (unsigned int c = 0; c < 65536; c++) {
-        if (characterMap[c]) {
-            m_pHuffChunks[leafNumber] = CHuffChunk(c, characterMap[c]);
-            huffList.push_back(leafNumber);
-            leafNumber++;
+    // the Huffman tree is only needed for the code lengths - the codes and the tree which is
+    // written to the file are generated from the lengths in canonical form
+    unsigned int numNodes = numCharacters * 2 - 1;
+    std::vector<unsigned int> weights(numNodes, 0);
+    std::vector<unsigned short> parents(numNodes, 0xFFFF);
+    std::vector<unsigned short> sortedLeaves(numCharacters);
+    for (unsigned short i = 0; i < numCharacters; i++) {
+        weights[i] = frequencies[i];
+        sortedLeaves[i] = i;
+    }
+    std::stable_sort(sortedLeaves.begin(), sortedLeaves.end(), [&](unsigned short a, unsigned short b) {
+        return weights[a] < weights[b];
+        });
+    // internal nodes are created in non-decreasing weight order, so two queues are enough
+    unsigned int nextLeaf = 0;
+    unsigned int nextInternal = numCharacters;
+    unsigned int nextNode = numCharacters;
+    auto PopLightest = [&]() -> unsigned short {
+        if (nextLeaf < numCharacters && (nextInternal == nextNode || weights[sortedLeaves[nextLeaf]] <= weights[nextInternal]))
+            return sortedLeaves[nextLeaf++];
+        return nextInternal++;
+    };
+    for (; nextNode < numNodes; nextNode++) {
+        unsigned short right = PopLightest();
+        unsigned short left = PopLightest();
+        weights[nextNode] = weights[right] + weights[left];
+        parents[right] = nextNode;
+        parents[left] = nextNode;
+    }
+    std::vector<unsigned short> codeLengths(numNodes, 0);
+    for (int i = numNodes - 2; i >= 0; i--)
+        codeLengths[i] = codeLengths[parents[i]] + 1;
+    CCanonicalHuffman::LimitCodeLengths(codeLengths.data(), frequencies.data(), numCharacters);
+    m_nNumUniqueCharacters = numCharacters;
+    m_pCharactersInfo = new CharacterInfo[numCharacters];
+    for (unsigned int i = 0; i < numCharacters; i++) {
+        m_pCharactersInfo[i].character = characters[i];
+        m_pCharactersInfo[i].codeLength = (unsigned char)codeLengths[i];
+    }
+    if (!m_canonical.Build(m_pCharactersInfo, numCharacters) || !BuildTreeFromCodes(frequencies.data())) {
+        Clear();
+        return false;
+    }
+    return true;
+}
+
+void CCanonicalHuffman::Clear() {
+    m_symbols.clear();
+    m_lookup.clear();
+    memset(m_firstCode, 0, sizeof(m_firstCode));
+    memset(m_firstSymbol, 0, sizeof(m_firstSymbol));
+    memset(m_numCodes, 0, sizeof(m_numCodes));
+    m_nMaxCodeLength = 0;
+}
+
+bool CCanonicalHuffman::IsValid() const {
+    return m_nMaxCodeLength != 0;
+}
+
+bool CCanonicalHuffman::Build(CharacterInfo *characters, unsigned int numCharacters) {
+    // characters must be sorted by character, codeLength must be set
+    Clear();
+    if (!characters || numCharacters < 2)
+        return false;
+    unsigned char maxCodeLength = 0;
+    for (unsigned int i = 0; i < numCharacters; i++) {
+        unsigned char codeLength = characters[i].codeLength;
+        if (codeLength == 0 || codeLength > MAX_CODE_LENGTH)
+            return false;
+        m_numCodes[codeLength]++;
+        if (codeLength > maxCodeLength)
+            maxCodeLength = codeLength;
+    }
+    unsigned long long code = 0;
+    unsigned int symbolIndex = 0;
+    unsigned int nextSymbol[MAX_CODE_LENGTH + 1] = {};
+    for (unsigned char length = 1; length <= maxCodeLength; length++) {
+        code = (code + m_numCodes[length - 1]) << 1;
+        if (code + m_numCodes[length] > (1ull << length)) {
+            Clear();
+            return false;
+        }
+        m_firstCode[length] = (unsigned int)code;
+        m_firstSymbol[length] = symbolIndex;
+        nextSymbol[length] = symbolIndex;
+        symbolIndex += m_numCodes[length];
+    }
+    // an incomplete code would leave dangling branches in the tree written for the game
+    if (code + m_numCodes[maxCodeLength] != (1ull << maxCodeLength)) {
+        Clear();
+        return false;
+    }
+    m_symbols.resize(numCharacters);
+    for (unsigned int i = 0; i < numCharacters; i++) {
+        unsigned char codeLength = characters[i].codeLength;
+        unsigned int position = nextSymbol[codeLength]++;
+        m_symbols[position] = characters[i].character;
+        characters[i].codeBits = m_firstCode[codeLength] + (position - m_firstSymbol[codeLength]);
+    }
+    // the stream holds the first bit of a code in its lowest bit, so the lookup index is the reversed code
+    // followed by every combination of the bits after it
+    m_lookup.assign(1 << LOOKUP_BITS, 0);
+    for (unsigned int symbol = 0; symbol < numCharacters; symbol++) {
+        unsigned char codeLength = 1;
+        while (symbol >= m_firstSymbol[codeLength] + m_numCodes[codeLength])
+            codeLength++;
+        if (codeLength > LOOKUP_BITS)
+            break;
+        unsigned int codeBits = m_firstCode[codeLength] + (symbol - m_firstSymbol[codeLength]);
+        unsigned int reversed = 0;
+        for (unsigned char b = 0; b < codeLength; b++)
+            reversed |= ((codeBits >> b) & 1) << (codeLength - 1 - b);
+        for (unsigned int index = reversed; index < (1u << LOOKUP_BITS); index += 1 << codeLength)
+            m_lookup[index] = (symbol << 8) | codeLength;
+    }
+    m_nMaxCodeLength = maxCodeLength;
+    return true;
+}
+
+void CCanonicalHuffman::LimitCodeLengths(unsigned short *codeLengths, unsigned int const *frequencies, unsigned int numCharacters) {
+    unsigned short maxCodeLength = 0;
+    for (unsigned int i = 0; i < numCharacters; i++) {
+        if (codeLengths[i] > maxCodeLength)
+            maxCodeLength = codeLengths[i];
+    }
+    if (maxCodeLength <= MAX_CODE_LENGTH)
+        return;
+    // move the deepest pairs of leaves up (JPEG, Annex K.3) - this keeps the code complete
+    std::vector<unsigned int> counts(maxCodeLength + 1, 0);
+    for (unsigned int i = 0; i < numCharacters; i++)
+        counts[codeLengths[i]]++;
+    for (unsigned int length = maxCodeLength; length > MAX_CODE_LENGTH; length--) {
+        while (counts[length] > 0) {
+            unsigned int shorter = length - 2;
+            while (shorter > 0 && counts[shorter] == 0)
+                shorter--;
+            if (shorter == 0)
+                break;
+            counts[length] -= 2;
+            counts[length - 1]++;
+            counts[shorter + 1] += 2;
+            counts[shorter]--;
         }
     }
-    huffList.sort([&](unsigned short a, unsigned short b) {
-        return m_pHuffChunks[a].frequency < m_pHuffChunks[b].frequency;
+    // the most frequent characters get the shortest codes
+    std::vector<unsigned int> order(numCharacters);
+    for (unsigned int i = 0; i < numCharacters; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) {
+        return frequencies[a] > frequencies[b];
         });
-    while (huffList.size() > 1) {
-        CHuffChunk &parent = m_pHuffChunks[m_nNumHuffmanChunks];
-        parent.character = 0;
-        parent.ParentLeaf = 0xFFFF;
-        unsigned short rightIdx = huffList.front(); huffList.pop_front();
-        unsigned short leftIdx = huffList.front(); huffList.pop_front();
-        parent.RightLeaf = rightIdx;
-        parent.LeftLeaf = leftIdx;
-        CHuffChunk *right = GetChunk(rightIdx);
-        CHuffChunk *left = GetChunk(leftIdx);
-        parent.frequency = right->frequency + left->frequency;
-        right->ParentLeaf = m_nNumHuffmanChunks;
-        left->ParentLeaf = m_nNumHuffmanChunks;
-        auto insertIt = huffList.begin();
-        while (insertIt != huffList.end()) {
-            CHuffChunk &node = m_pHuffChunks[*insertIt];
-            if (node.frequency > parent.frequency)
+    unsigned short length = 1;
+    for (unsigned int i : order) {
+        while (length < maxCodeLength && counts[length] == 0)
+            length++;
+        codeLengths[i] = length;
+        counts[length]--;
+    }
+}
+
+void CTextUTF8Table::Build(CTextHuffman const &huffman, wchar_t separator, std::vector<std::pair<std::wstring, std::wstring>> const &replacements,
+    std::map<wchar_t, wchar_t> const &charmap)
+{
+    auto MakeEntry = [&](wchar_t ch) {
+        Entry entry;
+        if (ch == 0) {
+            entry.flags = FLAG_END;
+            return entry;
+        }
+        auto it = charmap.find(ch);
+        if (it != charmap.end())
+            ch = it->second;
+        entry.character = ch;
+        // the first key starting with the character decides, as in ReplaceAll; a two-character key only
+        // works here if it gives the same text as the character alone
+        std::wstring const *single = nullptr;
+        std::vector<std::pair<std::wstring, std::wstring> const *> pairs;
+        bool slow = false;
+        for (auto const &replacement : replacements) {
+            std::wstring const &key = replacement.first;
+            if (key.empty() || key[0] != ch)
+                continue;
+            if (key.size() == 1) {
+                single = &replacement.second;
                 break;
-            ++insertIt;
+            }
+            if (key.size() == 2)
+                pairs.push_back(&replacement);
+            else
+                slow = true;
+        }
+        std::wstring text = single ? *single : std::wstring(1, ch);
+        if (pairs.size() > 1 || (pairs.size() == 1 && pairs[0]->second != text))
+            slow = true;
+        else if (pairs.size() == 1) {
+            entry.flags |= FLAG_SKIP_NEXT;
+            entry.skipNext = pairs[0]->first[1];
         }
-        huffList.insert(insertIt, m_nNumHuffmanChunks);
-        ++m_nNumHuffmanChunks;
+        for (wchar_t c : text) {
+            if (c == L'\r' || c == L'\n' || c == L'"' || c == separator || (c >= 0xD800 && c <= 0xDFFF))
+                slow = true;
+        }
+        std::string bytes = ToUTF8(text);
+        if (slow || bytes.size() > sizeof(entry.bytes))
+            entry.flags = FLAG_SLOW;
+        else {
+            memcpy(entry.bytes, bytes.data(), bytes.size());
+            entry.length = (unsigned char)bytes.size();
+        }
+        return entry;
+    };
+    m_entries.clear();
+    m_bBySymbol = huffman.m_canonical.IsValid();
+    if (m_bBySymbol) {
+        for (wchar_t ch : huffman.m_canonical.m_symbols)
+            m_entries.push_back(MakeEntry(ch));
     }
-    if (m_nNumHuffmanChunks < 2 * m_nNumUniqueCharacters) {
-        CHuffChunk *newChunks = new CHuffChunk[m_nNumHuffmanChunks];
-        memcpy(newChunks, m_pHuffChunks, m_nNumHuffmanChunks * sizeof(CHuffChunk));
-        delete[] m_pHuffChunks;
-        m_pHuffChunks = newChunks;
+    else {
+        m_entries.resize(huffman.m_nNumHuffmanChunks);
+        for (unsigned short i = 0; i < huffman.m_nNumHuffmanChunks; i++) {
+            CHuffChunk const *chunk = huffman.GetChunk(i);
+            if (chunk->IsLast())
+                m_entries[i] = MakeEntry(chunk->character);
+        }
     }
-    m_nRootLeaf = huffList.front();
-    huffList.clear();
-    m_pCharactersInfo = new CharacterInfo[m_nNumUniqueCharacters];
-    unsigned short nextCharacterIndex = 0;
-    GenerateHuffmanCodes(m_nRootLeaf, nextCharacterIndex);
-    std::sort(m_pCharactersInfo, m_pCharactersInfo + m_nNumUniqueCharacters, [](const CharacterInfo &a, const CharacterInfo &b) {
-        return a.character < b.character;
-    });
-    return true;
+}
+
+void CTextStringArena::Reserve(size_t numStrings, size_t numCharacters) {
+    m_entries.reserve(numStrings);
+    m_data.reserve(numCharacters);
+}
+
+void CTextStringArena::Add(unsigned int hash, std::wstring_view str) {
+    m_entries.push_back({ hash, (unsigned int)m_data.size(), (unsigned int)str.size() });
+    m_data.insert(m_data.end(), str.begin(), str.end());
+    m_data.push_back(0);
+}
+
+std::wstring_view CTextStringArena::Get(Entry const &entry) const {
+    return std::wstring_view(&m_data[entry.offset], entry.length);
+}
+
+wchar_t const *CTextStringArena::GetCStr(Entry const &entry) const {
+    return &m_data[entry.offset];
+}
+
+size_t CTextStringArena::Size() const {
+    return m_entries.size();
+}
+
+void CTextStringArena::SortAndDeduplicate() {
+    auto HashLess = [](Entry const &a, Entry const &b) {
+        return a.hash < b.hash;
+    };
+    if (!std::is_sorted(m_entries.begin(), m_entries.end(), HashLess)) {
+        // LSD radix sort by bytes of the hash; stable, so the first added entry stays first
+        std::vector<Entry> sorted(m_entries.size());
+        for (unsigned int shift = 0; shift < 32; shift += 8) {
+            size_t offsets[257] = {};
+            for (auto const &entry : m_entries)
+                offsets[((entry.hash >> shift) & 0xFF) + 1]++;
+            if (std::find(std::begin(offsets), std::end(offsets), m_entries.size()) != std::end(offsets))
+                continue;
+            for (unsigned int digit = 1; digit < 257; digit++)
+                offsets[digit] += offsets[digit - 1];
+            for (auto const &entry : m_entries)
+                sorted[offsets[(entry.hash >> shift) & 0xFF]++] = entry;
+            m_entries.swap(sorted);
+        }
+    }
+    m_entries.erase(std::unique(m_entries.begin(), m_entries.end(), [](Entry const &a, Entry const &b) {
+        return a.hash == b.hash;
+        }), m_entries.end());
+}
+
+void CTextStringArena::Clear() {
+    m_entries.clear();
+    m_entries.shrink_to_fit();
+    m_data.clear();
+    m_data.shrink_to_fit();
+}
+
+void CTextStringCache::Trim() {
+    while (m_nUsedBytes > m_nMaxBytes && !m_entries.empty()) {
+        m_nUsedBytes -= m_entries.back().size;
+        m_lookup.erase(m_entries.back().key);
+        m_entries.pop_back();
+    }
+}
+
+void CTextStringCache::SetMaxBytes(size_t maxBytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_nMaxBytes = maxBytes;
+    Trim();
+}
+
+std::shared_ptr<std::wstring const> CTextStringCache::Find(unsigned int key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_lookup.find(key);
+    if (it == m_lookup.end())
+        return nullptr;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return it->second->value;
+}
+
+void CTextStringCache::Add(unsigned int key, std::shared_ptr<std::wstring const> const &value) {
+    // the size includes the list node and the lookup entry, strings larger than the cache are not stored
+    size_t size = (value->size() + 1) * sizeof(wchar_t) + sizeof(Entry) + 64;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (size > m_nMaxBytes || m_lookup.contains(key))
+        return;
+    m_entries.push_front({ key, value, size });
+    m_lookup[key] = m_entries.begin();
+    m_nUsedBytes += size;
+    Trim();
+}
+
+void CTextStringCache::Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_lookup.clear();
+    m_nUsedBytes = 0;
 }
 
 CText::~CText() {
@@ -310,26 +775,41 @@ unsigned int CText::GetHash(const char *str) {
     return result;
 }
 
-void CText::AllocateTempStrings() {
-    if (m_nMaxStringLength) {
-        for (int i = 0; i < 32; i++) {
-            delete[] m_pTempStrings[i];
-            m_pTempStrings[i] = new wchar_t[m_nMaxStringLength + 1]();
-        }
+unsigned int CText::GetHash(std::wstring_view str, unsigned int prefixHash) {
+    unsigned int result = prefixHash;
+    for (wchar_t c : str) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (!byte)
+            break;
+        result = (result << 16) + (result << 6) + byte - result;
     }
+    return result;
+}
+
+void CText::GetHashes(std::wstring_view const *strs, size_t count, unsigned int *outHashes, unsigned int prefixHash) {
+    if (!strs || !outHashes)
+        return;
+    ParallelFor(count, [=](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            outHashes[i] = GetHash(strs[i], prefixHash);
+    }, 16384);
 }
 
 void CText::Clear() {
     delete[] m_pStringHashes;
     m_pStringHashes = nullptr;
-    for (int i = 0; i < 32; i++) {
-        delete[] m_pTempStrings[i];
-        m_pTempStrings[i] = nullptr;
-    }
     m_game = GAME_NOTSET;
     m_nMaxStringLength = 0;
     m_nNumStringHashes = 0;
-    m_nTempStringsCounter = 0;
+    m_nNumUniqueStrings = 0;
+    m_nNumSharedStrings = 0;
+    m_nNumSharedBits = 0;
+    m_nNumSuffixStrings = 0;
+    m_nNumSuffixBits = 0;
+    m_bStringHashesSorted = false;
+    m_bValidated = false;
+    m_stringCache.Clear();
+    m_characterMap.clear();
     m_mbStrings.Clear();
     m_huffmanInfo.Clear();
 }
@@ -344,17 +824,11 @@ unsigned __int64 GetBytesLeftToRead(HANDLE file) {
     return fileSize.QuadPart - currentPos.QuadPart;
 }
 
-bool CText::LoadTranslationsFile(wchar_t const *filePath, eGame game) {
-    if (!filePath || !*filePath)
-        return false;
-    Clear();
-    m_game = game;
+template<eGame Game>
+bool CText::ReadTranslations(HANDLE file) {
+    using Traits = CTextFormat<Game>;
     DWORD bytesRead = 0;
-    HANDLE file = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-    if (file == INVALID_HANDLE_VALUE)
-        return false;
-    bool success = false;
-    if (game == GAME_FM09) {
+    if constexpr (Traits::HAS_HEADER) {
         unsigned int magic = 0;
         unsigned int version = 0;
         if (ReadFile(file, &magic, 4, &bytesRead, nullptr) && magic == 'BFLC' &&
@@ -366,118 +840,176 @@ bool CText::LoadTranslationsFile(wchar_t const *filePath, eGame game) {
             ReadFile(file, &m_nNumStringHashes, 4, &bytesRead, nullptr))
         {
             m_pStringHashes = new CStringHash[m_nNumStringHashes];
-            success = ReadFile(file, m_pStringHashes, 8 * m_nNumStringHashes, &bytesRead, nullptr);
+            return ReadFile(file, m_pStringHashes, 8 * m_nNumStringHashes, &bytesRead, nullptr);
         }
+        return false;
     }
     else {
-        if (ReadFile(file, &m_nMaxStringLength, 4, &bytesRead, nullptr) &&
-            ReadFile(file, &m_nNumStringHashes, 4, &bytesRead, nullptr))
+        if (!ReadFile(file, &m_nMaxStringLength, 4, &bytesRead, nullptr) ||
+            !ReadFile(file, &m_nNumStringHashes, 4, &bytesRead, nullptr))
         {
-            m_nMaxStringLength -= 1;
-            m_pStringHashes = new CStringHash[m_nNumStringHashes];
-            if (ReadFile(file, m_pStringHashes, 8 * m_nNumStringHashes, &bytesRead, nullptr) &&
-                ReadFile(file, &m_huffmanInfo.m_nNumHuffmanChunks, 2, &bytesRead, nullptr) &&
-                ReadFile(file, &m_huffmanInfo.m_nRootLeaf, 2, &bytesRead, nullptr))
-            {
-                unsigned int NodeArraySize = (game == GAME_TCM2005) ? 256 : 512;
-                unsigned int MbStringsSizeInBits = 0;
-                CHuffChunk *huffChunks = new CHuffChunk[NodeArraySize];
-                if (ReadFile(file, huffChunks, NodeArraySize * 12, &bytesRead, nullptr) &&
-                    ReadFile(file, &m_mbStrings.m_bitOffset, 4, &bytesRead, nullptr) &&
-                    ReadFile(file, &MbStringsSizeInBits, 4, &bytesRead, nullptr) &&
-                    ReadFile(file, &m_mbStrings.m_nRuntimeDataPtr, 4, &bytesRead, nullptr))
-                {
-                    m_mbStrings.m_nDataSize = (unsigned int)GetBytesLeftToRead(file);
-                    m_mbStrings.m_nTotalLength = (MbStringsSizeInBits + 7) / 8 + ((m_game == GAME_TCM2005) ? 0xC10 : 0x1810);
-                    m_huffmanInfo.m_pHuffChunks = new CHuffChunk[m_huffmanInfo.m_nNumHuffmanChunks];
-                    memcpy(m_huffmanInfo.m_pHuffChunks, huffChunks, m_huffmanInfo.m_nNumHuffmanChunks * 12);
-                    for (unsigned int i = 0; i < m_huffmanInfo.m_nNumHuffmanChunks; i++)
-                        m_huffmanInfo.m_pHuffChunks[i].character &= 0xFF;
-                    m_mbStrings.m_pData = new unsigned char[m_mbStrings.m_nDataSize];
-                    success = m_mbStrings.m_pData && ReadFile(file, m_mbStrings.m_pData, m_mbStrings.m_nDataSize, &bytesRead, nullptr);
-                }
-                delete[] huffChunks;
-            }
+            return false;
+        }
+        m_nMaxStringLength -= 1;
+        m_pStringHashes = new CStringHash[m_nNumStringHashes];
+        if (!ReadFile(file, m_pStringHashes, 8 * m_nNumStringHashes, &bytesRead, nullptr) ||
+            !ReadFile(file, &m_huffmanInfo.m_nNumHuffmanChunks, 2, &bytesRead, nullptr) ||
+            !ReadFile(file, &m_huffmanInfo.m_nRootLeaf, 2, &bytesRead, nullptr) ||
+            m_huffmanInfo.m_nNumHuffmanChunks > Traits::NUM_TREE_NODES)
+        {
+            return false;
+        }
+        CHuffChunk huffChunks[Traits::NUM_TREE_NODES];
+        unsigned int MbStringsSizeInBits = 0;
+        if (!ReadFile(file, huffChunks, Traits::NUM_TREE_NODES * 12, &bytesRead, nullptr) ||
+            !ReadFile(file, &m_mbStrings.m_bitOffset, 4, &bytesRead, nullptr) ||
+            !ReadFile(file, &MbStringsSizeInBits, 4, &bytesRead, nullptr) ||
+            !ReadFile(file, &m_mbStrings.m_nRuntimeDataPtr, 4, &bytesRead, nullptr))
+        {
+            return false;
         }
+        m_mbStrings.m_nDataSize = (unsigned int)GetBytesLeftToRead(file);
+        m_mbStrings.m_nTotalLength = (MbStringsSizeInBits + 7) / 8 + Traits::TOTAL_LENGTH_EXTRA;
+        m_huffmanInfo.m_pHuffChunks = new CHuffChunk[m_huffmanInfo.m_nNumHuffmanChunks];
+        memcpy(m_huffmanInfo.m_pHuffChunks, huffChunks, m_huffmanInfo.m_nNumHuffmanChunks * 12);
+        for (unsigned int i = 0; i < m_huffmanInfo.m_nNumHuffmanChunks; i++)
+            m_huffmanInfo.m_pHuffChunks[i].character &= Traits::CHARACTER_MASK;
+        m_mbStrings.m_pData = new unsigned char[m_mbStrings.m_nDataSize];
+        return m_mbStrings.m_pData && ReadFile(file, m_mbStrings.m_pData, m_mbStrings.m_nDataSize, &bytesRead, nullptr);
     }
+}
+
+bool CText::LoadTranslationsFile(wchar_t const *filePath, eGame game, bool checkStrings) {
+    if (!filePath || !*filePath)
+        return false;
+    Clear();
+    m_loadError.clear();
+    m_game = game;
+    HANDLE file = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    bool success = DispatchGame(game, [this, file]<eGame Game>() {
+        return ReadTranslations<Game>(file);
+    });
     CloseHandle(file);
     if (!success)
         Clear();
-    else
-        AllocateTempStrings();
+    else {
+        m_bStringHashesSorted = std::is_sorted(m_pStringHashes, m_pStringHashes + m_nNumStringHashes, [](CStringHash const &a, CStringHash const &b) {
+            return a.key < b.key;
+            });
+        m_huffmanInfo.GenerateCanonicalCodes();
+        success = Validate(checkStrings);
+        if (!success)
+            Clear();
+    }
     return success;
 }
 
 bool CText::WriteTranslationsFile(wchar_t const *filePath) {
     if (!filePath || !*filePath)
         return false;
-    HANDLE file = CreateFileW(filePath, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
-    if (file == INVALID_HANDLE_VALUE)
+    CTextFileWriter file;
+    if (!file.Open(filePath))
+        return false;
+    bool success = WriteTranslations(file, nullptr);
+    return file.Close() && success;
+}
+
+bool CText::WriteTranslationsFile(wchar_t const *filePath, std::vector<std::wstring_view> const &encodeOrder) {
+    if (!filePath || !*filePath)
+        return false;
+    CTextFileWriter file;
+    if (!file.Open(filePath))
         return false;
-    DWORD written = 0;
-    bool success = false;
-    if (m_game == GAME_FM09) {
+    bool success = WriteTranslations(file, &encodeOrder);
+    return file.Close() && success;
+}
+
+template<eGame Game>
+bool CText::WriteTranslations(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const {
+    using Traits = CTextFormat<Game>;
+    if constexpr (Traits::HAS_HEADER) {
         unsigned int magic = 'BFLC';
         unsigned int version = 1;
-        if (WriteFile(file, &magic, 4, &written, nullptr) &&
-            WriteFile(file, &version, 4, &written, nullptr) &&
-            WriteFile(file, &m_nLanguageID, 4, &written, nullptr) &&
-            WriteFile(file, &m_nMaxStringLength, 4, &written, nullptr) &&
+        unsigned int mbMagic = 'MBST';
+        unsigned int byteSize = (m_mbStrings.m_bitOffset / 8) + 1;
+        return file.Write(&magic, 4) &&
+            file.Write(&version, 4) &&
+            file.Write(&m_nLanguageID, 4) &&
+            file.Write(&m_nMaxStringLength, 4) &&
             m_huffmanInfo.Write(file) &&
-            m_mbStrings.Write(file) &&
-            WriteFile(file, &m_nNumStringHashes, 4, &written, nullptr) &&
-            WriteFile(file, m_pStringHashes, m_nNumStringHashes * sizeof(CStringHash), &written, nullptr))
-        {
-            success = true;
-        }
+            file.Write(&mbMagic, 4) &&
+            file.Write(&m_mbStrings.m_bitOffset, 4) &&
+            file.Write(&byteSize, 4) &&
+            WriteStringsData(file, encodeOrder) &&
+            file.Write(&m_nNumStringHashes, 4) &&
+            file.Write(m_pStringHashes, m_nNumStringHashes * sizeof(CStringHash));
     }
     else {
         unsigned int maxLengthWithTerminator = m_nMaxStringLength + 1;
-        if (WriteFile(file, &maxLengthWithTerminator, 4, &written, nullptr) &&
-            WriteFile(file, &m_nNumStringHashes, 4, &written, nullptr) &&
-            WriteFile(file, m_pStringHashes, 8 * m_nNumStringHashes, &written, nullptr) &&
-            WriteFile(file, &m_huffmanInfo.m_nNumHuffmanChunks, 2, &written, nullptr) &&
-            WriteFile(file, &m_huffmanInfo.m_nRootLeaf, 2, &written, nullptr))
-        {
-            unsigned int NodeArraySize = (m_game == GAME_TCM2005) ? 256 : 512;
-            CHuffChunk *huffChunks = new CHuffChunk[NodeArraySize];
-            memset(huffChunks, 0, NodeArraySize * 12);
-            memcpy(huffChunks, m_huffmanInfo.m_pHuffChunks, m_huffmanInfo.m_nNumHuffmanChunks * 12);
-            unsigned int MbStringsSizeInBits = (m_mbStrings.m_nTotalLength - ((m_game == GAME_TCM2005) ? 0xC10 : 0x1810)) * 8;
-            unsigned int byteSize = (m_mbStrings.m_bitOffset / 8) + 1;
-            if (WriteFile(file, huffChunks, NodeArraySize * 12, &written, nullptr) &&
-                WriteFile(file, &MbStringsSizeInBits, 4, &written, nullptr) &&
-                WriteFile(file, &m_mbStrings.m_bitOffset, 4, &written, nullptr) &&
-                WriteFile(file, &m_mbStrings.m_nRuntimeDataPtr, 4, &written, nullptr))
-            {
-                if (m_mbStrings.m_bitOffset == 0) {
-                    unsigned char data = 0;
-                    success = WriteFile(file, &data, 1, &written, nullptr);
-                }
-                else
-                    success = WriteFile(file, m_mbStrings.m_pData, byteSize, &written, nullptr);
-            }
-            delete[] huffChunks;
-        }
+        // the game reads a fixed-size node array, unused nodes are zeroed
+        unsigned int numChunks = (m_huffmanInfo.m_nNumHuffmanChunks < Traits::NUM_TREE_NODES) ? m_huffmanInfo.m_nNumHuffmanChunks : Traits::NUM_TREE_NODES;
+        unsigned int MbStringsSizeInBits = (m_mbStrings.m_nTotalLength - Traits::TOTAL_LENGTH_EXTRA) * 8;
+        return file.Write(&maxLengthWithTerminator, 4) &&
+            file.Write(&m_nNumStringHashes, 4) &&
+            file.Write(m_pStringHashes, 8 * m_nNumStringHashes) &&
+            file.Write(&m_huffmanInfo.m_nNumHuffmanChunks, 2) &&
+            file.Write(&m_huffmanInfo.m_nRootLeaf, 2) &&
+            file.Write(m_huffmanInfo.m_pHuffChunks, numChunks * 12) &&
+            file.WriteZeros((Traits::NUM_TREE_NODES - numChunks) * 12) &&
+            file.Write(&MbStringsSizeInBits, 4) &&
+            file.Write(&m_mbStrings.m_bitOffset, 4) &&
+            file.Write(&m_mbStrings.m_nRuntimeDataPtr, 4) &&
+            WriteStringsData(file, encodeOrder);
     }
-    CloseHandle(file);
-    return success;
 }
 
-bool CText::IsKeyPresent(char const *key) {
-    return GetByHashKey(GetHash(key)) != 0;
+bool CText::WriteTranslations(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const {
+    return DispatchGame(m_game, [this, &file, encodeOrder]<eGame Game>() {
+        return WriteTranslations<Game>(file, encodeOrder);
+    });
+}
+
+bool CText::WriteStringsData(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const {
+    unsigned int byteSize = (m_mbStrings.m_bitOffset / 8) + 1;
+    if (!encodeOrder) {
+        if (m_mbStrings.m_bitOffset == 0)
+            return file.WriteZeros(1);
+        return file.Write(m_mbStrings.m_pData, byteSize);
+    }
+    std::vector<unsigned int> reversedCodes(65536, 0);
+    std::vector<unsigned char> codeLengths(65536, 0);
+    for (unsigned int i = 0; i < m_huffmanInfo.m_nNumUniqueCharacters; i++) {
+        CharacterInfo const &info = m_huffmanInfo.m_pCharactersInfo[i];
+        unsigned int reversed = 0;
+        for (unsigned char b = 0; b < info.codeLength; b++)
+            reversed |= ((info.codeBits >> b) & 1) << (info.codeLength - 1 - b);
+        reversedCodes[info.character] = reversed;
+        codeLengths[info.character] = info.codeLength;
+    }
+    for (std::wstring_view str : *encodeOrder) {
+        for (wchar_t ch : str)
+            file.WriteReversedBits(reversedCodes[ch], codeLengths[ch]);
+        file.WriteReversedBits(reversedCodes[0], codeLengths[0]);
+    }
+    return file.FlushBits() && file.WriteZeros(byteSize - (m_mbStrings.m_bitOffset + 7) / 8);
+}
+
+bool CText::IsKeyPresent(char const *key) const {
+    return FindStringHash(GetHash(key)) != nullptr;
 }
 
-wchar_t const *CText::Get(char const *key) {
+wchar_t const *CText::Get(char const *key) const {
     return GetByKeyName(key);
 }
 
-wchar_t const *CText::GetByKeyName(char const *key) {
+wchar_t const *CText::GetByKeyName(char const *key) const {
     if (!key)
         return nullptr;
     wchar_t const *str = GetByHashKey(GetHash(key));
     if (!str) {
-        static wchar_t buf[4096];
+        thread_local wchar_t buf[4096];
         buf[0] = L'\0';
         wcscpy(buf, AtoW(key).c_str());
         return buf;
@@ -485,46 +1017,356 @@ wchar_t const *CText::GetByKeyName(char const *key) {
     return str;
 }
 
-wchar_t const *CText::GetByHashKey(unsigned int hashKey) {
+CStringHash const *CText::FindStringHash(unsigned int hashKey) const {
+    if (!m_pStringHashes)
+        return nullptr;
+    CStringHash *end = &m_pStringHashes[m_nNumStringHashes];
+    CStringHash *it = nullptr;
+    if (m_bStringHashesSorted) {
+        it = std::lower_bound(m_pStringHashes, end, hashKey, [](CStringHash const &s, unsigned int key) {
+            return s.key < key;
+            });
+    }
+    else {
+        it = std::find_if(m_pStringHashes, end, [hashKey](CStringHash const &s) {
+            return s.key == hashKey;
+            });
+    }
+    if (it == end || it->key != hashKey)
+        return nullptr;
+    return it;
+}
+
+wchar_t const *CText::GetByHashKey(unsigned int hashKey) const {
     if (!m_pStringHashes || !m_nMaxStringLength)
         return nullptr;
-    auto it = std::find_if(m_pStringHashes, &m_pStringHashes[m_nNumStringHashes], [hashKey](CStringHash &s) {
-        return s.key == hashKey;
-        });
-    if (it == &m_pStringHashes[m_nNumStringHashes])
+    CStringHash const *it = FindStringHash(hashKey);
+    if (!it)
+        return nullptr;
+    // every thread has its own ring of strings, so a string returned to one thread isn't overwritten by the others
+    thread_local std::vector<wchar_t> tempStrings[32];
+    thread_local unsigned int tempStringsCounter = 0;
+    std::vector<wchar_t> &outStr = tempStrings[tempStringsCounter++ % 32];
+    if (outStr.size() < m_nMaxStringLength + 1)
+        outStr.resize(m_nMaxStringLength + 1);
+    DecodeString(it->offset, outStr.data());
+    return outStr.data();
+}
+
+std::shared_ptr<std::wstring const> CText::GetShared(unsigned int hashKey) const {
+    auto value = m_stringCache.Find(hashKey);
+    if (value)
+        return value;
+    CStringHash const *it = FindStringHash(hashKey);
+    if (!it)
         return nullptr;
-    wchar_t *outStr = m_pTempStrings[m_nTempStringsCounter++];
-    if (m_nTempStringsCounter == 32)
-        m_nTempStringsCounter = 0;
-    wchar_t *pStr = outStr;
-    unsigned int bitOffset = it->offset;
-    for (unsigned int i = 0; i < m_nMaxStringLength; i++) {
-        unsigned short leaf = m_huffmanInfo.GetRootLeaf();
-        while (true) {
-            unsigned char bit = m_mbStrings.GetBitAt(bitOffset++);
-            CHuffChunk *chunk = m_huffmanInfo.GetNextLeaf(&leaf, bit);
-            if (chunk->IsLast()) {
-                *pStr = chunk->character;
+    thread_local std::vector<wchar_t> buf;
+    if (buf.size() < m_nMaxStringLength + 1)
+        buf.resize(m_nMaxStringLength + 1);
+    unsigned int length = DecodeString(it->offset, buf.data());
+    value = std::make_shared<std::wstring const>(buf.data(), length);
+    m_stringCache.Add(hashKey, value);
+    return value;
+}
+
+bool CText::Validate(bool checkStrings) {
+    m_bValidated = false;
+    // a file without strings is never decoded, its tree is empty
+    if (m_nNumStringHashes == 0) {
+        m_bValidated = true;
+        return true;
+    }
+    CTextHuffman const &huffman = m_huffmanInfo;
+    unsigned int numChunks = huffman.m_nNumHuffmanChunks;
+    if (!huffman.m_pHuffChunks || numChunks == 0) {
+        m_loadError = L"The Huffman tree is empty";
+        return false;
+    }
+    if (huffman.m_nRootLeaf >= numChunks) {
+        m_loadError = Format(L"The Huffman tree root node %d is out of range (%d nodes)", huffman.m_nRootLeaf, numChunks);
+        return false;
+    }
+    if (huffman.m_pHuffChunks[huffman.m_nRootLeaf].IsLast()) {
+        m_loadError = L"The Huffman tree root node is a leaf";
+        return false;
+    }
+    // every node must be reached exactly once from the root - a node reached twice is a cycle or a shared subtree
+    struct PendingNode {
+        unsigned short index;
+        unsigned char depth;
+    };
+    std::vector<bool> visited(numChunks, false);
+    std::vector<PendingNode> pending = { { huffman.m_nRootLeaf, 0 } };
+    bool hasTerminator = false;
+    while (!pending.empty()) {
+        PendingNode node = pending.back();
+        pending.pop_back();
+        if (visited[node.index]) {
+            m_loadError = Format(L"The Huffman tree node %d is reached more than once", node.index);
+            return false;
+        }
+        visited[node.index] = true;
+        CHuffChunk const &chunk = huffman.m_pHuffChunks[node.index];
+        if (chunk.IsLast()) {
+            if (chunk.character == 0)
+                hasTerminator = true;
+            continue;
+        }
+        if (chunk.LeftLeaf >= numChunks || chunk.RightLeaf >= numChunks) {
+            m_loadError = Format(L"The Huffman tree node %d has a child node out of range (left %d, right %d, %d nodes)",
+                node.index, chunk.LeftLeaf, chunk.RightLeaf, numChunks);
+            return false;
+        }
+        if (node.depth == CTextHuffman::MAX_TREE_DEPTH) {
+            m_loadError = Format(L"The Huffman tree node %d is deeper than %d levels", node.index, CTextHuffman::MAX_TREE_DEPTH);
+            return false;
+        }
+        pending.push_back({ chunk.RightLeaf, (unsigned char)(node.depth + 1) });
+        pending.push_back({ chunk.LeftLeaf, (unsigned char)(node.depth + 1) });
+    }
+    for (unsigned int i = 0; i < numChunks; i++) {
+        if (!visited[i]) {
+            m_loadError = Format(L"The Huffman tree node %d is not reachable from the root", i);
+            return false;
+        }
+    }
+    if (!hasTerminator) {
+        m_loadError = L"The Huffman tree has no string terminator";
+        return false;
+    }
+    // without the string walk the text stays on the checked decoding: an offset which doesn't lead to a terminator
+    // is only caught by the walk
+    if (!checkStrings)
+        return true;
+    // the tree is sound now, so the strings are walked with the unchecked decoding; shared strings are walked once.
+    // Offsets are 32-bit, the data beyond them is never read
+    unsigned long long dataBits = (unsigned long long)m_mbStrings.m_nDataSize * 8;
+    if (dataBits > 0xFFFFFFFFull - CTextHuffman::MAX_TREE_DEPTH)
+        dataBits = 0xFFFFFFFFull - CTextHuffman::MAX_TREE_DEPTH;
+    std::vector<CStringHash> hashes(m_pStringHashes, m_pStringHashes + m_nNumStringHashes);
+    std::sort(hashes.begin(), hashes.end(), [](CStringHash const &a, CStringHash const &b) {
+        return a.offset < b.offset;
+    });
+    hashes.erase(std::unique(hashes.begin(), hashes.end(), [](CStringHash const &a, CStringHash const &b) {
+        return a.offset == b.offset;
+    }), hashes.end());
+    CCanonicalHuffman const &canonical = huffman.m_canonical;
+    std::atomic<size_t> firstInvalid = hashes.size();
+    ParallelFor(hashes.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end && i < firstInvalid; i++) {
+            unsigned int bitOffset = hashes[i].offset;
+            bool terminated = false;
+            while (!terminated && bitOffset < dataBits) {
+                if (canonical.IsValid())
+                    terminated = canonical.DecodeCharacter(m_mbStrings, bitOffset) == 0;
+                else
+                    terminated = huffman.m_pHuffChunks[huffman.DecodeLeafUnchecked(m_mbStrings, bitOffset)].character == 0;
+            }
+            if (!terminated || bitOffset > dataBits) {
+                size_t expected = firstInvalid;
+                while (i < expected && !firstInvalid.compare_exchange_weak(expected, i))
+                    ;
                 break;
             }
         }
-        if (*pStr == 0)
+    }, 4096);
+    if (firstInvalid < hashes.size()) {
+        m_loadError = Format(L"The string HASH#%u at bit %u has no terminator inside the strings data (%u bits)",
+            hashes[firstInvalid].key, hashes[firstInvalid].offset, (unsigned int)dataBits);
+        return false;
+    }
+    m_bValidated = true;
+    return true;
+}
+
+unsigned short CText::DecodeLeaf(unsigned int &bitOffset) const {
+    if (m_bValidated)
+        return m_huffmanInfo.DecodeLeafUnchecked(m_mbStrings, bitOffset);
+    unsigned short leaf = m_huffmanInfo.GetRootLeaf();
+    while (!m_huffmanInfo.GetNextLeaf(&leaf, m_mbStrings.GetBitAt(bitOffset++))->IsLast())
+        ;
+    return leaf;
+}
+
+template<typename Char>
+unsigned int CText::DecodeStringTo(unsigned int bitOffset, Char *outStr) const {
+    unsigned int length = 0;
+    CCanonicalHuffman const &canonical = m_huffmanInfo.m_canonical;
+    if (canonical.IsValid()) {
+        while (length < m_nMaxStringLength) {
+            wchar_t character = canonical.DecodeCharacter(m_mbStrings, bitOffset);
+            if (character == 0)
+                break;
+            outStr[length++] = (Char)character;
+        }
+        outStr[length] = 0;
+        return length;
+    }
+    while (length < m_nMaxStringLength) {
+        wchar_t character = m_huffmanInfo.GetChunk(DecodeLeaf(bitOffset))->character;
+        if (character == 0)
             break;
-        ++pStr;
+        outStr[length++] = (Char)character;
+    }
+    outStr[length] = 0;
+    return length;
+}
+
+unsigned int CText::DecodeString(unsigned int bitOffset, wchar_t *outStr) const {
+    return DecodeStringTo(bitOffset, outStr);
+}
+
+template<eGame Game>
+bool CText::IsFormat() const {
+    return DispatchGame(m_game, []<eGame TextGame>() {
+        return TextGame == Game;
+    });
+}
+
+template<eGame Game>
+unsigned int CText::DecodeString(unsigned int bitOffset, typename CTextFormat<Game>::Character *outStr) const {
+    if (!IsFormat<Game>()) {
+        outStr[0] = 0;
+        return 0;
     }
-    return outStr;
+    return DecodeStringTo(bitOffset, outStr);
+}
+
+template<typename Char>
+void CText::DecodeStringsTo(unsigned int const *bitOffsets, unsigned int count, Char *outStrs, unsigned int *outLengths) const {
+    unsigned int const stride = m_nMaxStringLength + 1;
+    CCanonicalHuffman const &canonical = m_huffmanInfo.m_canonical;
+    if (!canonical.IsValid() || m_nMaxStringLength == 0) {
+        // the tree walk is bound by its branches, decoding strings side by side does not speed it up
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int length = DecodeStringTo(bitOffsets[i], outStrs + (size_t)i * stride);
+            if (outLengths)
+                outLengths[i] = length;
+        }
+        return;
+    }
+    // every pass decodes one character of each lane; a lane which reaches the end of its string takes the next
+    // string. The strings are independent, so the processor works on all lanes at once instead of waiting for
+    // each code length in turn
+    unsigned int strings[DECODE_LANES];
+    unsigned int offsets[DECODE_LANES];
+    unsigned int lengths[DECODE_LANES];
+    unsigned int numLanes = 0;
+    unsigned int next = 0;
+    while (numLanes < DECODE_LANES && next < count) {
+        strings[numLanes] = next;
+        offsets[numLanes] = bitOffsets[next++];
+        lengths[numLanes++] = 0;
+    }
+    while (numLanes != 0) {
+        for (unsigned int lane = 0; lane < numLanes; lane++) {
+            wchar_t character = canonical.DecodeCharacter(m_mbStrings, offsets[lane]);
+            Char *outStr = outStrs + (size_t)strings[lane] * stride;
+            outStr[lengths[lane]] = (Char)character;
+            if (character != 0 && ++lengths[lane] < m_nMaxStringLength)
+                continue;
+            outStr[lengths[lane]] = 0;
+            if (outLengths)
+                outLengths[strings[lane]] = lengths[lane];
+            if (next < count) {
+                strings[lane] = next;
+                offsets[lane] = bitOffsets[next++];
+                lengths[lane] = 0;
+            }
+            else {
+                // the last lane takes this one's place
+                numLanes--;
+                strings[lane] = strings[numLanes];
+                offsets[lane] = offsets[numLanes];
+                lengths[lane] = lengths[numLanes];
+                lane--;
+            }
+        }
+    }
+}
+
+void CText::DecodeStrings(unsigned int const *bitOffsets, unsigned int count, wchar_t *outStrs, unsigned int *outLengths) const {
+    DecodeStringsTo(bitOffsets, count, outStrs, outLengths);
+}
+
+template<eGame Game>
+void CText::DecodeStrings(unsigned int const *bitOffsets, unsigned int count, typename CTextFormat<Game>::Character *outStrs,
+    unsigned int *outLengths) const
+{
+    if (IsFormat<Game>()) {
+        DecodeStringsTo(bitOffsets, count, outStrs, outLengths);
+        return;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        outStrs[(size_t)i * (m_nMaxStringLength + 1)] = 0;
+        if (outLengths)
+            outLengths[i] = 0;
+    }
+}
+
+// the decoding of every format, for the callers outside this file
+template unsigned int CText::DecodeString<GAME_TCM2005>(unsigned int, char *) const;
+template unsigned int CText::DecodeString<GAME_FM06>(unsigned int, char *) const;
+template unsigned int CText::DecodeString<GAME_FM09>(unsigned int, wchar_t *) const;
+template void CText::DecodeStrings<GAME_TCM2005>(unsigned int const *, unsigned int, char *, unsigned int *) const;
+template void CText::DecodeStrings<GAME_FM06>(unsigned int const *, unsigned int, char *, unsigned int *) const;
+template void CText::DecodeStrings<GAME_FM09>(unsigned int const *, unsigned int, wchar_t *, unsigned int *) const;
+
+bool CText::DecodeStringUTF8(unsigned int bitOffset, CTextUTF8Table const &table, std::string &output) const {
+    size_t start = output.size();
+    CCanonicalHuffman const &canonical = m_huffmanInfo.m_canonical;
+    wchar_t skipNext = 0;
+    for (unsigned int length = 0; length < m_nMaxStringLength; length++) {
+        unsigned int index = 0;
+        if (table.m_bBySymbol)
+            index = canonical.DecodeSymbol(m_mbStrings, bitOffset);
+        else
+            index = DecodeLeaf(bitOffset);
+        if (index >= table.m_entries.size())
+            break;
+        CTextUTF8Table::Entry const &entry = table.m_entries[index];
+        if (entry.flags & CTextUTF8Table::FLAG_END)
+            break;
+        if (skipNext != 0 && entry.character == skipNext) {
+            skipNext = 0;
+            continue;
+        }
+        if (entry.flags & CTextUTF8Table::FLAG_SLOW) {
+            output.resize(start);
+            return false;
+        }
+        output.append(entry.bytes, entry.length);
+        skipNext = (entry.flags & CTextUTF8Table::FLAG_SKIP_NEXT) ? entry.skipNext : 0;
+    }
+    return true;
+}
+
+unsigned int CText::GetEncodedBits(unsigned int bitOffset) const {
+    unsigned int startOffset = bitOffset;
+    CCanonicalHuffman const &canonical = m_huffmanInfo.m_canonical;
+    if (canonical.IsValid()) {
+        for (unsigned int i = 0; i <= m_nMaxStringLength; i++) {
+            if (canonical.DecodeCharacter(m_mbStrings, bitOffset) == 0)
+                break;
+        }
+        return bitOffset - startOffset;
+    }
+    for (unsigned int i = 0; i <= m_nMaxStringLength; i++) {
+        if (m_huffmanInfo.GetChunk(DecodeLeaf(bitOffset))->character == 0)
+            break;
+    }
+    return bitOffset - startOffset;
 }
 
 bool CText::EncodeString(wchar_t const *str) {
     if (!str)
         return false;
     while (true) {
-        CharacterInfo *info = m_huffmanInfo.FindCharacterInfo(*str);
+        CharacterInfo const *info = m_huffmanInfo.FindCharacterInfo(*str);
         if (!info || info->codeLength == 0)
             return false;
         if (!m_mbStrings.WriteBits(info->codeBits, info->codeLength))
             return false;
-        m_mbStrings.m_nTotalLength++;
         if (*str == 0)
             break;
         str++;
@@ -532,36 +1374,363 @@ bool CText::EncodeString(wchar_t const *str) {
     return true;
 }
 
-bool CText::LoadTranslationStrings(std::map<unsigned int, std::wstring> const &strings, eGame game) {
+bool CText::LoadTranslationStrings(std::map<unsigned int, std::wstring> const &strings, eGame game, bool shareSuffixes) {
+    CTextStringArena arena;
+    size_t numCharacters = 0;
+    for (auto const &[key, str] : strings)
+        numCharacters += str.size() + 1;
+    arena.Reserve(strings.size(), numCharacters);
+    for (auto const &[key, str] : strings)
+        arena.Add(key, str);
+    return LoadTranslationStrings(arena, game, shareSuffixes);
+}
+
+bool CText::LoadTranslationStrings(CTextStringArena &strings, eGame game, bool shareSuffixes) {
+    std::vector<std::wstring_view> encodeOrder;
+    if (!PrepareTranslationStrings(strings, game, shareSuffixes, encodeOrder))
+        return false;
+    // the bitstream size is known, so the buffer is allocated once
+    m_mbStrings.m_nDataSize = (m_mbStrings.m_bitOffset / 8) + 1;
+    m_mbStrings.m_pData = new unsigned char[m_mbStrings.m_nDataSize]();
+    m_mbStrings.m_bitOffset = 0;
+    for (std::wstring_view str : encodeOrder) {
+        // views point into the arena, where every string is followed by a terminator
+        EncodeString(str.data());
+    }
+    m_mbStrings.m_nRuntimeDataPtr = (unsigned int)m_mbStrings.m_pData;
+    // the tree and the offsets were built here
+    m_bValidated = true;
+    if (shareSuffixes) {
+        std::vector<wchar_t> decoded(m_nMaxStringLength + 1);
+        unsigned int stringCounter = 0;
+        for (auto const &entry : strings.m_entries) {
+            unsigned int length = DecodeString(m_pStringHashes[stringCounter].offset, decoded.data());
+            if (strings.Get(entry) != std::wstring_view(decoded.data(), length)) {
+                ErrorMessage(Format(L"Suffix sharing verification failed for key HASH#%u", entry.hash));
+                Clear();
+                return false;
+            }
+            stringCounter++;
+        }
+    }
+    return true;
+}
+
+bool CText::PrepareTranslationStrings(CTextStringArena &strings, eGame game, bool shareSuffixes,
+    std::vector<std::wstring_view> &encodeOrder)
+{
     Clear();
+    encodeOrder.clear();
+    strings.SortAndDeduplicate();
     m_game = game;
-    memset(m_characterMap, 0, sizeof(m_characterMap));
+    m_characterMap.assign(65536, 0);
+    // identical values are encoded once - all entries with the same text share the bit offset
+    std::vector<std::wstring_view> uniqueStrings;
+    std::vector<unsigned int> uniqueIndices;
+    std::unordered_map<std::wstring_view, unsigned int> uniqueLookup;
+    uniqueStrings.reserve(strings.Size());
+    uniqueIndices.reserve(strings.Size());
+    uniqueLookup.reserve(strings.Size());
+    for (auto const &entry : strings.m_entries) {
+        std::wstring_view str = strings.Get(entry);
+        auto [it, inserted] = uniqueLookup.try_emplace(str, (unsigned int)uniqueStrings.size());
+        if (inserted)
+            uniqueStrings.push_back(str);
+        uniqueIndices.push_back(it->second);
+    }
+    uniqueLookup.clear();
+    // a string which is a tail of another string starts inside its encoding - decoding stops at the same terminator
+    std::vector<unsigned int> uniqueOwners(uniqueStrings.size());
+    for (unsigned int i = 0; i < uniqueStrings.size(); i++)
+        uniqueOwners[i] = i;
+    if (shareSuffixes && uniqueStrings.size() > 1) {
+        std::vector<unsigned int> reversedOrder(uniqueOwners);
+        std::sort(reversedOrder.begin(), reversedOrder.end(), [&uniqueStrings](unsigned int a, unsigned int b) {
+            return std::lexicographical_compare(uniqueStrings[a].rbegin(), uniqueStrings[a].rend(),
+                uniqueStrings[b].rbegin(), uniqueStrings[b].rend());
+            });
+        // in reversed order a string is a suffix of another string only if it is a suffix of the next one
+        for (unsigned int i = reversedOrder.size() - 1; i > 0; i--) {
+            std::wstring_view tail = uniqueStrings[reversedOrder[i - 1]];
+            std::wstring_view next = uniqueStrings[reversedOrder[i]];
+            if (next.ends_with(tail))
+                uniqueOwners[reversedOrder[i - 1]] = uniqueOwners[reversedOrder[i]];
+        }
+    }
+    for (unsigned int i = 0; i < uniqueStrings.size(); i++) {
+        if (uniqueOwners[i] == i) {
+            for (wchar_t ch : uniqueStrings[i])
+                m_characterMap[ch]++;
+            m_characterMap[0]++;
+        }
+    }
+    m_huffmanInfo.Pack(m_characterMap.data());
+    unsigned int numTreeNodes = DispatchGame(m_game, []<eGame Game>() {
+        return CTextFormat<Game>::NUM_TREE_NODES;
+    });
+    if (numTreeNodes != 0 && m_huffmanInfo.m_nNumHuffmanChunks > numTreeNodes) {
+        ErrorMessage(Format(L"Reached Huffman Nodes array limit.\nNumber of unique characters: %d\nNumber of generated nodes: %d (%d max)",
+            m_huffmanInfo.m_nNumUniqueCharacters, m_huffmanInfo.m_nNumHuffmanChunks, numTreeNodes));
+        Clear();
+        return false;
+    }
+    // the bitstream layout follows from the code lengths - all offsets are known before encoding
+    std::vector<unsigned char> codeLengths(65536, 0);
+    for (unsigned int i = 0; i < m_huffmanInfo.m_nNumUniqueCharacters; i++)
+        codeLengths[m_huffmanInfo.m_pCharactersInfo[i].character] = m_huffmanInfo.m_pCharactersInfo[i].codeLength;
+    std::vector<unsigned int> uniqueOffsets(uniqueStrings.size());
+    std::vector<unsigned int> uniqueBits(uniqueStrings.size());
+    unsigned int bitOffset = 0;
+    for (unsigned int i = 0; i < uniqueStrings.size(); i++) {
+        if (uniqueOwners[i] == i) {
+            unsigned int numBits = codeLengths[0];
+            for (wchar_t ch : uniqueStrings[i])
+                numBits += codeLengths[ch];
+            uniqueOffsets[i] = bitOffset;
+            uniqueBits[i] = numBits;
+            bitOffset += numBits;
+            m_mbStrings.m_nTotalLength += uniqueStrings[i].size() + 1;
+            encodeOrder.push_back(uniqueStrings[i]);
+        }
+        m_nMaxStringLength = max(m_nMaxStringLength, uniqueStrings[i].size());
+    }
+    m_mbStrings.m_bitOffset = bitOffset;
+    for (unsigned int i = 0; i < uniqueStrings.size(); i++) {
+        unsigned int owner = uniqueOwners[i];
+        if (owner != i) {
+            std::wstring_view ownerStr = uniqueStrings[owner];
+            unsigned int headBits = 0;
+            for (unsigned int c = 0; c < ownerStr.size() - uniqueStrings[i].size(); c++)
+                headBits += codeLengths[ownerStr[c]];
+            uniqueOffsets[i] = uniqueOffsets[owner] + headBits;
+            uniqueBits[i] = uniqueBits[owner] - headBits;
+            m_mbStrings.m_nTotalLength += uniqueStrings[i].size() + 1;
+            m_nNumSuffixStrings++;
+            m_nNumSuffixBits += uniqueBits[i];
+        }
+    }
+    m_nNumUniqueStrings = uniqueStrings.size();
+    m_nNumStringHashes = strings.Size();
+    m_pStringHashes = new CStringHash[m_nNumStringHashes];
+    std::vector<bool> uniqueUsed(uniqueStrings.size(), false);
+    unsigned int stringCounter = 0;
+    for (auto const &entry : strings.m_entries) {
+        unsigned int uniqueIndex = uniqueIndices[stringCounter];
+        m_pStringHashes[stringCounter].key = entry.hash;
+        m_pStringHashes[stringCounter].offset = uniqueOffsets[uniqueIndex];
+        if (uniqueUsed[uniqueIndex]) {
+            // keep the total length as if the string was written, the game sizes its buffers from it
+            m_mbStrings.m_nTotalLength += entry.length + 1;
+            m_nNumSharedStrings++;
+            m_nNumSharedBits += uniqueBits[uniqueIndex];
+        }
+        else
+            uniqueUsed[uniqueIndex] = true;
+        stringCounter++;
+    }
+    m_bStringHashesSorted = true;
+    return true;
+}
+
+bool CText::PatchTranslationStrings(std::map<unsigned int, std::wstring> const &strings, std::set<unsigned int> const &removedKeys) {
+    if (!m_pStringHashes || !m_huffmanInfo.m_pHuffChunks)
+        return false;
+    // new strings are encoded with the codes read from the tree, not with the character table of the file. The tree
+    // is kept only if it can encode all new strings with codes of up to 32 bits, otherwise the file must be rebuilt
+    std::vector<CharacterInfo> codes;
+    if (!m_huffmanInfo.GenerateTreeCodes(codes))
+        return false;
+    auto FindCode = [&codes](wchar_t ch) -> CharacterInfo const * {
+        auto it = std::lower_bound(codes.begin(), codes.end(), ch, [](CharacterInfo const &info, wchar_t c) {
+            return info.character < c;
+            });
+        return (it != codes.end() && it->character == ch) ? &*it : nullptr;
+    };
     for (auto const &[key, str] : strings) {
-        for (wchar_t ch : str)
-            m_characterMap[ch]++;
-        m_characterMap[0]++;
-    }
-    m_huffmanInfo.Pack(m_characterMap);
-    if (m_game != GAME_FM09) {
-        unsigned int NodeArraySize = (m_game == GAME_TCM2005) ? 256 : 512;
-        if (m_huffmanInfo.m_nNumHuffmanChunks > NodeArraySize) {
-            ErrorMessage(Format(L"Reached Huffman Nodes array limit.\nNumber of unique characters: %d\nNumber of generated nodes: %d (%d max)",
-                m_huffmanInfo.m_nNumUniqueCharacters, m_huffmanInfo.m_nNumHuffmanChunks, NodeArraySize));
-            Clear();
+        for (unsigned int c = 0; c <= str.size(); c++) {
+            if (!FindCode(str.c_str()[c]))
+                return false;
+        }
+    }
+    // the bits of a removed or replaced string are dropped up to the first kept string starting inside them (a shared
+    // or a suffix string), unless they are inside a kept string. Only these strings and the kept strings right
+    // before them are decoded, everything else is copied as it is
+    struct StringOffset {
+        unsigned int offset;
+        bool kept;
+    };
+    struct BitSpan {
+        unsigned int start;
+        unsigned int end;
+    };
+    std::vector<StringOffset> offsets(m_nNumStringHashes);
+    std::vector<CStringHash> hashes;
+    hashes.reserve(m_nNumStringHashes + strings.size());
+    for (unsigned int i = 0; i < m_nNumStringHashes; i++) {
+        CStringHash const &entry = m_pStringHashes[i];
+        bool kept = !removedKeys.contains(entry.key) && !strings.contains(entry.key);
+        offsets[i] = { entry.offset, kept };
+        if (kept)
+            hashes.push_back(entry);
+    }
+    // the kept strings are read back from their old and new offsets
+    std::vector<CStringHash> keptHashes = hashes;
+    std::sort(offsets.begin(), offsets.end(), [](StringOffset const &a, StringOffset const &b) {
+        return a.offset < b.offset || (a.offset == b.offset && a.kept > b.kept);
+    });
+    offsets.erase(std::unique(offsets.begin(), offsets.end(), [](StringOffset const &a, StringOffset const &b) {
+        return a.offset == b.offset;
+    }), offsets.end());
+    // the stream ends with the string at the last offset; m_bitOffset of a loaded 8-bit file is not the stream size
+    unsigned int dataBits = (unsigned int)(std::min)(m_mbStrings.m_nDataSize * 8ull, 0xFFFFFFFFull);
+    unsigned int numBits = 0;
+    if (!offsets.empty() && offsets.back().offset < dataBits)
+        numBits = (std::min)(offsets.back().offset + GetEncodedBits(offsets.back().offset), dataBits);
+    std::vector<unsigned int> nextKept(offsets.size() + 1, numBits);
+    for (size_t i = offsets.size(); i > 0; i--)
+        nextKept[i - 1] = offsets[i - 1].kept ? offsets[i - 1].offset : nextKept[i];
+    std::vector<BitSpan> dropped;
+    size_t prevKept = offsets.size();
+    unsigned int prevKeptEnd = 0;
+    bool prevKeptMeasured = false;
+    for (size_t i = 0; i < offsets.size(); i++) {
+        unsigned int start = offsets[i].offset;
+        if (offsets[i].kept) {
+            prevKept = i;
+            prevKeptMeasured = false;
+            continue;
+        }
+        if (prevKept != offsets.size()) {
+            if (!prevKeptMeasured) {
+                prevKeptEnd = offsets[prevKept].offset + GetEncodedBits(offsets[prevKept].offset);
+                prevKeptMeasured = true;
+            }
+            if (prevKeptEnd > start)
+                continue;
+        }
+        unsigned int end = (std::min)(start + GetEncodedBits(start), nextKept[i + 1]);
+        if (start >= end)
+            continue;
+        if (!dropped.empty() && start <= dropped.back().end)
+            dropped.back().end = max(dropped.back().end, end);
+        else
+            dropped.push_back({ start, end });
+    }
+    CTextMultibyteStrings mbStrings;
+    if (!mbStrings.Reserve(m_mbStrings.m_nDataSize))
+        return false;
+    // droppedBits[i] is the number of bits dropped before span i
+    std::vector<unsigned int> droppedBits(dropped.size() + 1, 0);
+    unsigned int copyStart = 0;
+    for (size_t i = 0; i < dropped.size(); i++) {
+        if (!mbStrings.CopyBits(m_mbStrings, copyStart, dropped[i].start - copyStart))
             return false;
+        copyStart = dropped[i].end;
+        droppedBits[i + 1] = droppedBits[i] + (dropped[i].end - dropped[i].start);
+    }
+    if (copyStart < numBits && !mbStrings.CopyBits(m_mbStrings, copyStart, numBits - copyStart))
+        return false;
+    for (auto &entry : hashes) {
+        // a kept string never starts inside a dropped span
+        auto it = std::upper_bound(dropped.begin(), dropped.end(), entry.offset, [](unsigned int offset, BitSpan const &span) {
+            return offset < span.start;
+            });
+        entry.offset -= droppedBits[it - dropped.begin()];
+    }
+    // append the new strings
+    std::unordered_map<std::wstring_view, unsigned int> newOffsets;
+    unsigned int maxStringLength = m_nMaxStringLength;
+    for (auto const &[key, str] : strings) {
+        auto [it, inserted] = newOffsets.try_emplace(str, mbStrings.m_bitOffset);
+        if (inserted) {
+            for (unsigned int c = 0; c <= str.size(); c++) {
+                CharacterInfo const *info = FindCode(str.c_str()[c]);
+                if (!mbStrings.WriteBits(info->codeBits, info->codeLength))
+                    return false;
+            }
         }
+        hashes.push_back({ key, it->second });
+        maxStringLength = max(maxStringLength, str.size());
     }
-    m_nNumStringHashes = strings.size();
+    std::sort(hashes.begin(), hashes.end(), [](CStringHash const &a, CStringHash const &b) {
+        return a.key < b.key;
+    });
+    // the patched text replaces the loaded one and is read back; on a mismatch the loaded text is restored
+    CStringHash *oldHashes = m_pStringHashes;
+    unsigned int oldNumStringHashes = m_nNumStringHashes;
+    unsigned int oldMaxStringLength = m_nMaxStringLength;
+    bool oldStringHashesSorted = m_bStringHashesSorted;
+    auto SwapStrings = [this, &mbStrings]() {
+        std::swap(m_mbStrings.m_pData, mbStrings.m_pData);
+        std::swap(m_mbStrings.m_bitOffset, mbStrings.m_bitOffset);
+        std::swap(m_mbStrings.m_nDataSize, mbStrings.m_nDataSize);
+    };
+    std::vector<unsigned int> keptBits(keptHashes.size());
+    ParallelFor(keptHashes.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            keptBits[i] = GetEncodedBits(keptHashes[i].offset);
+    }, 4096);
+    SwapStrings();
+    m_nNumStringHashes = hashes.size();
     m_pStringHashes = new CStringHash[m_nNumStringHashes];
-    unsigned int stringCounter = 0;
+    std::copy(hashes.begin(), hashes.end(), m_pStringHashes);
+    m_bStringHashesSorted = true;
+    m_nMaxStringLength = maxStringLength;
+    bool verified = true;
+    std::vector<wchar_t> buffer(m_nMaxStringLength + 1);
     for (auto const &[key, str] : strings) {
-        m_pStringHashes[stringCounter].key = key;
-        m_pStringHashes[stringCounter].offset = m_mbStrings.m_bitOffset;
-        EncodeString(str.c_str());
-        m_nMaxStringLength = max(m_nMaxStringLength, str.size());
-        stringCounter++;
+        CStringHash const *entry = FindStringHash(key);
+        if (!entry || std::wstring_view(buffer.data(), DecodeString(entry->offset, buffer.data())) != str) {
+            verified = false;
+            break;
+        }
     }
-    m_mbStrings.m_nRuntimeDataPtr = (unsigned int)m_mbStrings.m_pData;
-    AllocateTempStrings();
+    for (unsigned int key : removedKeys) {
+        if (verified && !strings.contains(key) && FindStringHash(key))
+            verified = false;
+    }
+    // the tree is unchanged, so a kept string reads back right if its code bits are the same as in the old data,
+    // which is in mbStrings now. Dropping the spans is where a kept string would be cut
+    std::atomic<bool> keptVerified = verified;
+    if (verified) {
+        ParallelFor(keptHashes.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end && keptVerified; i++) {
+                CStringHash const *entry = FindStringHash(keptHashes[i].key);
+                if (!entry || GetEncodedBits(entry->offset) != keptBits[i]) {
+                    keptVerified = false;
+                    break;
+                }
+                for (unsigned int bit = 0; bit < keptBits[i]; bit += 56) {
+                    unsigned long long mask = (1ull << (std::min)(56u, keptBits[i] - bit)) - 1;
+                    if (((mbStrings.PeekBits(keptHashes[i].offset + bit) ^ m_mbStrings.PeekBits(entry->offset + bit)) & mask) != 0) {
+                        keptVerified = false;
+                        break;
+                    }
+                }
+            }
+        }, 4096);
+        verified = keptVerified;
+    }
+    if (!verified) {
+        delete[] m_pStringHashes;
+        m_pStringHashes = oldHashes;
+        m_nNumStringHashes = oldNumStringHashes;
+        m_nMaxStringLength = oldMaxStringLength;
+        m_bStringHashesSorted = oldStringHashesSorted;
+        SwapStrings();
+        return false;
+    }
+    delete[] oldHashes;
+    // a loaded 8-bit file has the size of its strings data in bytes plus TOTAL_LENGTH_EXTRA as the total length,
+    // it changes by the size of the data
+    DispatchGame(m_game, [this, numBits]<eGame Game>() {
+        if constexpr (!CTextFormat<Game>::HAS_HEADER) {
+            unsigned int oldBytes = (numBits + 7) / 8;
+            unsigned int newBytes = (m_mbStrings.m_bitOffset + 7) / 8;
+            m_mbStrings.m_nTotalLength = (m_mbStrings.m_nTotalLength > oldBytes) ? (m_mbStrings.m_nTotalLength - oldBytes + newBytes) :
+                (newBytes + CTextFormat<Game>::TOTAL_LENGTH_EXTRA);
+        }
+    });
+    m_stringCache.Clear();
     return true;
 }
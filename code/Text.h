@@ -1,6 +1,15 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <map>
+#include <set>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
 #include <Windows.h>
 
 enum eGame {
@@ -10,6 +19,46 @@ enum eGame {
     GAME_FM09 // unlimited tree nodes, UTF-16
 };
 
+// Layout constants of each file format; the readers and writers are instantiated per format
+template<eGame Game> struct CTextFormat;
+
+template<> struct CTextFormat<GAME_TCM2005> {
+    static constexpr bool HAS_HEADER = false;
+    static constexpr unsigned int NUM_TREE_NODES = 256;
+    static constexpr wchar_t CHARACTER_MASK = 0xFF;
+    using Character = char; // decoded strings take one byte per character
+    static constexpr unsigned int TOTAL_LENGTH_EXTRA = 0xC10;
+};
+
+template<> struct CTextFormat<GAME_FM06> {
+    static constexpr bool HAS_HEADER = false;
+    static constexpr unsigned int NUM_TREE_NODES = 512;
+    static constexpr wchar_t CHARACTER_MASK = 0xFF;
+    using Character = char; // decoded strings take one byte per character
+    static constexpr unsigned int TOTAL_LENGTH_EXTRA = 0x1810;
+};
+
+template<> struct CTextFormat<GAME_FM09> {
+    static constexpr bool HAS_HEADER = true; // BFLC header, MBST strings section
+    static constexpr unsigned int NUM_TREE_NODES = 0; // unlimited
+    static constexpr wchar_t CHARACTER_MASK = 0xFFFF;
+    using Character = wchar_t;
+    static constexpr unsigned int TOTAL_LENGTH_EXTRA = 0;
+};
+
+// calls func.template operator()<Game>() with the format of game; unset games use the FM06 layout
+template<typename Func>
+auto DispatchGame(eGame game, Func &&func) {
+    switch (game) {
+    case GAME_TCM2005:
+        return func.template operator()<GAME_TCM2005>();
+    case GAME_FM09:
+        return func.template operator()<GAME_FM09>();
+    default:
+        return func.template operator()<GAME_FM06>();
+    }
+}
+
 struct CharacterInfo {
     unsigned int codeBits = 0;
     wchar_t character = 0;
@@ -17,6 +66,43 @@ struct CharacterInfo {
     char _pad7 = 0;
 };
 
+// Buffered output for .huf files: data is collected in a large buffer and written in big blocks.
+// Bits are packed in stream order - the first bit goes to the lowest bit of a byte.
+class CTextFileWriter {
+public:
+    static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    std::unique_ptr<unsigned char[]> m_pBuffer;
+    size_t m_nBufferUsed = 0;
+    unsigned long long m_bitBuffer = 0;
+    unsigned int m_nNumBufferedBits = 0;
+    bool m_bFailed = false;
+
+    ~CTextFileWriter();
+    bool Open(wchar_t const *filePath);
+    bool Close();
+    bool Flush();
+    bool Write(void const *data, size_t size);
+    bool WriteZeros(size_t size);
+    bool FlushBits();
+
+    // bits are written from the lowest one, so Huffman codes must be passed bit-reversed
+    void WriteReversedBits(unsigned int bits, unsigned char numBits) {
+        m_bitBuffer |= (unsigned long long)bits << m_nNumBufferedBits;
+        m_nNumBufferedBits += numBits;
+        if (m_nNumBufferedBits >= 32) {
+            if (m_nBufferUsed + 4 > BUFFER_SIZE)
+                Flush();
+            unsigned int word = (unsigned int)m_bitBuffer;
+            memcpy(&m_pBuffer[m_nBufferUsed], &word, 4);
+            m_nBufferUsed += 4;
+            m_bitBuffer >>= 32;
+            m_nNumBufferedBits -= 32;
+        }
+    }
+};
+
 class CTextMultibyteStrings {
 public:
     unsigned char *m_pData = nullptr;
@@ -28,9 +114,22 @@ public:
     ~CTextMultibyteStrings();
     void Clear();
     bool Read(HANDLE fileHandle);
-    bool Write(HANDLE fileHandle) const;
     unsigned char GetBitAt(unsigned int offset) const;
+    // returns the bits from offset on, the bit at offset in bit 0; at least 57 bits are valid, bits past the end of the data are 0
+    unsigned long long PeekBits(unsigned int offset) const {
+        unsigned int byteIndex = offset / 8;
+        unsigned long long bits = 0;
+        if (byteIndex + 8 <= m_nDataSize)
+            memcpy(&bits, m_pData + byteIndex, 8);
+        else if (byteIndex < m_nDataSize)
+            memcpy(&bits, m_pData + byteIndex, m_nDataSize - byteIndex);
+        return bits >> (offset % 8);
+    }
+    // grows the zeroed buffer to at least numBytes
+    bool Reserve(unsigned int numBytes);
     bool WriteBits(unsigned int value, unsigned char numBits);
+    // appends numBits bits of source from offset on
+    bool CopyBits(CTextMultibyteStrings const &source, unsigned int offset, unsigned int numBits);
 };
 
 class CHuffChunk {
@@ -43,27 +142,130 @@ public:
 
     CHuffChunk();
     CHuffChunk(wchar_t Character, unsigned int Frequency);
-    bool IsLast();
+    bool IsLast() const;
+};
+
+// Canonical form of a Huffman code: codes of the same length are consecutive numbers
+// assigned in character order, so the whole code is described by the code lengths.
+class CCanonicalHuffman {
+public:
+    static const unsigned char MAX_CODE_LENGTH = 32;
+    static const unsigned char LOOKUP_BITS = 10;
+
+    std::vector<wchar_t> m_symbols; // sorted by (code length, character)
+    // indexed by the next LOOKUP_BITS bits of the stream: symbol index << 8 | code length, 0 for longer codes
+    std::vector<unsigned int> m_lookup;
+    unsigned int m_firstCode[MAX_CODE_LENGTH + 1] = {};
+    unsigned int m_firstSymbol[MAX_CODE_LENGTH + 1] = {};
+    unsigned int m_numCodes[MAX_CODE_LENGTH + 1] = {};
+    unsigned char m_nMaxCodeLength = 0;
+
+    void Clear();
+    bool IsValid() const;
+    bool Build(CharacterInfo *characters, unsigned int numCharacters);
+    static void LimitCodeLengths(unsigned short *codeLengths, unsigned int const *frequencies, unsigned int numCharacters);
+
+    // reads one code starting at bitOffset; returns its index in m_symbols, or m_symbols.size() on a malformed code
+    unsigned int DecodeSymbol(CTextMultibyteStrings const &mbStrings, unsigned int &bitOffset) const {
+        unsigned int numBits = 0;
+        unsigned int symbol = DecodeSymbol(mbStrings.PeekBits(bitOffset), numBits);
+        bitOffset += numBits;
+        return symbol;
+    }
+
+    // same as above for bits taken by CTextMultibyteStrings::PeekBits; numBits gets the number of bits read
+    unsigned int DecodeSymbol(unsigned long long bits, unsigned int &numBits) const {
+        unsigned int entry = m_lookup[bits & ((1 << LOOKUP_BITS) - 1)];
+        if (entry) {
+            numBits = entry & 0xFF;
+            return entry >> 8;
+        }
+        unsigned int code = 0;
+        for (unsigned char length = 1; length <= m_nMaxCodeLength; length++) {
+            code = (code << 1) | ((bits >> (length - 1)) & 1);
+            unsigned int index = code - m_firstCode[length];
+            if (index < m_numCodes[length]) {
+                numBits = length;
+                return m_firstSymbol[length] + index;
+            }
+        }
+        numBits = m_nMaxCodeLength;
+        return (unsigned int)m_symbols.size();
+    }
+
+    // reads one character starting at bitOffset; returns 0 on a malformed code
+    wchar_t DecodeCharacter(CTextMultibyteStrings const &mbStrings, unsigned int &bitOffset) const {
+        unsigned int symbol = DecodeSymbol(mbStrings, bitOffset);
+        return (symbol < m_symbols.size()) ? m_symbols[symbol] : 0;
+    }
 };
 
 class CTextHuffman {
 public:
+    // deeper trees are rejected by CText::Validate - a Huffman code of 57 bits needs more characters than a
+    // 32-bit bit offset can address, and a code up to this length is read with one PeekBits
+    static const unsigned char MAX_TREE_DEPTH = 56;
+
     CHuffChunk *m_pHuffChunks = nullptr;
     CharacterInfo *m_pCharactersInfo = nullptr;
     unsigned short m_nRootLeaf = 0xFFFF;
     unsigned short m_nNumHuffmanChunks = 0;
     unsigned short m_nNumUniqueCharacters = 0;
+    CCanonicalHuffman m_canonical;
 
     ~CTextHuffman();
     void Clear();
-    unsigned short GetRootLeaf();
+    unsigned short GetRootLeaf() const;
     CHuffChunk *GetChunk(unsigned short chunkIndex);
-    CharacterInfo *FindCharacterInfo(wchar_t ch);
-    CHuffChunk *GetNextLeaf(unsigned short *currLeaf, unsigned char bit);
+    CHuffChunk const *GetChunk(unsigned short chunkIndex) const;
+    CharacterInfo const *FindCharacterInfo(wchar_t ch) const;
+    CHuffChunk const *GetNextLeaf(unsigned short *currLeaf, unsigned char bit) const;
     bool Read(HANDLE fileHandle);
-    bool Write(HANDLE hFile);
-    void GenerateHuffmanCodes(unsigned short nodeIndex, unsigned short &outIndex);
+    bool Write(CTextFileWriter &file) const;
+    // the code of every leaf as the tree assigns it, sorted by character; fails on a malformed tree, a character
+    // with two leaves or a code longer than CCanonicalHuffman::MAX_CODE_LENGTH bits
+    bool GenerateTreeCodes(std::vector<CharacterInfo> &codes) const;
+    bool GenerateCanonicalCodes();
+    bool BuildTreeFromCodes(unsigned int const *frequencies);
     bool Pack(unsigned int *characterMap);
+
+    // walks from the root to a leaf reading the bits from bitOffset on; returns the leaf index. There are no
+    // checks, the tree must have passed CText::Validate
+    unsigned short DecodeLeafUnchecked(CTextMultibyteStrings const &mbStrings, unsigned int &bitOffset) const {
+        unsigned long long bits = mbStrings.PeekBits(bitOffset);
+        unsigned short leaf = m_nRootLeaf;
+        unsigned int numBits = 0;
+        do {
+            leaf = ((bits >> numBits++) & 1) ? m_pHuffChunks[leaf].LeftLeaf : m_pHuffChunks[leaf].RightLeaf;
+        } while (m_pHuffChunks[leaf].RightLeaf != 0xFFFF);
+        bitOffset += numBits;
+        return leaf;
+    }
+};
+
+// Export output of every decodable character: its UTF-8 bytes after token replacement, so that
+// CText::DecodeStringUTF8 appends a decoded string to the output without UTF-16 copies. Entries follow
+// the canonical symbols, or the tree nodes when the text has no canonical codes.
+class CTextUTF8Table {
+public:
+    enum {
+        FLAG_END = 1, // string terminator
+        FLAG_SLOW = 2, // the string needs the regular path: quoted cell, surrogate or a longer token
+        FLAG_SKIP_NEXT = 4 // the next character is dropped if it is skipNext - "\r\n" gives one token like "\r"
+    };
+    struct Entry {
+        char bytes[8] = {};
+        unsigned char length = 0;
+        unsigned char flags = 0;
+        wchar_t character = 0;
+        wchar_t skipNext = 0;
+    };
+    std::vector<Entry> m_entries;
+    bool m_bBySymbol = false;
+
+    // replacements are applied the same way as ReplaceAll, characters are mapped through charmap first
+    void Build(CTextHuffman const &huffman, wchar_t separator, std::vector<std::pair<std::wstring, std::wstring>> const &replacements,
+        std::map<wchar_t, wchar_t> const &charmap);
 };
 
 class CStringHash {
@@ -72,8 +274,68 @@ public:
     unsigned int offset = 0;
 };
 
+// Import staging for LoadTranslationStrings: all strings in one buffer (each followed by a
+// terminator) addressed by flat (hash, offset, length) entries
+class CTextStringArena {
+public:
+    struct Entry {
+        unsigned int hash;
+        unsigned int offset;
+        unsigned int length;
+    };
+    std::vector<wchar_t> m_data;
+    std::vector<Entry> m_entries;
+
+    void Reserve(size_t numStrings, size_t numCharacters);
+    void Add(unsigned int hash, std::wstring_view str);
+    std::wstring_view Get(Entry const &entry) const;
+    wchar_t const *GetCStr(Entry const &entry) const;
+    size_t Size() const;
+    void SortAndDeduplicate();
+    void Clear();
+
+    // func gets each string as std::wstring and may change its length
+    template<typename Func>
+    void TransformStrings(Func func) {
+        std::vector<wchar_t> data;
+        data.reserve(m_data.size());
+        std::wstring str;
+        for (auto &entry : m_entries) {
+            str.assign(Get(entry));
+            func(str);
+            entry.offset = (unsigned int)data.size();
+            entry.length = (unsigned int)str.size();
+            data.insert(data.end(), str.begin(), str.end());
+            data.push_back(0);
+        }
+        m_data.swap(data);
+    }
+};
+
+class CTextStringCache {
+    struct Entry {
+        unsigned int key = 0;
+        std::shared_ptr<std::wstring const> value;
+        size_t size = 0;
+    };
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<unsigned int, std::list<Entry>::iterator> m_lookup;
+    size_t m_nMaxBytes = 4 * 1024 * 1024;
+    size_t m_nUsedBytes = 0;
+    std::mutex m_mutex;
+
+    void Trim();
+public:
+    void SetMaxBytes(size_t maxBytes);
+    std::shared_ptr<std::wstring const> Find(unsigned int key);
+    void Add(unsigned int key, std::shared_ptr<std::wstring const> const &value);
+    void Clear();
+};
+
 class CText {
 public:
+    static const unsigned int DECODE_LANES = 4;
+
     eGame m_game = GAME_NOTSET;
     unsigned int m_nLanguageID = 0;
     CTextMultibyteStrings m_mbStrings;
@@ -81,20 +343,73 @@ public:
     CStringHash *m_pStringHashes = nullptr;
     unsigned int m_nMaxStringLength = 0;
     unsigned int m_nNumStringHashes = 0;
-    wchar_t *m_pTempStrings[32] = {};
-    unsigned int m_nTempStringsCounter = 0;
-    static unsigned int m_characterMap[65536];
+    unsigned int m_nNumUniqueStrings = 0;
+    unsigned int m_nNumSharedStrings = 0;
+    unsigned int m_nNumSharedBits = 0;
+    unsigned int m_nNumSuffixStrings = 0;
+    unsigned int m_nNumSuffixBits = 0;
+    bool m_bStringHashesSorted = false;
+    // the tree and every string passed Validate(true), or the text was encoded here; decoding skips the bounds checks
+    bool m_bValidated = false;
+    std::wstring m_loadError; // why the last LoadTranslationsFile failed the checks, for the caller to report
+    mutable CTextStringCache m_stringCache;
+    std::vector<unsigned int> m_characterMap;
 
     ~CText();
     static unsigned int GetHash(const char *str);
-    void AllocateTempStrings();
+    // hashes the low bytes of the characters, same as GetHash(WtoA(str).c_str()); passing the hash
+    // of a prefix as prefixHash gives the hash of the prefix followed by str
+    static unsigned int GetHash(std::wstring_view str, unsigned int prefixHash = 0);
+    static void GetHashes(std::wstring_view const *strs, size_t count, unsigned int *outHashes, unsigned int prefixHash = 0);
     void Clear();
-    bool LoadTranslationsFile(wchar_t const *filePath, eGame game);
+    // checks the tree of the file; checkStrings also walks every string to its terminator and enables the unchecked decoding
+    bool LoadTranslationsFile(wchar_t const *filePath, eGame game, bool checkStrings = false);
     bool WriteTranslationsFile(wchar_t const *filePath);
-    bool IsKeyPresent(char const *key);
-    wchar_t const *Get(char const *key);
-    wchar_t const *GetByKeyName(char const *key);
-    wchar_t const *GetByHashKey(unsigned int hashKey);
+    // writes a text set up by PrepareTranslationStrings, encoding encodeOrder on the fly
+    bool WriteTranslationsFile(wchar_t const *filePath, std::vector<std::wstring_view> const &encodeOrder);
+    bool WriteTranslations(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const;
+    template<eGame Game> bool ReadTranslations(HANDLE file);
+    template<eGame Game> bool WriteTranslations(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const;
+    bool WriteStringsData(CTextFileWriter &file, std::vector<std::wstring_view> const *encodeOrder) const;
+    bool IsKeyPresent(char const *key) const;
+    wchar_t const *Get(char const *key) const;
+    wchar_t const *GetByKeyName(char const *key) const;
+    // the returned string belongs to the calling thread and stays valid for its next 31 calls
+    wchar_t const *GetByHashKey(unsigned int hashKey) const;
+    std::shared_ptr<std::wstring const> GetShared(unsigned int hashKey) const;
+    CStringHash const *FindStringHash(unsigned int hashKey) const;
+    // checks the structure of a loaded file once: the tree is acyclic, every node is reachable and in range and codes
+    // are at most MAX_TREE_DEPTH bits. checkStrings also checks that every string ends with a terminator inside the
+    // strings data; only then the text is marked validated and decoded without the bounds checks. Nothing is
+    // displayed, the reason of a failure is left in m_loadError
+    bool Validate(bool checkStrings);
+    // returns the leaf of the next code; unchecked once the text is validated
+    unsigned short DecodeLeaf(unsigned int &bitOffset) const;
+    unsigned int DecodeString(unsigned int bitOffset, wchar_t *outStr) const;
+    // decodes count strings, string i to outStrs + i * (m_nMaxStringLength + 1); DECODE_LANES strings are
+    // decoded in lockstep, so the lookups of one string overlap with the lookups of the others
+    void DecodeStrings(unsigned int const *bitOffsets, unsigned int count, wchar_t *outStrs, unsigned int *outLengths) const;
+    // the same in the character type of format Game, one byte per character for the Latin-1 formats, whose
+    // characters the reader masks to a byte. Game must be the format of the text (FM06 for an unset game), a text
+    // of another format gives empty strings
+    template<eGame Game> unsigned int DecodeString(unsigned int bitOffset, typename CTextFormat<Game>::Character *outStr) const;
+    template<eGame Game> void DecodeStrings(unsigned int const *bitOffsets, unsigned int count,
+        typename CTextFormat<Game>::Character *outStrs, unsigned int *outLengths) const;
+    template<eGame Game> bool IsFormat() const;
+    template<typename Char> unsigned int DecodeStringTo(unsigned int bitOffset, Char *outStr) const;
+    template<typename Char> void DecodeStringsTo(unsigned int const *bitOffsets, unsigned int count, Char *outStrs, unsigned int *outLengths) const;
+    // appends the decoded string to output; returns false and leaves output unchanged if the string has a FLAG_SLOW character
+    bool DecodeStringUTF8(unsigned int bitOffset, CTextUTF8Table const &table, std::string &output) const;
+    unsigned int GetEncodedBits(unsigned int bitOffset) const;
     bool EncodeString(wchar_t const *str);
-    bool LoadTranslationStrings(std::map<unsigned int, std::wstring> const &strings, eGame game);
+    bool LoadTranslationStrings(std::map<unsigned int, std::wstring> const &strings, eGame game, bool shareSuffixes = false);
+    bool LoadTranslationStrings(CTextStringArena &strings, eGame game, bool shareSuffixes = false);
+    // builds the tree and the hash table without encoding; encodeOrder gets the strings to encode, in
+    // bitstream order (views into strings, each followed by a terminator)
+    bool PrepareTranslationStrings(CTextStringArena &strings, eGame game, bool shareSuffixes,
+        std::vector<std::wstring_view> &encodeOrder);
+    // replaces, adds and removes strings of a loaded text, keeping its tree and the bits of the untouched strings.
+    // Returns false and leaves the text unchanged if the tree can't encode the new strings or the patched strings
+    // don't read back; the file must be rebuilt then
+    bool PatchTranslationStrings(std::map<unsigned int, std::wstring> const &strings, std::set<unsigned int> const &removedKeys);
 };
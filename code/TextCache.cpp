@@ -0,0 +1,175 @@
+#include "TextCache.h"
+#include <algorithm>
+
+bool CTextCacheSource::Read(std::filesystem::path const &path) {
+    *this = CTextCacheSource();
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize = {};
+    FILETIME writeTime = {};
+    if (!GetFileSizeEx(file, &fileSize) || !GetFileTime(file, nullptr, nullptr, &writeTime)) {
+        CloseHandle(file);
+        return false;
+    }
+    size = fileSize.QuadPart;
+    this->writeTime = ((unsigned long long)writeTime.dwHighDateTime << 32) | writeTime.dwLowDateTime;
+    // FNV-1a
+    contentHash = 0xCBF29CE484222325ull;
+    std::vector<unsigned char> buffer(1024 * 1024);
+    DWORD bytesRead = 0;
+    while (ReadFile(file, buffer.data(), (DWORD)buffer.size(), &bytesRead, nullptr) && bytesRead > 0) {
+        for (DWORD i = 0; i < bytesRead; i++)
+            contentHash = (contentHash ^ buffer[i]) * 0x100000001B3ull;
+    }
+    CloseHandle(file);
+    return true;
+}
+
+CTextCache::~CTextCache() {
+    Close();
+}
+
+bool CTextCache::Open(std::filesystem::path const &cachePath, CTextCacheSource const &source, CTextCacheSource const &keys, eGame game) {
+    Close();
+    m_file = CreateFileW(cachePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(m_file, &fileSize) || (unsigned long long)fileSize.QuadPart < sizeof(Header)) {
+        Close();
+        return false;
+    }
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_pView = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_pView) {
+        Close();
+        return false;
+    }
+    m_pHeader = (Header const *)m_pView;
+    unsigned long long numEntries = m_pHeader->numEntries;
+    unsigned long long expectedSize = sizeof(Header) + numEntries * (sizeof(Entry) + sizeof(unsigned int)) +
+        (unsigned long long)m_pHeader->numCharacters * sizeof(wchar_t);
+    if (m_pHeader->magic != 'HUFC' || m_pHeader->version != 1 || m_pHeader->game != (unsigned int)game ||
+        !(m_pHeader->source == source) || !(m_pHeader->keys == keys) || expectedSize != (unsigned long long)fileSize.QuadPart)
+    {
+        Close();
+        return false;
+    }
+    m_pEntries = (Entry const *)((unsigned char const *)m_pView + sizeof(Header));
+    m_pHashIndex = (unsigned int const *)(m_pEntries + numEntries);
+    m_pCharacters = (wchar_t const *)(m_pHashIndex + numEntries);
+    unsigned long long numCharacters = m_pHeader->numCharacters;
+    for (unsigned int i = 0; i < numEntries; i++) {
+        Entry const &entry = m_pEntries[i];
+        if ((unsigned long long)entry.nameOffset + entry.nameLength > numCharacters ||
+            (unsigned long long)entry.valueOffset + entry.valueLength > numCharacters ||
+            m_pHashIndex[i] >= numEntries)
+        {
+            Close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void CTextCache::Close() {
+    if (m_pView)
+        UnmapViewOfFile(m_pView);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    m_mapping = nullptr;
+    m_pView = nullptr;
+    m_pHeader = nullptr;
+    m_pEntries = nullptr;
+    m_pHashIndex = nullptr;
+    m_pCharacters = nullptr;
+}
+
+bool CTextCache::IsOpen() const {
+    return m_pHeader != nullptr;
+}
+
+unsigned int CTextCache::NumEntries() const {
+    return m_pHeader ? m_pHeader->numEntries : 0;
+}
+
+unsigned int CTextCache::NumNamedEntries() const {
+    return m_pHeader ? m_pHeader->numNamedEntries : 0;
+}
+
+CTextCache::Entry const &CTextCache::GetEntry(unsigned int index) const {
+    return m_pEntries[index];
+}
+
+std::wstring_view CTextCache::GetName(Entry const &entry) const {
+    return std::wstring_view(m_pCharacters + entry.nameOffset, entry.nameLength);
+}
+
+std::wstring_view CTextCache::GetValue(Entry const &entry) const {
+    return std::wstring_view(m_pCharacters + entry.valueOffset, entry.valueLength);
+}
+
+CTextCache::Entry const *CTextCache::Find(unsigned int hash) const {
+    if (!m_pHeader)
+        return nullptr;
+    auto it = std::lower_bound(m_pHashIndex, m_pHashIndex + m_pHeader->numEntries, hash, [this](unsigned int index, unsigned int hash) {
+        return m_pEntries[index].hash < hash;
+        });
+    if (it == m_pHashIndex + m_pHeader->numEntries || m_pEntries[*it].hash != hash)
+        return nullptr;
+    return &m_pEntries[*it];
+}
+
+void CTextCacheWriter::Reserve(size_t numEntries) {
+    m_entries.reserve(numEntries);
+}
+
+void CTextCacheWriter::Add(unsigned int hash, std::wstring_view name, std::wstring_view value, bool named) {
+    CTextCache::Entry entry;
+    entry.hash = hash;
+    entry.flags = named ? CTextCache::CACHE_ENTRY_NAMED : 0;
+    entry.nameOffset = (unsigned int)m_characters.size();
+    entry.nameLength = (unsigned int)name.size();
+    m_characters.append(name);
+    entry.valueOffset = (unsigned int)m_characters.size();
+    entry.valueLength = (unsigned int)value.size();
+    m_characters.append(value);
+    m_entries.push_back(entry);
+    if (named)
+        m_nNumNamedEntries++;
+}
+
+bool CTextCacheWriter::Write(std::filesystem::path const &cachePath, CTextCacheSource const &source, CTextCacheSource const &keys, eGame game) const {
+    CTextCache::Header header = {};
+    header.magic = 'HUFC';
+    header.version = 1;
+    header.game = game;
+    header.numEntries = (unsigned int)m_entries.size();
+    header.source = source;
+    header.keys = keys;
+    header.numNamedEntries = m_nNumNamedEntries;
+    header.numCharacters = (unsigned int)m_characters.size();
+    std::vector<unsigned int> hashIndex(m_entries.size());
+    for (unsigned int i = 0; i < hashIndex.size(); i++)
+        hashIndex[i] = i;
+    std::sort(hashIndex.begin(), hashIndex.end(), [this](unsigned int a, unsigned int b) {
+        return m_entries[a].hash < m_entries[b].hash;
+        });
+    HANDLE file = CreateFileW(cachePath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD written = 0;
+    bool success = WriteFile(file, &header, sizeof(header), &written, nullptr) &&
+        WriteFile(file, m_entries.data(), (DWORD)(m_entries.size() * sizeof(CTextCache::Entry)), &written, nullptr) &&
+        WriteFile(file, hashIndex.data(), (DWORD)(hashIndex.size() * sizeof(unsigned int)), &written, nullptr) &&
+        WriteFile(file, m_characters.data(), (DWORD)(m_characters.size() * sizeof(wchar_t)), &written, nullptr);
+    CloseHandle(file);
+    if (!success)
+        DeleteFileW(cachePath.c_str());
+    return success;
+}
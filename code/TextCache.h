@@ -0,0 +1,74 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include "Text.h"
+
+// Identifies the exact contents of an input file
+class CTextCacheSource {
+public:
+    unsigned long long size = 0;
+    unsigned long long writeTime = 0;
+    unsigned long long contentHash = 0;
+
+    bool Read(std::filesystem::path const &path);
+    bool operator==(CTextCacheSource const &other) const = default;
+};
+
+// Sidecar file with the decoded strings of a .huf file and their resolved key names, stored in
+// export order with an index sorted by hash. It is valid while the .huf file, the keys file
+// and the game are unchanged, and is memory-mapped when opened.
+class CTextCache {
+public:
+    static const unsigned int CACHE_ENTRY_NAMED = 1;
+
+    struct Header {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int game;
+        unsigned int numEntries;
+        CTextCacheSource source;
+        CTextCacheSource keys;
+        unsigned int numNamedEntries;
+        unsigned int numCharacters;
+    };
+
+    struct Entry {
+        unsigned int hash;
+        unsigned int flags;
+        unsigned int nameOffset;
+        unsigned int nameLength;
+        unsigned int valueOffset;
+        unsigned int valueLength;
+    };
+private:
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+    void const *m_pView = nullptr;
+    Header const *m_pHeader = nullptr;
+    Entry const *m_pEntries = nullptr;
+    unsigned int const *m_pHashIndex = nullptr; // entry indices sorted by hash
+    wchar_t const *m_pCharacters = nullptr;
+public:
+    ~CTextCache();
+    bool Open(std::filesystem::path const &cachePath, CTextCacheSource const &source, CTextCacheSource const &keys, eGame game);
+    void Close();
+    bool IsOpen() const;
+    unsigned int NumEntries() const;
+    unsigned int NumNamedEntries() const;
+    Entry const &GetEntry(unsigned int index) const;
+    std::wstring_view GetName(Entry const &entry) const;
+    std::wstring_view GetValue(Entry const &entry) const;
+    Entry const *Find(unsigned int hash) const;
+};
+
+class CTextCacheWriter {
+    std::vector<CTextCache::Entry> m_entries;
+    std::wstring m_characters;
+    unsigned int m_nNumNamedEntries = 0;
+public:
+    void Reserve(size_t numEntries);
+    void Add(unsigned int hash, std::wstring_view name, std::wstring_view value, bool named);
+    bool Write(std::filesystem::path const &cachePath, CTextCacheSource const &source, CTextCacheSource const &keys, eGame game) const;
+};
@@ -0,0 +1,348 @@
+#include "TextDiff.h"
+#include <algorithm>
+#include "utils.h"
+
+std::vector<CStringHash> CTextDiff::SortedHashes(CText const &text) {
+    std::vector<CStringHash> hashes;
+    if (text.m_pStringHashes)
+        hashes.assign(text.m_pStringHashes, text.m_pStringHashes + text.m_nNumStringHashes);
+    auto keyLess = [](CStringHash const &a, CStringHash const &b) {
+        return a.key < b.key;
+    };
+    if (!std::is_sorted(hashes.begin(), hashes.end(), keyLess))
+        std::sort(hashes.begin(), hashes.end(), keyLess);
+    return hashes;
+}
+
+bool CTextDiff::HasSameEncoding(CText const &a, CText const &b) {
+    CTextHuffman const &ha = a.m_huffmanInfo;
+    CTextHuffman const &hb = b.m_huffmanInfo;
+    return a.m_game == b.m_game && ha.m_pHuffChunks && hb.m_pHuffChunks &&
+        ha.m_nNumHuffmanChunks == hb.m_nNumHuffmanChunks && ha.m_nRootLeaf == hb.m_nRootLeaf &&
+        !memcmp(ha.m_pHuffChunks, hb.m_pHuffChunks, ha.m_nNumHuffmanChunks * sizeof(CHuffChunk));
+}
+
+bool CTextDiff::IsEncodedStringEqual(CText const &a, unsigned int offsetA, CText const &b, unsigned int offsetB) {
+    // both files use the same tree - the strings are equal if they decode to the same canonical symbols or leaves
+    CCanonicalHuffman const &canonicalA = a.m_huffmanInfo.m_canonical;
+    CCanonicalHuffman const &canonicalB = b.m_huffmanInfo.m_canonical;
+    bool canonical = canonicalA.IsValid() && canonicalB.IsValid();
+    for (unsigned int i = 0; i <= a.m_nMaxStringLength; i++) {
+        if (canonical) {
+            unsigned int symbolA = canonicalA.DecodeSymbol(a.m_mbStrings, offsetA);
+            if (symbolA != canonicalB.DecodeSymbol(b.m_mbStrings, offsetB) || symbolA >= canonicalA.m_symbols.size())
+                return false;
+            if (canonicalA.m_symbols[symbolA] == 0)
+                return true;
+        }
+        else {
+            unsigned short leafA = a.DecodeLeaf(offsetA);
+            if (leafA != b.DecodeLeaf(offsetB))
+                return false;
+            if (a.m_huffmanInfo.GetChunk(leafA)->character == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+void CTextDiff::DecodeStrings(CText const &text, std::vector<unsigned int> const &offsets, std::vector<std::wstring> &out) {
+    out.resize(offsets.size());
+    ParallelFor(offsets.size(), [&](size_t begin, size_t end) {
+        std::vector<wchar_t> buf(text.m_nMaxStringLength + 1);
+        for (size_t i = begin; i < end; i++) {
+            if (offsets[i] != NO_OFFSET) {
+                unsigned int length = text.DecodeString(offsets[i], buf.data());
+                out[i].assign(buf.data(), length);
+            }
+        }
+    });
+}
+
+std::vector<TextDiffEntry> CTextDiff::Diff(CText const &oldText, CText const &newText) {
+    std::vector<TextDiffEntry> entries;
+    std::vector<unsigned int> oldOffsets, newOffsets;
+    auto a = SortedHashes(oldText);
+    auto b = SortedHashes(newText);
+    bool sameEncoding = HasSameEncoding(oldText, newText);
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        TextDiffEntry entry;
+        unsigned int oldOffset = NO_OFFSET, newOffset = NO_OFFSET;
+        if (j == b.size() || (i < a.size() && a[i].key < b[j].key)) {
+            entry.key = a[i].key;
+            entry.status = TEXTDIFF_REMOVED;
+            oldOffset = a[i++].offset;
+        }
+        else if (i == a.size() || b[j].key < a[i].key) {
+            entry.key = b[j].key;
+            entry.status = TEXTDIFF_ADDED;
+            newOffset = b[j++].offset;
+        }
+        else {
+            entry.key = a[i].key;
+            entry.status = TEXTDIFF_CHANGED;
+            oldOffset = a[i++].offset;
+            newOffset = b[j++].offset;
+        }
+        entries.push_back(entry);
+        oldOffsets.push_back(oldOffset);
+        newOffsets.push_back(newOffset);
+    }
+    // the strings of the common keys are compared by their codes on all cores, the equal ones are never decoded
+    if (sameEncoding) {
+        std::vector<char> equal(entries.size(), 0);
+        ParallelFor(entries.size(), [&](size_t begin, size_t end) {
+            for (size_t e = begin; e < end; e++) {
+                if (entries[e].status == TEXTDIFF_CHANGED && IsEncodedStringEqual(oldText, oldOffsets[e], newText, newOffsets[e]))
+                    equal[e] = 1;
+            }
+        }, 4096);
+        size_t numKept = 0;
+        for (size_t e = 0; e < entries.size(); e++) {
+            if (equal[e])
+                continue;
+            entries[numKept] = entries[e];
+            oldOffsets[numKept] = oldOffsets[e];
+            newOffsets[numKept] = newOffsets[e];
+            numKept++;
+        }
+        entries.resize(numKept);
+        oldOffsets.resize(numKept);
+        newOffsets.resize(numKept);
+    }
+    std::vector<std::wstring> oldValues, newValues;
+    DecodeStrings(oldText, oldOffsets, oldValues);
+    DecodeStrings(newText, newOffsets, newValues);
+    size_t numEntries = 0;
+    for (size_t e = 0; e < entries.size(); e++) {
+        // with different trees the encodings can't be compared, so equal strings are only dropped here
+        if (entries[e].status == TEXTDIFF_CHANGED && oldValues[e] == newValues[e])
+            continue;
+        entries[e].oldValue = std::move(oldValues[e]);
+        entries[e].newValue = std::move(newValues[e]);
+        if (numEntries != e)
+            entries[numEntries] = std::move(entries[e]);
+        numEntries++;
+    }
+    entries.resize(numEntries);
+    return entries;
+}
+
+std::vector<TextDiffEntry> CTextDiff::Merge(CText const *base, CText const &ours, CText const &theirs, std::map<unsigned int, std::wstring> &merged) {
+    std::vector<TextDiffEntry> conflicts;
+    std::vector<unsigned int> keys, baseOffsets, ourOffsets, theirOffsets;
+    std::vector<CStringHash> b;
+    if (base)
+        b = SortedHashes(*base);
+    auto o = SortedHashes(ours);
+    auto t = SortedHashes(theirs);
+    size_t ib = 0, io = 0, it = 0;
+    while (ib < b.size() || io < o.size() || it < t.size()) {
+        unsigned int key = 0xFFFFFFFF;
+        if (ib < b.size())
+            key = b[ib].key;
+        if (io < o.size() && o[io].key < key)
+            key = o[io].key;
+        if (it < t.size() && t[it].key < key)
+            key = t[it].key;
+        keys.push_back(key);
+        baseOffsets.push_back((ib < b.size() && b[ib].key == key) ? b[ib++].offset : NO_OFFSET);
+        ourOffsets.push_back((io < o.size() && o[io].key == key) ? o[io++].offset : NO_OFFSET);
+        theirOffsets.push_back((it < t.size() && t[it].key == key) ? t[it++].offset : NO_OFFSET);
+    }
+    // strings are compared by their codes where two texts share the tree. Only the strings which can't be compared
+    // that way, and the strings which go to the merged text or to a conflict, are decoded
+    enum : char { UNKNOWN, EQUAL, DIFFERENT };
+    auto Compare = [](CText const &a, unsigned int offsetA, CText const &b, unsigned int offsetB, bool sameEncoding) -> char {
+        if (offsetA == NO_OFFSET || offsetB == NO_OFFSET)
+            return (offsetA == offsetB) ? EQUAL : DIFFERENT;
+        if (!sameEncoding)
+            return UNKNOWN;
+        return IsEncodedStringEqual(a, offsetA, b, offsetB) ? EQUAL : DIFFERENT;
+    };
+    size_t numKeys = keys.size();
+    bool sameOursTheirs = HasSameEncoding(ours, theirs);
+    bool sameOursBase = base && HasSameEncoding(ours, *base);
+    bool sameTheirsBase = base && HasSameEncoding(theirs, *base);
+    std::vector<char> oursVsTheirs(numKeys), oursVsBase(numKeys, EQUAL), theirsVsBase(numKeys, EQUAL);
+    ParallelFor(numKeys, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++) {
+            oursVsTheirs[k] = Compare(ours, ourOffsets[k], theirs, theirOffsets[k], sameOursTheirs);
+            // the base version is only needed where both sides differ
+            if (base && oursVsTheirs[k] != EQUAL) {
+                oursVsBase[k] = Compare(ours, ourOffsets[k], *base, baseOffsets[k], sameOursBase);
+                theirsVsBase[k] = Compare(theirs, theirOffsets[k], *base, baseOffsets[k], sameTheirsBase);
+            }
+        }
+    });
+    std::vector<std::wstring> ourValues(numKeys), theirValues(numKeys), baseValues(numKeys);
+    std::vector<char> ourDecoded(numKeys, 0), theirDecoded(numKeys, 0);
+    // decodes the strings of the keys for which needed returns true, unless they are decoded already
+    auto DecodeNeeded = [numKeys](CText const &text, std::vector<unsigned int> const &offsets, std::vector<std::wstring> &values,
+        std::vector<char> &decoded, auto needed)
+    {
+        std::vector<unsigned int> pending(numKeys, NO_OFFSET);
+        for (size_t k = 0; k < numKeys; k++) {
+            if (!decoded[k] && offsets[k] != NO_OFFSET && needed(k)) {
+                pending[k] = offsets[k];
+                decoded[k] = 1;
+            }
+        }
+        std::vector<std::wstring> pendingValues;
+        DecodeStrings(text, pending, pendingValues);
+        for (size_t k = 0; k < numKeys; k++) {
+            if (pending[k] != NO_OFFSET)
+                values[k] = std::move(pendingValues[k]);
+        }
+    };
+    DecodeNeeded(ours, ourOffsets, ourValues, ourDecoded, [&](size_t k) {
+        return oursVsTheirs[k] == UNKNOWN || oursVsBase[k] == UNKNOWN;
+    });
+    DecodeNeeded(theirs, theirOffsets, theirValues, theirDecoded, [&](size_t k) {
+        return oursVsTheirs[k] == UNKNOWN || theirsVsBase[k] == UNKNOWN;
+    });
+    if (base) {
+        std::vector<char> baseDecoded(numKeys, 0);
+        DecodeNeeded(*base, baseOffsets, baseValues, baseDecoded, [&](size_t k) {
+            return oursVsBase[k] == UNKNOWN || theirsVsBase[k] == UNKNOWN;
+        });
+    }
+    // the strings of both sides are present wherever a comparison is unknown
+    std::vector<char> useTheirs(numKeys, 0), isConflict(numKeys, 0);
+    for (size_t k = 0; k < numKeys; k++) {
+        if (oursVsTheirs[k] == UNKNOWN)
+            oursVsTheirs[k] = (ourValues[k] == theirValues[k]) ? EQUAL : DIFFERENT;
+        if (oursVsTheirs[k] == EQUAL)
+            continue;
+        if (!base) {
+            useTheirs[k] = theirOffsets[k] != NO_OFFSET;
+            continue;
+        }
+        if (oursVsBase[k] == UNKNOWN)
+            oursVsBase[k] = (ourValues[k] == baseValues[k]) ? EQUAL : DIFFERENT;
+        if (theirsVsBase[k] == UNKNOWN)
+            theirsVsBase[k] = (theirValues[k] == baseValues[k]) ? EQUAL : DIFFERENT;
+        // both sides changed the string - keep our version and report it
+        isConflict[k] = oursVsBase[k] == DIFFERENT && theirsVsBase[k] == DIFFERENT;
+        useTheirs[k] = oursVsBase[k] == EQUAL;
+    }
+    DecodeNeeded(ours, ourOffsets, ourValues, ourDecoded, [&](size_t k) {
+        return !useTheirs[k] || isConflict[k];
+    });
+    DecodeNeeded(theirs, theirOffsets, theirValues, theirDecoded, [&](size_t k) {
+        return useTheirs[k] || isConflict[k];
+    });
+    for (size_t k = 0; k < numKeys; k++) {
+        if (isConflict[k]) {
+            TextDiffEntry conflict;
+            conflict.key = keys[k];
+            conflict.status = TEXTDIFF_CONFLICT;
+            conflict.oldValue = ourValues[k];
+            conflict.newValue = theirValues[k];
+            conflicts.push_back(conflict);
+        }
+        if (useTheirs[k]) {
+            if (theirOffsets[k] != NO_OFFSET)
+                merged.emplace_hint(merged.end(), keys[k], std::move(theirValues[k]));
+        }
+        else if (ourOffsets[k] != NO_OFFSET)
+            merged.emplace_hint(merged.end(), keys[k], std::move(ourValues[k]));
+    }
+    return conflicts;
+}
+
+bool CTextDiff::Verify(wchar_t const *filePath, eGame game, CTextStringArena const &strings, std::vector<TextDiffEntry> &mismatches,
+    std::wstring &loadError, bool parallel)
+{
+    mismatches.clear();
+    CText text;
+    if (!text.LoadTranslationsFile(filePath, game, true)) {
+        loadError = text.m_loadError;
+        return false;
+    }
+    auto written = SortedHashes(text);
+    std::vector<unsigned int> staged(strings.m_entries.size());
+    for (unsigned int i = 0; i < staged.size(); i++)
+        staged[i] = i;
+    auto stagedLess = [&strings](unsigned int a, unsigned int b) {
+        return strings.m_entries[a].hash < strings.m_entries[b].hash;
+    };
+    if (!std::is_sorted(staged.begin(), staged.end(), stagedLess))
+        std::stable_sort(staged.begin(), staged.end(), stagedLess);
+    // (bit offset, staged entry) of every key in both, decoded in bitstream order
+    std::vector<std::pair<unsigned int, unsigned int>> pairs;
+    pairs.reserve(written.size());
+    size_t i = 0, j = 0;
+    while (i < staged.size() || j < written.size()) {
+        unsigned int stagedKey = (i < staged.size()) ? strings.m_entries[staged[i]].hash : 0;
+        if (j == written.size() || (i < staged.size() && stagedKey < written[j].key)) {
+            TextDiffEntry entry;
+            entry.key = stagedKey;
+            entry.status = TEXTDIFF_REMOVED;
+            entry.oldValue = strings.Get(strings.m_entries[staged[i]]);
+            mismatches.push_back(std::move(entry));
+            i++;
+        }
+        else if (i == staged.size() || written[j].key < stagedKey) {
+            TextDiffEntry entry;
+            entry.key = written[j].key;
+            entry.status = TEXTDIFF_ADDED;
+            mismatches.push_back(std::move(entry));
+            j++;
+        }
+        else {
+            pairs.emplace_back(written[j].offset, staged[i]);
+            // a key staged twice is written once, with the first string
+            while (++i < staged.size() && strings.m_entries[staged[i]].hash == stagedKey)
+                ;
+            j++;
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<char> changed(pairs.size(), 0);
+    // the Latin-1 formats are decoded into 8-bit buffers, the reader has masked their characters to a byte
+    DispatchGame(text.m_game, [&]<eGame Game>() {
+        using Character = typename CTextFormat<Game>::Character;
+        auto CompareStrings = [&](size_t begin, size_t end) {
+            static const unsigned int BATCH_SIZE = 64;
+            unsigned int const stride = text.m_nMaxStringLength + 1;
+            std::vector<Character> buffer((size_t)BATCH_SIZE * stride);
+            unsigned int offsets[BATCH_SIZE], lengths[BATCH_SIZE];
+            for (size_t batch = begin; batch < end; batch += BATCH_SIZE) {
+                unsigned int count = (unsigned int)(std::min)((size_t)BATCH_SIZE, end - batch);
+                for (unsigned int b = 0; b < count; b++)
+                    offsets[b] = pairs[batch + b].first;
+                text.DecodeStrings<Game>(offsets, count, buffer.data(), lengths);
+                for (unsigned int b = 0; b < count; b++) {
+                    Character const *decoded = buffer.data() + (size_t)b * stride;
+                    std::wstring_view expected = strings.Get(strings.m_entries[pairs[batch + b].second]);
+                    if (lengths[b] != expected.size() || !std::equal(decoded, decoded + lengths[b], expected.begin(),
+                        [](Character c, wchar_t e) { return (wchar_t)(std::make_unsigned_t<Character>)c == e; }))
+                    {
+                        changed[batch + b] = 1;
+                    }
+                }
+            }
+        };
+        if (parallel)
+            ParallelFor(pairs.size(), CompareStrings, 4096);
+        else
+            CompareStrings(0, pairs.size());
+    });
+    std::vector<wchar_t> buffer(text.m_nMaxStringLength + 1);
+    for (size_t p = 0; p < pairs.size(); p++) {
+        if (!changed[p])
+            continue;
+        TextDiffEntry entry;
+        entry.key = strings.m_entries[pairs[p].second].hash;
+        entry.status = TEXTDIFF_CHANGED;
+        entry.oldValue = strings.Get(strings.m_entries[pairs[p].second]);
+        entry.newValue.assign(buffer.data(), text.DecodeString(pairs[p].first, buffer.data()));
+        mismatches.push_back(std::move(entry));
+    }
+    std::sort(mismatches.begin(), mismatches.end(), [](TextDiffEntry const &a, TextDiffEntry const &b) {
+        return a.key < b.key;
+        });
+    return true;
+}
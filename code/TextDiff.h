@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include "Text.h"
+
+enum eTextDiffStatus {
+    TEXTDIFF_ADDED,
+    TEXTDIFF_REMOVED,
+    TEXTDIFF_CHANGED,
+    TEXTDIFF_CONFLICT
+};
+
+class TextDiffEntry {
+public:
+    unsigned int key = 0;
+    eTextDiffStatus status = TEXTDIFF_CHANGED;
+    std::wstring oldValue;
+    std::wstring newValue;
+};
+
+class CTextDiff {
+    static constexpr unsigned int NO_OFFSET = 0xFFFFFFFF;
+
+    static std::vector<CStringHash> SortedHashes(CText const &text);
+    static bool HasSameEncoding(CText const &a, CText const &b);
+    static bool IsEncodedStringEqual(CText const &a, unsigned int offsetA, CText const &b, unsigned int offsetB);
+    static void DecodeStrings(CText const &text, std::vector<unsigned int> const &offsets, std::vector<std::wstring> &out);
+public:
+    // reads a written .huf file back and compares every string with the strings it was built from: ADDED keys are
+    // only in the file, REMOVED keys are missing from it, CHANGED strings decode to something else (oldValue is
+    // the expected string). The file is validated with the full string walk, so an unterminated string is a load
+    // error. Returns false if the file can't be read or fails CText::Validate, loadError gets the reason. Callers
+    // which verify several files at once pass parallel = false
+    static bool Verify(wchar_t const *filePath, eGame game, CTextStringArena const &strings, std::vector<TextDiffEntry> &mismatches,
+        std::wstring &loadError, bool parallel = true);
+    static std::vector<TextDiffEntry> Diff(CText const &oldText, CText const &newText);
+    static std::vector<TextDiffEntry> Merge(CText const *base, CText const &ours, CText const &theirs, std::map<unsigned int, std::wstring> &merged);
+};
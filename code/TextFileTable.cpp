@@ -3,21 +3,22 @@
 #include <io.h>
 #include <Windows.h>
 
-std::wstring TextFileTable::Unquoted(std::wstring const &str) {
+void TextFileTable::AddUnquotedCell(std::wstring_view str) {
     if (str.size() > 1 && str[0] == L'"' && str[str.size() - 1] == L'"') {
-        std::wstring unquoted = str.substr(1, str.size() - 2);
-        std::wstring result;
+        std::wstring_view unquoted = str.substr(1, str.size() - 2);
+        size_t offset = mData.size();
         for (size_t i = 0; i < unquoted.size(); i++) {
             if (unquoted[i] == '"' && (i + 1) < unquoted.size() && unquoted[i + 1] == '"')
                 i++;
-            result += unquoted[i];
+            mData += unquoted[i];
         }
-        return result;
+        AddCellAt(offset);
     }
-    return str;
+    else
+        AddCell(str);
 }
 
-std::wstring TextFileTable::Quoted(std::wstring const &str, wchar_t separator) {
+void TextFileRowWriter::AppendQuoted(std::wstring &output, std::wstring_view str, wchar_t separator) {
     bool addQuotes = false;
     for (wchar_t c : str) {
         if (c == L'\r' || c == L'\n' || c == L'"' || c == separator) {
@@ -25,90 +26,107 @@ std::wstring TextFileTable::Quoted(std::wstring const &str, wchar_t separator) {
             break;
         }
     }
-    if (!addQuotes)
-        return str;
-    std::wstring result;
-    result += L'"';
+    if (!addQuotes) {
+        output += str;
+        return;
+    }
+    output += L'"';
     for (wchar_t c : str) {
-        result += c;
+        output += c;
         if (c == L'"')
-            result += c;
+            output += c;
     }
-    result += L'"';
-    return result;
+    output += L'"';
 }
 
 size_t TextFileTable::NumRowsToWrite() const {
-    size_t result = 0;
-    for (size_t r = 0; r < mCells.size(); r++) {
-        bool validRow = false;
-        if (!mCells[r].empty()) {
-            for (size_t c = 0; c < mCells[r].size(); c++) {
-                if (!mCells[r][c].empty()) {
-                    validRow = true;
-                    break;
-                }
-            }
-        }
-        if (validRow)
-            result = r + 1;
+    return mNumRowsToWrite;
+}
+
+void TextFileTable::Truncate(size_t numRows) {
+    if (numRows >= mRowStarts.size())
+        return;
+    mCells.resize(mRowStarts[numRows]);
+    mRowStarts.resize(numRows);
+    mData.resize(mCells.empty() ? 0 : (mCells.back().offset + mCells.back().length));
+    mMaxColumns = 0;
+    for (size_t r = 0; r < mRowStarts.size(); r++) {
+        if (NumColumns(r) > mMaxColumns)
+            mMaxColumns = NumColumns(r);
     }
-    return result;
+    if (mNumRowsToWrite > numRows)
+        mNumRowsToWrite = numRows;
 }
 
 size_t TextFileTable::NumRows() const {
-    return mCells.size();
+    return mRowStarts.size();
 }
 
 size_t TextFileTable::NumColumns(size_t row) const {
-    if (row < mCells.size())
-        return mCells[row].size();
+    if (row < mRowStarts.size())
+        return ((row + 1 < mRowStarts.size()) ? mRowStarts[row + 1] : mCells.size()) - mRowStarts[row];
     return 0;
 }
 
 bool TextFileTable::IsConsistent() const {
-    if (mCells.size() > 1) {
-        for (size_t i = 1; i < mCells.size(); i++) {
-            if (mCells[i - 1].size() != mCells[i].size())
-                return false;
-        }
+    for (size_t i = 1; i < mRowStarts.size(); i++) {
+        if (NumColumns(i - 1) != NumColumns(i))
+            return false;
     }
     return true;
 }
 
 size_t TextFileTable::MaxColumns() const {
-    size_t maxColumns = 0;
-    for (auto const &row : mCells) {
-        if (row.size() > maxColumns)
-            maxColumns = row.size();
+    return mMaxColumns;
+}
+
+std::wstring_view TextFileTable::Cell(size_t column, size_t row) const {
+    if (column < NumColumns(row)) {
+        CellRef const &cell = mCells[mRowStarts[row] + column];
+        return std::wstring_view(mData.data() + cell.offset, cell.length);
     }
-    return maxColumns;
+    return std::wstring_view();
 }
 
-std::vector<std::vector<std::wstring>> const &TextFileTable::Rows() const {
-    return mCells;
+void TextFileTable::BeginRow() {
+    mRowStarts.push_back(mCells.size());
 }
 
-std::vector<std::wstring> const &TextFileTable::Row(size_t row) const {
-    static std::vector<std::wstring> emptyRow;
-    if (row < mCells.size())
-        return mCells[row];
-    return emptyRow;
+void TextFileTable::AddCellAt(size_t offset) {
+    if (mRowStarts.empty())
+        BeginRow();
+    mCells.push_back({ offset, mData.size() - offset });
+    size_t numColumns = mCells.size() - mRowStarts.back();
+    if (numColumns > mMaxColumns)
+        mMaxColumns = numColumns;
+    if (mData.size() != offset)
+        mNumRowsToWrite = mRowStarts.size();
 }
 
-std::wstring const &TextFileTable::Cell(size_t column, size_t row) const {
-    static std::wstring emptyCell;
-    if (row < mCells.size() && column < mCells[row].size())
-        return mCells[row][column];
-    return emptyCell;
+void TextFileTable::AddCell(std::wstring_view cell) {
+    size_t offset = mData.size();
+    mData.append(cell);
+    AddCellAt(offset);
 }
 
-void TextFileTable::AddRow(std::vector<std::wstring> const &row) {
-    mCells.push_back(row);
+void TextFileTable::AddRow(std::initializer_list<std::wstring_view> row) {
+    BeginRow();
+    for (auto const &cell : row)
+        AddCell(cell);
+}
+
+void TextFileTable::Reserve(size_t numRows, size_t numCells, size_t numCharacters) {
+    mRowStarts.reserve(numRows);
+    mCells.reserve(numCells);
+    mData.reserve(numCharacters);
 }
 
 void TextFileTable::Clear() {
+    mData.clear();
     mCells.clear();
+    mRowStarts.clear();
+    mNumRowsToWrite = 0;
+    mMaxColumns = 0;
 }
 
 bool TextFileTable::Read(std::filesystem::path const &filename, wchar_t separator) {
@@ -197,120 +215,148 @@ bool TextFileTable::Read(std::filesystem::path const &filename, wchar_t separato
                 data[i] = (data[i] >> 8) | (data[i] << 8);
         }
 
-        std::vector<std::wstring> mLines;
-        std::wstring currentLine;
-        unsigned int numQuotes = 0;
+        // single pass: line breaks and separators inside quotes belong to the cell
+        Reserve(0, 0, numWideChars);
+        BeginRow();
+        bool inQuotes = false;
+        long cellStart = 0;
         for (long i = 0; i < numWideChars; i++) {
-            if (data[i] == L'\n') {
-                if (numQuotes % 2)
-                    currentLine += data[i];
-                else {
-                    mLines.push_back(currentLine);
-                    currentLine.clear();
-                }
-            }
-            else if (data[i] == L'\r') {
-                if (numQuotes % 2)
-                    currentLine += data[i];
-                if ((i + 1) < numWideChars && data[i + 1] == L'\n') {
+            wchar_t c = data[i];
+            if (c == L'"')
+                inQuotes = !inQuotes;
+            else if (!inQuotes && (c == separator || c == L'\n' || c == L'\r')) {
+                AddUnquotedCell(std::wstring_view(data + cellStart, i - cellStart));
+                if (c == L'\r' && (i + 1) < numWideChars && data[i + 1] == L'\n')
                     i++;
-                    if (numQuotes % 2)
-                        currentLine += data[i];
-                }
-                if ((numQuotes % 2) == 0) {
-                    mLines.push_back(currentLine);
-                    currentLine.clear();
-                }
-            }
-            else {
-                if (data[i] == L'"')
-                    numQuotes++;
-                currentLine += data[i];
+                if (c != separator)
+                    BeginRow();
+                cellStart = i + 1;
             }
         }
-        if (!currentLine.empty() || !mLines.empty())
-            mLines.push_back(currentLine);
+        AddUnquotedCell(std::wstring_view(data + cellStart, numWideChars - cellStart));
         delete[] data;
 
-        mCells.resize(mLines.size());
-
-        for (size_t l = 0; l < mLines.size(); l++) {
-            numQuotes = 0;
-            auto const &line = mLines[l];
-            std::wstring value;
-            for (size_t i = 0; i < line.size(); i++) {
-                if (line[i] == L'"')
-                    numQuotes++;
-                else if (line[i] == separator && ((numQuotes % 2) == 0)) {
-                    mCells[l].push_back(Unquoted(value));
-                    value.clear();
-                    continue;
-                }
-                value += line[i];
-            }
-            mCells[l].push_back(Unquoted(value));
-            value.clear();
-        }
-
-        mCells.resize(NumRowsToWrite());
+        Truncate(NumRowsToWrite());
     }
     return true;
 }
 
 bool TextFileTable::Write(std::filesystem::path const &filename, wchar_t separator, eEncoding encoding) {
-    if (filename.empty())
+    TextFileRowWriter writer;
+    if (!writer.Open(filename, encoding))
         return false;
-    auto parentPath = filename.parent_path();
-    if (!parentPath.empty() && !std::filesystem::exists(parentPath)) {
-        std::error_code ec;
-        if (!std::filesystem::create_directories(parentPath, ec))
-            return false;
-    }
     std::wstring output;
     size_t numRowsToWrite = NumRowsToWrite();
     size_t numColumnsToWrite = MaxColumns();
     if (numColumnsToWrite > 0) {
+        output.reserve(mData.size() + numRowsToWrite * (numColumnsToWrite + 1));
         for (size_t r = 0; r < numRowsToWrite; r++) {
             for (size_t c = 0; c < numColumnsToWrite; c++) {
                 if (c != 0)
                     output += separator;
-                output += Quoted(Cell(c, r), separator);
+                TextFileRowWriter::AppendQuoted(output, Cell(c, r), separator);
             }
             output += L"\r\n";
         }
     }
     else
         output += L"\r\n";
-    
-    FILE *mFile = _wfopen(filename.c_str(), L"wb");
-    if (!mFile)
-        return false;
+    std::string encoded;
+    TextFileRowWriter::Encode(encoded, output, encoding);
+    return writer.WriteEncoded(encoded) && writer.Close();
+}
+
+TextFileRowWriter::~TextFileRowWriter() {
+    Close();
+}
+
+void TextFileRowWriter::AppendRow(std::wstring &output, std::initializer_list<std::wstring_view> row, wchar_t separator) {
+    bool first = true;
+    for (auto const &cell : row) {
+        if (!first)
+            output += separator;
+        AppendQuoted(output, cell, separator);
+        first = false;
+    }
+    output += L"\r\n";
+}
+
+void TextFileRowWriter::Encode(std::string &output, std::wstring_view text, eEncoding encoding) {
+    if (text.empty())
+        return;
     if (encoding == ENCODING_ANSI || encoding == ENCODING_UTF8 || encoding == ENCODING_UTF8_BOM) {
-        if (encoding == ENCODING_UTF8_BOM) {
-            unsigned char bom[3] = { 0xEF, 0xBB, 0xBF };
-            fwrite(bom, 3, 1, mFile);
-        }
         unsigned int codePage = (encoding == ENCODING_ANSI) ? 1252 : CP_UTF8;
-        int size_needed = WideCharToMultiByte(codePage, 0, &output[0], (int)output.size(), NULL, 0, NULL, NULL);
-        std::string encoded(size_needed, 0);
-        WideCharToMultiByte(codePage, 0, &output[0], (int)output.size(), &encoded[0], size_needed, NULL, NULL);
-        fwrite(encoded.data(), 1, encoded.size(), mFile);
+        int size_needed = WideCharToMultiByte(codePage, 0, text.data(), (int)text.size(), NULL, 0, NULL, NULL);
+        size_t offset = output.size();
+        output.resize(offset + size_needed);
+        WideCharToMultiByte(codePage, 0, text.data(), (int)text.size(), &output[offset], size_needed, NULL, NULL);
+    }
+    else if (encoding == ENCODING_UTF16LE_BOM || encoding == ENCODING_UTF16BE_BOM) {
+        size_t offset = output.size();
+        output.resize(offset + text.size() * 2);
+        for (size_t i = 0; i < text.size(); i++) {
+            unsigned char lo = text[i] & 0xFF, hi = text[i] >> 8;
+            output[offset + i * 2] = (encoding == ENCODING_UTF16BE_BOM) ? hi : lo;
+            output[offset + i * 2 + 1] = (encoding == ENCODING_UTF16BE_BOM) ? lo : hi;
+        }
+    }
+}
+
+void TextFileRowWriter::AppendEncodedCell(std::string &output, std::wstring_view cell, wchar_t separator, eEncoding encoding) {
+    bool copy = encoding == ENCODING_ANSI || encoding == ENCODING_UTF8 || encoding == ENCODING_UTF8_BOM;
+    for (size_t i = 0; i < cell.size() && copy; i++) {
+        wchar_t c = cell[i];
+        if (c >= 0x80 || c == L'\r' || c == L'\n' || c == L'"' || c == separator)
+            copy = false;
+    }
+    if (copy) {
+        output.append(cell.begin(), cell.end());
+        return;
+    }
+    std::wstring quoted;
+    AppendQuoted(quoted, cell, separator);
+    Encode(output, quoted, encoding);
+}
+
+bool TextFileRowWriter::Open(std::filesystem::path const &filename, eEncoding encoding) {
+    Close();
+    if (filename.empty())
+        return false;
+    auto parentPath = filename.parent_path();
+    if (!parentPath.empty() && !std::filesystem::exists(parentPath)) {
+        std::error_code ec;
+        if (!std::filesystem::create_directories(parentPath, ec))
+            return false;
+    }
+    mFile = _wfopen(filename.c_str(), L"wb");
+    if (!mFile)
+        return false;
+    mFailed = false;
+    if (encoding == ENCODING_UTF8_BOM) {
+        unsigned char bom[3] = { 0xEF, 0xBB, 0xBF };
+        fwrite(bom, 3, 1, mFile);
     }
     else if (encoding == ENCODING_UTF16LE_BOM || encoding == ENCODING_UTF16BE_BOM) {
         unsigned char bom[2] = { 0xFF, 0xFE };
-        if (encoding == ENCODING_UTF16BE_BOM) {
+        if (encoding == ENCODING_UTF16BE_BOM)
             std::swap(bom[0], bom[1]);
-            std::vector<wchar_t> swapped(output.size());
-            for (size_t i = 0; i < output.size(); i++)
-                swapped[i] = (output[i] >> 8) | (output[i] << 8);
-            fwrite(bom, 2, 1, mFile);
-            fwrite(swapped.data(), 2, swapped.size(), mFile);
-        }
-        else {
-            fwrite(bom, 2, 1, mFile);
-            fwrite(output.data(), 2, output.size(), mFile);
-        }
+        fwrite(bom, 2, 1, mFile);
     }
-    fclose(mFile);
     return true;
 }
+
+bool TextFileRowWriter::WriteEncoded(std::string_view data) {
+    if (!mFile)
+        return false;
+    if (!data.empty() && fwrite(data.data(), 1, data.size(), mFile) != data.size())
+        mFailed = true;
+    return !mFailed;
+}
+
+bool TextFileRowWriter::Close() {
+    if (!mFile)
+        return false;
+    fclose(mFile);
+    mFile = nullptr;
+    return !mFailed;
+}
@@ -1,7 +1,10 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
+#include <initializer_list>
 #include <filesystem>
+#include <cstdio>
 
 enum eEncoding {
     ENCODING_ANSI,
@@ -11,22 +14,50 @@ enum eEncoding {
     ENCODING_UTF16BE_BOM
 };
 
+// Cells are stored one after another in a single buffer; rows and cells are offsets into it
 class TextFileTable {
-    std::vector<std::vector<std::wstring>> mCells;
+    struct CellRef {
+        size_t offset;
+        size_t length;
+    };
+    std::wstring mData;
+    std::vector<CellRef> mCells;
+    std::vector<size_t> mRowStarts; // index of the first cell of each row
+    size_t mNumRowsToWrite = 0; // rows up to the last row with a non-empty cell
+    size_t mMaxColumns = 0;
 
-    static std::wstring Unquoted(std::wstring const &str);
-    static std::wstring Quoted(std::wstring const &str, wchar_t separator);
+    void AddCellAt(size_t offset);
+    void AddUnquotedCell(std::wstring_view str);
     size_t NumRowsToWrite() const;
+    void Truncate(size_t numRows);
 public:
     size_t NumRows() const;
     size_t NumColumns(size_t row) const;
     bool IsConsistent() const;
     size_t MaxColumns() const;
-    std::vector<std::vector<std::wstring>> const &Rows() const;
-    std::vector<std::wstring> const &Row(size_t row) const;
-    std::wstring const &Cell(size_t column, size_t row) const;
-    void AddRow(std::vector<std::wstring> const &row);
+    std::wstring_view Cell(size_t column, size_t row) const;
+    void BeginRow();
+    void AddCell(std::wstring_view cell);
+    void AddRow(std::initializer_list<std::wstring_view> row);
+    void Reserve(size_t numRows, size_t numCells, size_t numCharacters);
     void Clear();
     bool Read(std::filesystem::path const &filename, wchar_t separator = L',');
     bool Write(std::filesystem::path const &filename, wchar_t separator = L',', eEncoding encoding = ENCODING_UTF8_BOM);
 };
+
+// Writes rows in the TextFileTable format without keeping them: rows are formatted and encoded into
+// blocks by the caller (possibly on another thread), the writer only appends the blocks to the file
+class TextFileRowWriter {
+    FILE *mFile = nullptr;
+    bool mFailed = false;
+public:
+    ~TextFileRowWriter();
+    static void AppendQuoted(std::wstring &output, std::wstring_view str, wchar_t separator);
+    static void AppendRow(std::wstring &output, std::initializer_list<std::wstring_view> row, wchar_t separator);
+    static void Encode(std::string &output, std::wstring_view text, eEncoding encoding);
+    // quotes and encodes one cell; ASCII cells which need no quotes are copied as they are
+    static void AppendEncodedCell(std::string &output, std::wstring_view cell, wchar_t separator, eEncoding encoding);
+    bool Open(std::filesystem::path const &filename, eEncoding encoding = ENCODING_UTF8_BOM);
+    bool WriteEncoded(std::string_view data);
+    bool Close();
+};
@@ -0,0 +1,337 @@
+#include "TextSearch.h"
+#include "utils.h"
+#include <algorithm>
+#include <mutex>
+
+std::vector<std::wstring> CTextSearchQuery::GetRegexLiterals(std::wstring_view pattern) {
+    // only runs of plain characters outside of groups and classes are taken, a character followed by
+    // ?, * or {} is optional; an alternative at the top level gives no literals
+    std::vector<std::wstring> literals;
+    std::wstring current;
+    unsigned int depth = 0;
+    auto Flush = [&literals, &current]() {
+        if (!current.empty())
+            literals.push_back(current);
+        current.clear();
+    };
+    for (size_t i = 0; i < pattern.size(); i++) {
+        wchar_t c = pattern[i];
+        if (c == L'|') {
+            if (depth == 0)
+                return {};
+        }
+        else if (c == L'(') {
+            Flush();
+            depth++;
+        }
+        else if (c == L')') {
+            Flush();
+            if (depth > 0)
+                depth--;
+        }
+        else if (c == L'[') {
+            Flush();
+            size_t end = i + 1;
+            if (end < pattern.size() && pattern[end] == L'^')
+                end++;
+            if (end < pattern.size() && pattern[end] == L']')
+                end++;
+            while (end < pattern.size() && pattern[end] != L']')
+                end += (pattern[end] == L'\\') ? 2 : 1;
+            i = end;
+        }
+        else if (c == L'?' || c == L'*' || c == L'{') {
+            if (!current.empty())
+                current.pop_back();
+            Flush();
+            if (c == L'{') {
+                while (i < pattern.size() && pattern[i] != L'}')
+                    i++;
+            }
+        }
+        else if (c == L'+' || c == L'.' || c == L'^' || c == L'$')
+            Flush();
+        else if (c == L'\\') {
+            // escaped punctuation is literal, escaped letters and digits are classes, anchors or codes
+            wchar_t next = (i + 1 < pattern.size()) ? pattern[++i] : 0;
+            bool isWordCharacter = (next >= L'0' && next <= L'9') || (next >= L'A' && next <= L'Z') || (next >= L'a' && next <= L'z');
+            if (next == 0 || isWordCharacter)
+                Flush();
+            else if (depth == 0)
+                current += next;
+        }
+        else if (depth == 0)
+            current += c;
+    }
+    Flush();
+    return literals;
+}
+
+bool CTextSearchQuery::Set(std::wstring const &text, bool regex, bool ignoreCase) {
+    m_bRegex = regex;
+    m_bIgnoreCase = ignoreCase;
+    m_text = text;
+    m_literals.clear();
+    if (regex) {
+        try {
+            auto flags = std::regex_constants::ECMAScript | std::regex_constants::optimize;
+            m_regex.assign(text, ignoreCase ? (flags | std::regex_constants::icase) : flags);
+        }
+        catch (std::regex_error const &) {
+            return false;
+        }
+        m_literals = GetRegexLiterals(text);
+    }
+    else {
+        if (ignoreCase)
+            CTextSearchIndex::FoldCase(m_text);
+        m_literals.push_back(m_text);
+    }
+    return true;
+}
+
+std::vector<std::wstring> const &CTextSearchQuery::GetLiterals() const {
+    return m_literals;
+}
+
+bool CTextSearchQuery::Matches(std::wstring_view str, std::wstring &buffer) const {
+    if (m_bRegex)
+        return std::regex_search(str.begin(), str.end(), m_regex);
+    if (!m_bIgnoreCase)
+        return str.find(m_text) != std::wstring_view::npos;
+    buffer.assign(str);
+    CTextSearchIndex::FoldCase(buffer);
+    return buffer.find(m_text) != std::wstring::npos;
+}
+
+CTextSearchIndex::~CTextSearchIndex() {
+    Close();
+}
+
+wchar_t CTextSearchIndex::FoldCase(wchar_t c) {
+    // Latin, Latin-1, Latin Extended-A, Greek and Cyrillic capitals; the dotted and dotless i are left alone
+    if (c < 0x80)
+        return (c >= L'A' && c <= L'Z') ? (wchar_t)(c + 0x20) : c;
+    if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+        return (wchar_t)(c + 0x20);
+    if (c >= 0x100 && c <= 0x17F) {
+        if ((c <= 0x12F || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177)) && !(c & 1))
+            return (wchar_t)(c + 1);
+        if (((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) && (c & 1))
+            return (wchar_t)(c + 1);
+        return (c == 0x178) ? (wchar_t)0xFF : c;
+    }
+    if (c >= 0x391 && c <= 0x3A9 && c != 0x3A2)
+        return (wchar_t)(c + 0x20);
+    if (c >= 0x410 && c <= 0x42F)
+        return (wchar_t)(c + 0x20);
+    if (c >= 0x400 && c <= 0x40F)
+        return (wchar_t)(c + 0x50);
+    return c;
+}
+
+void CTextSearchIndex::FoldCase(std::wstring &str) {
+    for (auto &c : str)
+        c = FoldCase(c);
+}
+
+unsigned long long CTextSearchIndex::MakeTrigram(wchar_t a, wchar_t b, wchar_t c) {
+    return ((unsigned long long)(unsigned short)a << 32) | ((unsigned long long)(unsigned short)b << 16) | (unsigned short)c;
+}
+
+bool CTextSearchIndex::Build(CText const &text, std::filesystem::path const &indexPath, CTextCacheSource const &source, eGame game) {
+    unsigned int numEntries = text.m_nNumStringHashes;
+    // (trigram, entry) for the distinct trigrams of every string
+    std::vector<std::pair<unsigned long long, unsigned int>> pairs;
+    std::mutex pairsMutex;
+    // the Latin-1 formats are decoded into 8-bit buffers and widened by the case folding
+    DispatchGame(text.m_game, [&]<eGame Game>() {
+        using Character = typename CTextFormat<Game>::Character;
+        ParallelFor(numEntries, [&](size_t begin, size_t end) {
+            std::vector<Character> decoded(text.m_nMaxStringLength + 1);
+            std::vector<wchar_t> buffer(text.m_nMaxStringLength + 1);
+            std::vector<unsigned long long> trigrams;
+            std::vector<std::pair<unsigned long long, unsigned int>> rangePairs;
+            for (size_t i = begin; i < end; i++) {
+                unsigned int length = text.DecodeString<Game>(text.m_pStringHashes[i].offset, decoded.data());
+                for (unsigned int c = 0; c < length; c++)
+                    buffer[c] = FoldCase((wchar_t)(std::make_unsigned_t<Character>)decoded[c]);
+                trigrams.clear();
+                for (unsigned int c = 0; c + 2 < length; c++)
+                    trigrams.push_back(MakeTrigram(buffer[c], buffer[c + 1], buffer[c + 2]));
+                std::sort(trigrams.begin(), trigrams.end());
+                trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+                for (auto trigram : trigrams)
+                    rangePairs.emplace_back(trigram, (unsigned int)i);
+            }
+            std::lock_guard<std::mutex> lock(pairsMutex);
+            pairs.insert(pairs.end(), rangePairs.begin(), rangePairs.end());
+        });
+    });
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<Trigram> trigrams;
+    std::vector<unsigned int> postings(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (trigrams.empty() || trigrams.back().trigram != pairs[i].first)
+            trigrams.push_back({ pairs[i].first, (unsigned int)i, 0 });
+        trigrams.back().numPostings++;
+        postings[i] = pairs[i].second;
+    }
+    pairs.clear();
+    pairs.shrink_to_fit();
+    Header header = {};
+    header.magic = 'HUFS';
+    header.version = 1;
+    header.game = game;
+    header.numEntries = numEntries;
+    header.numTrigrams = (unsigned int)trigrams.size();
+    header.numPostings = (unsigned int)postings.size();
+    header.source = source;
+    HANDLE file = CreateFileW(indexPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD written = 0;
+    bool success = WriteFile(file, &header, sizeof(header), &written, nullptr) &&
+        WriteFile(file, trigrams.data(), (DWORD)(trigrams.size() * sizeof(Trigram)), &written, nullptr) &&
+        WriteFile(file, postings.data(), (DWORD)(postings.size() * sizeof(unsigned int)), &written, nullptr);
+    CloseHandle(file);
+    if (!success)
+        DeleteFileW(indexPath.c_str());
+    return success;
+}
+
+bool CTextSearchIndex::Open(std::filesystem::path const &indexPath, CTextCacheSource const &source, eGame game) {
+    Close();
+    m_file = CreateFileW(indexPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(m_file, &fileSize) || (unsigned long long)fileSize.QuadPart < sizeof(Header)) {
+        Close();
+        return false;
+    }
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_pView = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_pView) {
+        Close();
+        return false;
+    }
+    m_pHeader = (Header const *)m_pView;
+    unsigned long long expectedSize = sizeof(Header) + (unsigned long long)m_pHeader->numTrigrams * sizeof(Trigram) +
+        (unsigned long long)m_pHeader->numPostings * sizeof(unsigned int);
+    if (m_pHeader->magic != 'HUFS' || m_pHeader->version != 1 || m_pHeader->game != (unsigned int)game ||
+        !(m_pHeader->source == source) || expectedSize != (unsigned long long)fileSize.QuadPart)
+    {
+        Close();
+        return false;
+    }
+    m_pTrigrams = (Trigram const *)((unsigned char const *)m_pView + sizeof(Header));
+    m_pPostings = (unsigned int const *)(m_pTrigrams + m_pHeader->numTrigrams);
+    for (unsigned int i = 0; i < m_pHeader->numTrigrams; i++) {
+        Trigram const &trigram = m_pTrigrams[i];
+        if ((unsigned long long)trigram.postingsOffset + trigram.numPostings > m_pHeader->numPostings ||
+            (i > 0 && m_pTrigrams[i - 1].trigram >= trigram.trigram))
+        {
+            Close();
+            return false;
+        }
+    }
+    for (unsigned int i = 0; i < m_pHeader->numPostings; i++) {
+        if (m_pPostings[i] >= m_pHeader->numEntries) {
+            Close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void CTextSearchIndex::Close() {
+    if (m_pView)
+        UnmapViewOfFile(m_pView);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+    m_mapping = nullptr;
+    m_pView = nullptr;
+    m_pHeader = nullptr;
+    m_pTrigrams = nullptr;
+    m_pPostings = nullptr;
+}
+
+bool CTextSearchIndex::IsOpen() const {
+    return m_pHeader != nullptr;
+}
+
+unsigned int CTextSearchIndex::NumEntries() const {
+    return m_pHeader ? m_pHeader->numEntries : 0;
+}
+
+CTextSearchIndex::Trigram const *CTextSearchIndex::FindTrigram(unsigned long long trigram) const {
+    Trigram const *end = m_pTrigrams + m_pHeader->numTrigrams;
+    Trigram const *it = std::lower_bound(m_pTrigrams, end, trigram, [](Trigram const &t, unsigned long long trigram) {
+        return t.trigram < trigram;
+        });
+    if (it == end || it->trigram != trigram)
+        return nullptr;
+    return it;
+}
+
+void CTextSearchIndex::FindCandidates(std::vector<std::wstring> const &literals, std::vector<unsigned int> &candidates) const {
+    candidates.clear();
+    if (!m_pHeader)
+        return;
+    std::vector<Trigram const *> lists;
+    for (auto const &literal : literals) {
+        std::wstring folded = literal;
+        FoldCase(folded);
+        for (size_t c = 0; c + 2 < folded.size(); c++) {
+            Trigram const *trigram = FindTrigram(MakeTrigram(folded[c], folded[c + 1], folded[c + 2]));
+            if (!trigram)
+                return;
+            lists.push_back(trigram);
+        }
+    }
+    if (lists.empty()) {
+        candidates.resize(m_pHeader->numEntries);
+        for (unsigned int i = 0; i < m_pHeader->numEntries; i++)
+            candidates[i] = i;
+        return;
+    }
+    // the shortest list is intersected with the others; each lookup starts where the previous one ended
+    std::sort(lists.begin(), lists.end(), [](Trigram const *a, Trigram const *b) {
+        return a->numPostings < b->numPostings;
+        });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+    candidates.assign(m_pPostings + lists[0]->postingsOffset, m_pPostings + lists[0]->postingsOffset + lists[0]->numPostings);
+    for (size_t l = 1; l < lists.size() && !candidates.empty(); l++) {
+        unsigned int const *it = m_pPostings + lists[l]->postingsOffset;
+        unsigned int const *end = it + lists[l]->numPostings;
+        size_t numKept = 0;
+        for (unsigned int candidate : candidates) {
+            it = std::lower_bound(it, end, candidate);
+            if (it == end)
+                break;
+            if (*it == candidate)
+                candidates[numKept++] = candidate;
+        }
+        candidates.resize(numKept);
+    }
+}
+
+void CTextSearchIndex::Search(CText const &text, CTextSearchQuery const &query, std::vector<unsigned int> const &candidates,
+    std::vector<std::pair<unsigned int, std::wstring>> &matches)
+{
+    std::vector<wchar_t> buffer(text.m_nMaxStringLength + 1);
+    std::wstring folded;
+    for (unsigned int candidate : candidates) {
+        if (candidate >= text.m_nNumStringHashes)
+            continue;
+        CStringHash const &entry = text.m_pStringHashes[candidate];
+        std::wstring_view str(buffer.data(), text.DecodeString(entry.offset, buffer.data()));
+        if (query.Matches(str, folded))
+            matches.emplace_back(entry.key, std::wstring(str));
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <regex>
+#include <filesystem>
+#include "Text.h"
+#include "TextCache.h"
+
+// A substring or regular expression query, with the literal parts that every matching string contains
+class CTextSearchQuery {
+    std::wstring m_text; // case-folded with m_bIgnoreCase
+    std::wregex m_regex;
+    bool m_bRegex = false;
+    bool m_bIgnoreCase = false;
+    std::vector<std::wstring> m_literals;
+
+    static std::vector<std::wstring> GetRegexLiterals(std::wstring_view pattern);
+public:
+    // returns false on an invalid regular expression
+    bool Set(std::wstring const &text, bool regex, bool ignoreCase);
+    std::vector<std::wstring> const &GetLiterals() const;
+    // buffer is scratch space for the case-folded string
+    bool Matches(std::wstring_view str, std::wstring &buffer) const;
+};
+
+// Trigram index of the decoded strings of a .huf file, kept in <file>.hufindex and memory-mapped when
+// opened. Trigrams are taken from the case-folded strings, so one index serves case-sensitive and
+// case-insensitive queries; every trigram has the sorted list of the strings, by their index in the
+// hash table, which contain it.
+// The index is valid while the .huf file and the game are unchanged.
+class CTextSearchIndex {
+public:
+    struct Header {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int game;
+        unsigned int numEntries;
+        unsigned int numTrigrams;
+        unsigned int numPostings;
+        CTextCacheSource source;
+    };
+
+    struct Trigram {
+        unsigned long long trigram;
+        unsigned int postingsOffset;
+        unsigned int numPostings;
+    };
+private:
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+    void const *m_pView = nullptr;
+    Header const *m_pHeader = nullptr;
+    Trigram const *m_pTrigrams = nullptr; // sorted by trigram
+    unsigned int const *m_pPostings = nullptr;
+
+    Trigram const *FindTrigram(unsigned long long trigram) const;
+public:
+    ~CTextSearchIndex();
+    static wchar_t FoldCase(wchar_t c);
+    static void FoldCase(std::wstring &str);
+    static unsigned long long MakeTrigram(wchar_t a, wchar_t b, wchar_t c);
+    // decodes every string of a validated text and writes its index
+    static bool Build(CText const &text, std::filesystem::path const &indexPath, CTextCacheSource const &source, eGame game);
+
+    bool Open(std::filesystem::path const &indexPath, CTextCacheSource const &source, eGame game);
+    void Close();
+    bool IsOpen() const;
+    unsigned int NumEntries() const;
+    // entries which contain every trigram of the literals; every entry if the literals are shorter than a trigram
+    void FindCandidates(std::vector<std::wstring> const &literals, std::vector<unsigned int> &candidates) const;
+    // decodes the candidates (indices in the hash table of text) and adds the (hash, string) pairs which match the query
+    static void Search(CText const &text, CTextSearchQuery const &query, std::vector<unsigned int> const &candidates,
+        std::vector<std::pair<unsigned int, std::wstring>> &matches);
+};
@@ -0,0 +1,158 @@
+#include "TokenEscaper.h"
+#include "TextFileTable.h"
+#include <bit>
+#include <cwchar>
+
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)) && WCHAR_MAX == 0xFFFF
+#include <emmintrin.h>
+#define TOKEN_ESCAPER_SSE2
+#endif
+
+void CTokenEscaper::Set(Replacements const &replacements) {
+    m_replacements = replacements;
+    m_firstCharacters.assign(65536 / 64, 0);
+    m_candidates.clear();
+    m_scanCharacters.clear();
+    for (unsigned int i = 0; i < m_replacements.size(); i++) {
+        std::wstring const &key = m_replacements[i].first;
+        if (key.empty())
+            continue;
+        wchar_t first = key[0];
+        if (!IsFirstCharacter(first))
+            m_scanCharacters.push_back(first);
+        m_firstCharacters[(unsigned short)first / 64] |= 1ull << ((unsigned short)first % 64);
+        m_candidates[first].push_back(i);
+    }
+    if (m_scanCharacters.size() > MAX_SCAN_CHARACTERS)
+        m_scanCharacters.clear();
+}
+
+CTokenEscaper::Replacements const &CTokenEscaper::GetReplacements() const {
+    return m_replacements;
+}
+
+bool CTokenEscaper::IsEmpty() const {
+    return m_candidates.empty();
+}
+
+bool CTokenEscaper::IsFirstCharacter(wchar_t c) const {
+    return (m_firstCharacters[(unsigned short)c / 64] >> ((unsigned short)c % 64)) & 1;
+}
+
+size_t CTokenEscaper::FindFirstCharacter(std::wstring_view input, size_t pos) const {
+#ifdef TOKEN_ESCAPER_SSE2
+    if (!m_scanCharacters.empty()) {
+        // eight characters are compared with every first character at once
+        __m128i patterns[MAX_SCAN_CHARACTERS];
+        size_t numPatterns = m_scanCharacters.size();
+        for (size_t i = 0; i < numPatterns; i++)
+            patterns[i] = _mm_set1_epi16((short)m_scanCharacters[i]);
+        for (; pos + 8 <= input.size(); pos += 8) {
+            __m128i chunk = _mm_loadu_si128((__m128i const *)(input.data() + pos));
+            __m128i hits = _mm_cmpeq_epi16(chunk, patterns[0]);
+            for (size_t i = 1; i < numPatterns; i++)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi16(chunk, patterns[i]));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+            if (mask)
+                return pos + std::countr_zero(mask) / 2;
+        }
+    }
+#endif
+    for (; pos < input.size(); pos++) {
+        if (IsFirstCharacter(input[pos]))
+            return pos;
+    }
+    return input.size();
+}
+
+std::wstring_view CTokenEscaper::Apply(std::wstring_view input, std::wstring &buffer) const {
+    if (IsEmpty())
+        return input;
+    size_t pos = FindFirstCharacter(input, 0);
+    if (pos == input.size())
+        return input;
+    buffer.clear();
+    size_t copied = 0;
+    bool replaced = false;
+    while (pos < input.size()) {
+        bool matched = false;
+        for (unsigned int index : m_candidates.find(input[pos])->second) {
+            auto const &[key, value] = m_replacements[index];
+            if (input.compare(pos, key.size(), key) == 0) {
+                buffer.append(input.substr(copied, pos - copied));
+                buffer.append(value);
+                pos += key.size();
+                copied = pos;
+                matched = true;
+                replaced = true;
+                break;
+            }
+        }
+        if (!matched)
+            pos++;
+        pos = FindFirstCharacter(input, pos);
+    }
+    if (!replaced)
+        return input;
+    buffer.append(input.substr(copied));
+    return buffer;
+}
+
+bool CTokenEscaper::ReadTokensFile(std::filesystem::path const &path, Replacements &tokensToSymbols, Replacements &symbolsToTokens) {
+    TextFileTable table;
+    if (!table.Read(path, L'\t'))
+        return false;
+    auto Unescape = [](std::wstring_view cell) {
+        std::wstring result;
+        for (size_t i = 0; i < cell.size(); i++) {
+            if (cell[i] != L'\\' || i + 1 == cell.size()) {
+                result += cell[i];
+                continue;
+            }
+            wchar_t next = cell[++i];
+            if (next == L'r')
+                result += L'\r';
+            else if (next == L'n')
+                result += L'\n';
+            else if (next == L't')
+                result += L'\t';
+            else if (next == L'u' && i + 4 < cell.size()) {
+                wchar_t code = 0;
+                for (size_t d = 1; d <= 4; d++) {
+                    wchar_t c = cell[i + d];
+                    unsigned int digit = (c >= L'0' && c <= L'9') ? (c - L'0') : ((c | 0x20) >= L'a' && (c | 0x20) <= L'f') ? ((c | 0x20) - L'a' + 10) : 16;
+                    if (digit == 16) {
+                        code = 0;
+                        break;
+                    }
+                    code = code * 16 + digit;
+                }
+                if (code != 0) {
+                    result += code;
+                    i += 4;
+                }
+                else
+                    result += next;
+            }
+            else
+                result += next;
+        }
+        return result;
+    };
+    tokensToSymbols.clear();
+    symbolsToTokens.clear();
+    for (unsigned int r = 0; r < table.NumRows(); r++) {
+        if (table.NumColumns(r) < 2)
+            continue;
+        std::wstring token = Unescape(table.Cell(0, r));
+        std::wstring symbol = Unescape(table.Cell(1, r));
+        if (token.empty() || symbol.empty())
+            continue;
+        std::wstring direction = (table.NumColumns(r) >= 3) ? std::wstring(table.Cell(2, r)) : std::wstring();
+        if (direction != L"export")
+            tokensToSymbols.emplace_back(token, symbol);
+        if (direction != L"import")
+            symbolsToTokens.emplace_back(symbol, token);
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+
+// Prepared form of a replacement list, applied with the same rules as ReplaceAll: at every position the
+// first listed key which matches is replaced. Keys are looked up by their first character, and runs of
+// characters which start no key are found with a vector scan and copied in one piece.
+class CTokenEscaper {
+public:
+    typedef std::vector<std::pair<std::wstring, std::wstring>> Replacements;
+    static const unsigned int MAX_SCAN_CHARACTERS = 8;
+private:
+    Replacements m_replacements;
+    std::vector<unsigned long long> m_firstCharacters; // bit set of the first characters of the keys
+    std::unordered_map<wchar_t, std::vector<unsigned int>> m_candidates; // keys by first character, in list order
+    std::vector<wchar_t> m_scanCharacters; // the first characters, if there are at most MAX_SCAN_CHARACTERS
+
+    bool IsFirstCharacter(wchar_t c) const;
+    size_t FindFirstCharacter(std::wstring_view input, size_t pos) const;
+public:
+    void Set(Replacements const &replacements);
+    Replacements const &GetReplacements() const;
+    bool IsEmpty() const;
+    // returns input itself if no key matches, otherwise the replaced string, stored in buffer
+    std::wstring_view Apply(std::wstring_view input, std::wstring &buffer) const;
+
+    // Reads a tab-separated tokens file for the .tr format. Every row is: token, symbol, and optionally "import"
+    // or "export" to use the row in one direction only. Rows keep their order in both lists; \r, \n, \t, \\ and
+    // \uXXXX in the cells stand for the characters.
+    static bool ReadTokensFile(std::filesystem::path const &path, Replacements &tokensToSymbols, Replacements &symbolsToTokens);
+};
@@ -1,6 +1,7 @@
 #include "TranslationKeyComparator.h"
+#include "utils.h"
 
-TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
+TranslationKey::TranslationKey(std::wstring_view _name, CStringHash *_hash) {
     name = _name;
     hash = _hash;
     category = KEYCAT_NONE;
@@ -11,14 +12,14 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
     unsigned int i1 = 0, i2 = 0;
 
     if (name.starts_with(L"HASH#")) {
-        if (swscanf(name.c_str(), L"HASH#%d", &i1) == 1) {
+        if (swscanf(name.data(), L"HASH#%d", &i1) == 1) {
             category = KEYCAT_HASH;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"IDS_EA_MAIL_")) {
         if (name.starts_with(L"IDS_EA_MAIL_TITLE_VAR_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_TITLE_VAR_%d_%d", &i2, &i1) == 2) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_TITLE_VAR_%d_%d", &i2, &i1) == 2) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_TITLE_VAR;
                 id1 = i1;
@@ -26,14 +27,14 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
             }
         }
         if (name.starts_with(L"IDS_EA_MAIL_TITLE_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_TITLE_%d", &i1) == 1) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_TITLE_%d", &i1) == 1) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_TITLE;
                 id1 = i1;
             }
         }
         else if (name.starts_with(L"IDS_EA_MAIL_TEXT_VAR_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_TEXT_VAR_%d_%d", &i2, &i1) == 2) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_TEXT_VAR_%d_%d", &i2, &i1) == 2) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_TEXT_VAR;
                 id1 = i1;
@@ -41,21 +42,21 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
             }
         }
         else if (name.starts_with(L"IDS_EA_MAIL_TEXT_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_TEXT_%d", &i1) == 1) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_TEXT_%d", &i1) == 1) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_TEXT;
                 id1 = i1;
             }
         }
         else if (name.starts_with(L"IDS_EA_MAIL_REMARK_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_REMARK_%d", &i1) == 1) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_REMARK_%d", &i1) == 1) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_REMARK;
                 id1 = i1;
             }
         }
         else if (name.starts_with(L"IDS_EA_MAIL_ALT_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_ALT_%d_%d", &i2, &i1) == 2) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_ALT_%d_%d", &i2, &i1) == 2) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_ALT;
                 id1 = i1;
@@ -63,7 +64,7 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
             }
         }
         else if (name.starts_with(L"IDS_EA_MAIL_ANSWER_")) {
-            if (swscanf(name.c_str(), L"IDS_EA_MAIL_ANSWER_%d_%d", &i2, &i1) == 2) {
+            if (swscanf(name.data(), L"IDS_EA_MAIL_ANSWER_%d_%d", &i2, &i1) == 2) {
                 category = KEYCAT_MAIL;
                 subcategory = KEYSUBCAT_ANSWER;
                 id1 = i1;
@@ -72,7 +73,7 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
         }
     }
     else if (name.starts_with(L"TM09_")) {
-        if (swscanf(name.c_str(), L"TM09_%06d_%02d", &i1, &i2) == 2) {
+        if (swscanf(name.data(), L"TM09_%06d_%02d", &i1, &i2) == 2) {
             category = KEYCAT_TM09;
             subcategory = KEYSUBCAT_TITLE;
             id1 = i1;
@@ -80,7 +81,7 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
         }
     }
     else if (name.starts_with(L"TM09LIVE_")) {
-        if (swscanf(name.c_str(), L"TM09LIVE_%06d_%02d", &i1, &i2) == 2) {
+        if (swscanf(name.data(), L"TM09LIVE_%06d_%02d", &i1, &i2) == 2) {
             category = KEYCAT_TM09;
             subcategory = KEYSUBCAT_TEXT;
             id1 = i1;
@@ -90,7 +91,7 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
     else if (name.starts_with(L"IDS_HELP_")) {
         wchar_t screenName[256] = {};
         wchar_t categoryName[256] = {};
-        if (swscanf(name.c_str(), L"IDS_HELP_%s_%s_%d", screenName, categoryName, &i1) == 3) {
+        if (swscanf(name.data(), L"IDS_HELP_%s_%s_%d", screenName, categoryName, &i1) == 3) {
             std::wstring categoryName_ = categoryName;
             if (categoryName_ == L"HEADLINE") {
                 category = KEYCAT_HELP;
@@ -107,42 +108,42 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
         }
     }
     else if (name.starts_with(L"ACHIEVEMENT_HEADER_")) {
-        if (swscanf(name.c_str(), L"ACHIEVEMENT_HEADER_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"ACHIEVEMENT_HEADER_%d", &i1) == 1) {
             category = KEYCAT_ACHIEVEMENT;
             subcategory = KEYSUBCAT_TITLE;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"ACHIEVEMENT_TEXT_")) {
-        if (swscanf(name.c_str(), L"ACHIEVEMENT_TEXT_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"ACHIEVEMENT_TEXT_%d", &i1) == 1) {
             category = KEYCAT_ACHIEVEMENT;
             subcategory = KEYSUBCAT_TEXT;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"REWARD_HEADER_")) {
-        if (swscanf(name.c_str(), L"REWARD_HEADER_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"REWARD_HEADER_%d", &i1) == 1) {
             category = KEYCAT_REWARD;
             subcategory = KEYSUBCAT_TITLE;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"REWARD_TEXT_")) {
-        if (swscanf(name.c_str(), L"REWARD_TEXT_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"REWARD_TEXT_%d", &i1) == 1) {
             category = KEYCAT_REWARD;
             subcategory = KEYSUBCAT_TEXT;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"IDS_CHARACTER_FULL_")) {
-        if (swscanf(name.c_str(), L"IDS_CHARACTER_FULL_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"IDS_CHARACTER_FULL_%d", &i1) == 1) {
             category = KEYCAT_CHARACTER;
             subcategory = KEYSUBCAT_TITLE;
             id1 = i1;
         }
     }
     else if (name.starts_with(L"IDS_CHARACTER_ABBR_")) {
-        if (swscanf(name.c_str(), L"IDS_CHARACTER_ABBR_%d", &i1) == 1) {
+        if (swscanf(name.data(), L"IDS_CHARACTER_ABBR_%d", &i1) == 1) {
             category = KEYCAT_CHARACTER;
             subcategory = KEYSUBCAT_TEXT;
             id1 = i1;
@@ -150,7 +151,7 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
     }
     else if (name.starts_with(L"IDS_3DMATCH_HINT")) {
         wchar_t categoryName[256] = {};
-        if (swscanf(name.c_str(), L"IDS_3DMATCH_HINT%d_%s", &i1, categoryName) == 3) {
+        if (swscanf(name.data(), L"IDS_3DMATCH_HINT%d_%s", &i1, categoryName) == 3) {
             std::wstring categoryName_ = categoryName;
             if (categoryName_ == L"TITLE") {
                 category = KEYCAT_3DMATCHHINT;
@@ -166,13 +167,21 @@ TranslationKey::TranslationKey(std::wstring const &_name, CStringHash *_hash) {
     }
 }
 
-unsigned long TranslationKeyComparator::ParseNumber(const std::wstring &s) {
-    if (s.size() == 8 && s[0] == '0' && std::all_of(s.begin(), s.end(), ::isxdigit))
-        return std::stoul(s, nullptr, 16);
-    return std::stoul(s, nullptr, 10);
+unsigned long TranslationKeyComparator::ParseNumber(std::wstring_view s) {
+    bool isHex = s.size() == 8 && s[0] == '0' && std::all_of(s.begin(), s.end(), ::isxdigit);
+    unsigned long value = 0;
+    for (wchar_t c : s) {
+        unsigned long digit = 0;
+        if (c >= L'0' && c <= L'9')
+            digit = c - L'0';
+        else if (isHex)
+            digit = (c | 0x20) - L'a' + 10;
+        value = value * (isHex ? 16 : 10) + digit;
+    }
+    return value;
 }
 
-int TranslationKeyComparator::NaturalCompare(const std::wstring &a, const std::wstring &b) {
+int TranslationKeyComparator::NaturalCompare(std::wstring_view a, std::wstring_view b) {
     size_t i = 0, j = 0;
     while (i < a.size() && j < b.size()) {
         if (iswdigit(a[i]) && iswdigit(b[j])) {
@@ -205,3 +214,201 @@ bool TranslationKeyComparator::Compare(const TranslationKey &a, const Translatio
     }
     return NaturalCompare(a.name, b.name) < 0;
 }
+
+// number of leading elements of [first, last) which satisfy pred, where pred holds for a prefix of the range;
+// searches exponentially from the front, so a short prefix costs few calls
+template<typename It, typename Pred>
+static size_t GallopCount(It first, It last, Pred pred) {
+    size_t size = last - first;
+    size_t low = 0;
+    size_t high = 1;
+    while (high <= size && pred(first[high - 1])) {
+        low = high;
+        high *= 2;
+    }
+    if (high > size)
+        high = size + 1;
+    return std::partition_point(first + low, first + (high - 1), pred) - first;
+}
+
+void TranslationKeyComparator::MergeRuns(std::vector<TranslationKey> const &keys, std::vector<unsigned int> &order, std::vector<size_t> runBounds) {
+    // runBounds holds the start of every run followed by the end of the last one; neighbouring runs are
+    // merged pairwise, the merges of one level run in parallel. Runs of different categories rarely interleave,
+    // so the merge copies whole blocks found by galloping instead of comparing every element
+    auto Merge = [&keys](unsigned int const *a, unsigned int const *aEnd, unsigned int const *b, unsigned int const *bEnd, unsigned int *out) {
+        while (a != aEnd && b != bEnd) {
+            // elements of a which are not greater than the head of b go first, so equal keys keep the order of the runs
+            size_t count = GallopCount(a, aEnd, [&](unsigned int index) { return !Compare(keys[*b], keys[index]); });
+            out = std::copy(a, a + count, out);
+            a += count;
+            if (a == aEnd)
+                break;
+            count = GallopCount(b, bEnd, [&](unsigned int index) { return Compare(keys[index], keys[*a]); });
+            out = std::copy(b, b + count, out);
+            b += count;
+        }
+        out = std::copy(a, aEnd, out);
+        std::copy(b, bEnd, out);
+    };
+    std::vector<unsigned int> merged(order.size());
+    while (runBounds.size() > 2) {
+        size_t numRuns = runBounds.size() - 1;
+        ParallelFor((numRuns + 1) / 2, [&](size_t begin, size_t end) {
+            for (size_t pair = begin; pair < end; pair++) {
+                size_t first = runBounds[pair * 2];
+                size_t middle = runBounds[pair * 2 + 1];
+                size_t last = (pair * 2 + 2 < runBounds.size()) ? runBounds[pair * 2 + 2] : middle;
+                Merge(order.data() + first, order.data() + middle, order.data() + middle, order.data() + last, merged.data() + first);
+            }
+        }, 1);
+        order.swap(merged);
+        std::vector<size_t> nextBounds;
+        for (size_t i = 0; i < runBounds.size(); i += 2)
+            nextBounds.push_back(runBounds[i]);
+        if (nextBounds.back() != runBounds.back())
+            nextBounds.push_back(runBounds.back());
+        runBounds.swap(nextBounds);
+    }
+}
+
+void TranslationKeyComparator::Sort(std::vector<TranslationKey> const &keys, std::vector<unsigned int> &order) {
+    unsigned int numKeys = (unsigned int)keys.size();
+    order.resize(numKeys);
+    // the fields of categorised keys are packed into 128 bits in comparison order: category, stringId rank,
+    // id1, id2, subcategory, subid - each field gets the bits of its largest value
+    std::vector<std::wstring_view> stringIds;
+    std::vector<unsigned int> categorised;
+    unsigned int maxId1 = 0, maxId2 = 0, maxSubid = 0;
+    for (unsigned int i = 0; i < numKeys; i++) {
+        TranslationKey const &key = keys[i];
+        if (key.category == KEYCAT_NONE)
+            continue;
+        categorised.push_back(i);
+        if (!key.stringId.empty())
+            stringIds.push_back(key.stringId);
+        maxId1 = max(maxId1, key.id1);
+        maxId2 = max(maxId2, key.id2);
+        maxSubid = max(maxSubid, key.subid);
+    }
+    std::sort(stringIds.begin(), stringIds.end());
+    stringIds.erase(std::unique(stringIds.begin(), stringIds.end()), stringIds.end());
+    auto BitWidth = [](unsigned long long value) {
+        unsigned int bits = 0;
+        while (value >> bits)
+            bits++;
+        return bits;
+    };
+    // stringId rank 0 is the empty string, which sorts first
+    unsigned int const widths[] = { BitWidth(KEYCAT_3DMATCHHINT), BitWidth(stringIds.size()), BitWidth(maxId1), BitWidth(maxId2),
+        BitWidth(KEYSUBCAT_ANSWER), BitWidth(maxSubid) };
+    unsigned int totalBits = 0;
+    for (unsigned int width : widths)
+        totalBits += width;
+
+    std::vector<size_t> runBounds;
+    unsigned int numCategorised = (unsigned int)categorised.size();
+    bool packedSort = totalBits <= 128;
+    if (packedSort) {
+        struct PackedKey {
+            unsigned long long lo;
+            unsigned long long hi;
+            unsigned int index;
+        };
+        std::vector<PackedKey> packed(numCategorised);
+        std::vector<PackedKey> scratch(numCategorised);
+        ParallelFor(numCategorised, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                TranslationKey const &key = keys[categorised[i]];
+                unsigned int rank = 0;
+                if (!key.stringId.empty())
+                    rank = (unsigned int)(std::lower_bound(stringIds.begin(), stringIds.end(), key.stringId) - stringIds.begin()) + 1;
+                unsigned long long const fields[] = { (unsigned long long)key.category, rank, key.id1, key.id2,
+                    (unsigned long long)key.subcategory, key.subid };
+                PackedKey &p = packed[i];
+                p.lo = 0;
+                p.hi = 0;
+                p.index = categorised[i];
+                for (unsigned int f = 0; f < 6; f++) {
+                    // shift the 128-bit value left by the width of the field (at most 32 bits) and add the field
+                    if (widths[f] == 0)
+                        continue;
+                    p.hi = (p.hi << widths[f]) | (p.lo >> (64 - widths[f]));
+                    p.lo = (p.lo << widths[f]) | fields[f];
+                }
+            }
+        }, 65536);
+        // least significant digit first: every pass is a stable counting sort on one byte. The keys are split into
+        // slices; each slice counts its digits, then scatters to offsets ordered by digit, then by slice
+        const unsigned int SLICE_SIZE = 65536;
+        unsigned int numSlices = (numCategorised + SLICE_SIZE - 1) / SLICE_SIZE;
+        std::vector<unsigned int> counts((size_t)numSlices * 256);
+        for (unsigned int shift = 0; shift < totalBits; shift += 8) {
+            auto Digit = [shift](PackedKey const &p) -> unsigned int {
+                if (shift >= 64)
+                    return (p.hi >> (shift - 64)) & 0xFF;
+                return (p.lo >> shift) & 0xFF;
+            };
+            std::fill(counts.begin(), counts.end(), 0);
+            ParallelFor(numSlices, [&](size_t begin, size_t end) {
+                for (size_t slice = begin; slice < end; slice++) {
+                    unsigned int *sliceCounts = &counts[slice * 256];
+                    size_t last = (slice + 1) * SLICE_SIZE < numCategorised ? (slice + 1) * SLICE_SIZE : numCategorised;
+                    for (size_t i = slice * SLICE_SIZE; i < last; i++)
+                        sliceCounts[Digit(packed[i])]++;
+                }
+            }, 1);
+            unsigned int offset = 0;
+            bool sameDigit = false;
+            for (unsigned int digit = 0; digit < 256; digit++) {
+                unsigned int digitStart = offset;
+                for (unsigned int slice = 0; slice < numSlices; slice++) {
+                    unsigned int count = counts[slice * 256 + digit];
+                    counts[slice * 256 + digit] = offset;
+                    offset += count;
+                }
+                if (offset - digitStart == numCategorised)
+                    sameDigit = true;
+            }
+            // all keys have the same digit - the pass would not move anything
+            if (sameDigit)
+                continue;
+            ParallelFor(numSlices, [&](size_t begin, size_t end) {
+                for (size_t slice = begin; slice < end; slice++) {
+                    unsigned int *sliceOffsets = &counts[slice * 256];
+                    size_t last = (slice + 1) * SLICE_SIZE < numCategorised ? (slice + 1) * SLICE_SIZE : numCategorised;
+                    for (size_t i = slice * SLICE_SIZE; i < last; i++)
+                        scratch[sliceOffsets[Digit(packed[i])]++] = packed[i];
+                }
+            }, 1);
+            packed.swap(scratch);
+        }
+        // the category is in the top bits, so every category is one run
+        for (unsigned int i = 0; i < numCategorised; i++) {
+            if (i == 0 || keys[packed[i].index].category != keys[packed[i - 1].index].category)
+                runBounds.push_back(i);
+            order[i] = packed[i].index;
+        }
+    }
+    // uncategorised names, and categorised keys whose fields do not fit, are sorted in slices by Compare
+    unsigned int numSorted = packedSort ? numCategorised : 0;
+    unsigned int numRest = 0;
+    for (unsigned int i = 0; i < numKeys; i++) {
+        if (!packedSort || keys[i].category == KEYCAT_NONE)
+            order[numSorted + numRest++] = i;
+    }
+    const unsigned int COMPARE_SLICE_SIZE = 16384;
+    unsigned int numRestSlices = (numRest + COMPARE_SLICE_SIZE - 1) / COMPARE_SLICE_SIZE;
+    ParallelFor(numRestSlices, [&](size_t begin, size_t end) {
+        for (size_t slice = begin; slice < end; slice++) {
+            size_t first = numSorted + slice * COMPARE_SLICE_SIZE;
+            size_t last = numSorted + (((slice + 1) * COMPARE_SLICE_SIZE < numRest) ? (slice + 1) * COMPARE_SLICE_SIZE : numRest);
+            std::stable_sort(order.begin() + first, order.begin() + last, [&keys](unsigned int a, unsigned int b) {
+                return Compare(keys[a], keys[b]);
+            });
+        }
+    }, 1);
+    for (unsigned int slice = 0; slice < numRestSlices; slice++)
+        runBounds.push_back(numSorted + slice * COMPARE_SLICE_SIZE);
+    runBounds.push_back(numKeys);
+    MergeRuns(keys, order, std::move(runBounds));
+}
@@ -1,4 +1,6 @@
+#pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cctype>
 #include <algorithm>
@@ -29,9 +31,10 @@ enum eKeySubCategory {
     KEYSUBCAT_ANSWER
 };
 
+// name is not copied - it must stay alive and be followed by a terminator
 class TranslationKey {
 public:
-    std::wstring name;
+    std::wstring_view name;
     CStringHash *hash;
     eKeyCategory category;
     eKeySubCategory subcategory;
@@ -40,12 +43,16 @@ public:
     unsigned int subid;
     std::wstring stringId;
 
-    TranslationKey(std::wstring const &_name, CStringHash *_hash);
+    TranslationKey(std::wstring_view _name, CStringHash *_hash);
 };
 
 class TranslationKeyComparator {
-    static unsigned long ParseNumber(const std::wstring &s);
-    static int NaturalCompare(const std::wstring &a, const std::wstring &b);
+    static unsigned long ParseNumber(std::wstring_view s);
+    static int NaturalCompare(std::wstring_view a, std::wstring_view b);
+    static void MergeRuns(std::vector<TranslationKey> const &keys, std::vector<unsigned int> &order, std::vector<size_t> runBounds);
 public:
     static bool Compare(const TranslationKey &a, const TranslationKey &b);
+    // fills order with the indices of keys in the order of Compare. Categorised keys are radix sorted by their
+    // packed fields, only uncategorised names are compared as text; the sorted runs are merged with Compare
+    static void Sort(std::vector<TranslationKey> const &keys, std::vector<unsigned int> &order);
 };
@@ -6,6 +6,13 @@
 #include "xlsxwriter.h"
 #include "xlnt\xlnt.hpp"
 #include "TranslationKeyComparator.h"
+#include "TokenEscaper.h"
+#include "TextDiff.h"
+#include "KeyCollisions.h"
+#include "KeyFilter.h"
+#include "TextCache.h"
+#include "TextSearch.h"
+#include "KeyRecovery.h"
 
 wchar_t const *version = L"1.03";
 
@@ -20,7 +27,9 @@ int wmain(int argc, wchar_t *argv[]) {
         INVALID_GAME = 6,
         INPUT_FILE_READING_ERROR = 7,
         OUTPUT_FILE_WRITING_ERROR = 7,
-        ERROR_OTHER = 8
+        ERROR_OTHER = 8,
+        KEY_HASH_COLLISION = 9,
+        VERIFICATION_ERROR = 10
     };
     enum eFileType { FILETYPE_NOTSET, FILETYPE_HUF, FILETYPE_XLSX, FILETYPE_TXT, FILETYPE_CSV, FILETYPE_TSV, FILETYPE_TR };
     struct FileTypeInfo {
@@ -55,12 +64,14 @@ int wmain(int argc, wchar_t *argv[]) {
         {L"}",    L"{}}"}
     };
     CommandLine cmd(argc, argv, { L"game", L"g", L"input", L"i", L"output", L"o", L"keys", L"k",
-        L"locale", L"language", L"l", L"separator", L"s", L"charmap" },
-        { L"silent", L"hashes", L"stats", L"windows1251" } );
+        L"locale", L"language", L"l", L"separator", L"s", L"charmap", L"patch", L"with", L"base", L"key", L"locales", L"tokens", L"find", L"regex",
+        L"keylist", L"keyfilter", L"keyregex", L"category", L"valueregex", L"grammar", L"maxcandidates" },
+        { L"silent", L"hashes", L"stats", L"windows1251", L"sharesuffixes", L"failoncollisions", L"cache", L"ignorecase",
+        L"verify", L"noverify" } );
     SetMessageDisplayType(cmd.HasOption(L"silent") ? MessageDisplayType::MSG_CONSOLE : MessageDisplayType::MSG_MESSAGE_BOX);
     std::pair<eFileType, eFileType> format = { FILETYPE_NOTSET, FILETYPE_NOTSET };
-    if (argc >= 2) {
-        std::wstring opTypeStr = ToLower(argv[1]);
+    std::wstring opTypeStr = (argc >= 2) ? ToLower(argv[1]) : std::wstring();
+    if (!opTypeStr.empty()) {
         if (opTypeStr == L"huf2xlsx" || opTypeStr == L"huf2xls")
             format = { FILETYPE_HUF, FILETYPE_XLSX };
         else if (opTypeStr == L"huf2txt")
@@ -81,20 +92,45 @@ int wmain(int argc, wchar_t *argv[]) {
             format = { FILETYPE_TSV, FILETYPE_HUF };
         else if (opTypeStr == L"tr2huf")
             format = { FILETYPE_TR, FILETYPE_HUF };
+        else if (opTypeStr == L"hufpatch" || opTypeStr == L"hufmerge")
+            format = { FILETYPE_HUF, FILETYPE_HUF };
+        else if (opTypeStr == L"hufdiff")
+            format = { FILETYPE_HUF, FILETYPE_CSV };
+        else if (opTypeStr == L"hufget")
+            format = { FILETYPE_HUF, FILETYPE_TXT };
+        else if (opTypeStr == L"hufsearch")
+            format = { FILETYPE_HUF, FILETYPE_CSV };
+        else if (opTypeStr == L"hufrecover")
+            format = { FILETYPE_HUF, FILETYPE_CSV };
     }
     if (format.first == FILETYPE_NOTSET || format.second == FILETYPE_NOTSET) {
         ErrorMessage(L"Unknown operation type\nPlease use HufConverterGUI.py if you don't understand how to work with command-line tool");
         return ErrorType::UNKNOWN_OPERATION_TYPE;
     }
-    std::filesystem::path in, out, keysPath = L"keys.txt";
+    std::filesystem::path in, out, keysPath = L"keys.txt", patchPath, withPath, basePath;
     eGame game = GAME_FM09;
     unsigned int localeID = 1;
+    std::vector<unsigned int> locales;
     wchar_t separator = 0;
     bool hashes = (format.second != FILETYPE_TR) ? cmd.HasOption(L"hashes") : false;
     bool stats = cmd.HasOption(L"stats");
     bool windows1251 = cmd.HasOption(L"windows1251");
+    bool shareSuffixes = cmd.HasOption(L"sharesuffixes");
+    bool failOnCollisions = cmd.HasOption(L"failoncollisions");
+    bool useCache = cmd.HasOption(L"cache");
+    // batch runs check every written .huf file unless -noverify is given. Files with shared suffixes are always read
+    // back, a string which ends inside another one is checked like the in-memory import does
+    bool verify = ((cmd.HasOption(L"verify") || cmd.HasOption(L"silent")) && !cmd.HasOption(L"noverify")) || shareSuffixes;
+    // loading a .huf file checks its tree; only -verify walks every string of it to its terminator, which lets the
+    // strings be decoded without the bounds checks
+    bool checkStrings = cmd.HasOption(L"verify");
     std::map<wchar_t, wchar_t> charmap;
-    auto ApplyCharmap = [&charmap](std::wstring &str) {
+    // .tr token replacements, the defaults unless a tokens file is given
+    CTokenEscaper tokensToSymbols;
+    CTokenEscaper symbolsToTokens;
+    tokensToSymbols.Set(TokensToSymbols);
+    symbolsToTokens.Set(SymbolsToTokens);
+    auto ApplyCharmap = [&charmap](auto &str) {
         for (auto &c : str) {
             auto it = charmap.find(c);
             if (it != charmap.end())
@@ -160,6 +196,34 @@ int wmain(int argc, wchar_t *argv[]) {
             }
             catch (...) {}
         }
+        else if (arg == L"locales") {
+            // one locale per value column: -locales 1,2,3
+            size_t start = 0;
+            while (start < value.size()) {
+                size_t end = value.find(L',', start);
+                if (end == std::wstring::npos)
+                    end = value.size();
+                try {
+                    locales.push_back(std::stoi(value.substr(start, end - start)));
+                }
+                catch (...) {}
+                start = end + 1;
+            }
+        }
+        else if (arg == L"patch") {
+            patchPath = value;
+            if (!std::filesystem::exists(patchPath)) {
+                ErrorMessage(L"Patch path does not exist");
+                return ErrorType::INVALID_INPUT_PATH;
+            }
+        }
+        else if (arg == L"with" || arg == L"base") {
+            (arg == L"with" ? withPath : basePath) = value;
+            if (!std::filesystem::exists(value)) {
+                ErrorMessage(L"Input path does not exist");
+                return ErrorType::INVALID_INPUT_PATH;
+            }
+        }
         else if (arg == L"charmap") {
             TextFileTable chm;
             chm.Read(value, L'\t');
@@ -170,39 +234,723 @@ int wmain(int argc, wchar_t *argv[]) {
                     charmap[from[0]] = to[0];
             }
         }
+        else if (arg == L"tokens") {
+            CTokenEscaper::Replacements toSymbols, toTokens;
+            if (!CTokenEscaper::ReadTokensFile(value, toSymbols, toTokens)) {
+                ErrorMessage(L"Tokens file reading error");
+                return ErrorType::INPUT_FILE_READING_ERROR;
+            }
+            tokensToSymbols.Set(toSymbols);
+            symbolsToTokens.Set(toTokens);
+        }
     }
     if (in.empty()) {
         ErrorMessage(L"Input path is not specified");
         return ErrorType::NO_INPUT_PATH;
     }
+    if (opTypeStr == L"hufpatch" && patchPath.empty()) {
+        ErrorMessage(L"Patch path is not specified");
+        return ErrorType::NO_INPUT_PATH;
+    }
+    if ((opTypeStr == L"hufdiff" || opTypeStr == L"hufmerge") && withPath.empty()) {
+        ErrorMessage(L"Second input path is not specified");
+        return ErrorType::NO_INPUT_PATH;
+    }
     if (out.empty()) {
         out = in;
+        // recovered names don't replace a huf2csv export next to the input, patched and merged files don't replace the input
+        if (opTypeStr == L"hufrecover")
+            out.replace_filename(in.stem().wstring() + L"_recovered");
+        else if (opTypeStr == L"hufpatch")
+            out.replace_filename(in.stem().wstring() + L"_patched");
+        else if (opTypeStr == L"hufmerge")
+            out.replace_filename(in.stem().wstring() + L"_merged");
         out.replace_extension(fileType[format.second].extension);
     }
+    auto GetKeyHash = [](std::wstring_view key, unsigned int &hash) {
+        bool hasPrefix = key.starts_with(L"HASH#");
+        if (hasPrefix || IsNumber(key)) {
+            try {
+                hash = std::stoul(std::wstring(hasPrefix ? key.substr(5) : key));
+            }
+            catch (...) {
+                return false;
+            }
+        }
+        else
+            hash = CText::GetHash(key);
+        return true;
+    };
+
+    auto SplitList = [](std::wstring const &list) {
+        std::vector<std::wstring> items;
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(L',', start);
+            if (end == std::wstring::npos)
+                end = list.size();
+            std::wstring item = list.substr(start, end - start);
+            Trim(item);
+            if (!item.empty())
+                items.push_back(item);
+            start = end + 1;
+        }
+        return items;
+    };
+
+    // exports can be limited to keys or hashes (-key a,b or -keylist file), name globs (-keyfilter IDS_EA_MAIL_*),
+    // a name pattern (-keyregex), key categories (-category mail,help) and a value pattern (-valueregex)
+    CKeyFilter keyFilter;
+    std::wregex valueRegex;
+    bool hasValueRegex = false;
+    if (opTypeStr.starts_with(L"huf2")) {
+        if (cmd.HasArgument(L"key")) {
+            keyFilter.UseHashList();
+            for (auto const &key : SplitList(cmd.GetArgumentString(L"key"))) {
+                unsigned int hash = 0;
+                if (GetKeyHash(key, hash))
+                    keyFilter.AddHash(hash);
+            }
+        }
+        if (cmd.HasArgument(L"keylist")) {
+            TextFileTable keyList;
+            if (!keyList.Read(cmd.GetArgumentPath(L"keylist"))) {
+                ErrorMessage(L"Key list reading error");
+                return ErrorType::INPUT_FILE_READING_ERROR;
+            }
+            keyFilter.UseHashList();
+            for (unsigned int r = 0; r < keyList.NumRows(); r++) {
+                std::wstring key = (keyList.NumColumns(r) > 0) ? std::wstring(keyList.Cell(0, r)) : std::wstring();
+                Trim(key);
+                unsigned int hash = 0;
+                if (!key.empty() && GetKeyHash(key, hash))
+                    keyFilter.AddHash(hash);
+            }
+        }
+        for (auto const &glob : SplitList(cmd.GetArgumentString(L"keyfilter")))
+            keyFilter.AddGlob(glob);
+        if (cmd.HasArgument(L"keyregex") && !keyFilter.AddRegex(cmd.GetArgumentString(L"keyregex"))) {
+            ErrorMessage(L"Invalid key regular expression");
+            return ErrorType::ERROR_OTHER;
+        }
+        for (auto const &category : SplitList(cmd.GetArgumentString(L"category"))) {
+            if (!keyFilter.AddCategory(category)) {
+                ErrorMessage(Format(L"Unknown key category: %s", category));
+                return ErrorType::ERROR_OTHER;
+            }
+        }
+        if (cmd.HasArgument(L"valueregex")) {
+            try {
+                valueRegex.assign(cmd.GetArgumentString(L"valueregex"), std::regex_constants::ECMAScript | std::regex_constants::optimize);
+                hasValueRegex = true;
+            }
+            catch (std::regex_error const &) {
+                ErrorMessage(L"Invalid value regular expression");
+                return ErrorType::ERROR_OTHER;
+            }
+        }
+    }
+    bool filtered = !keyFilter.IsEmpty() || hasValueRegex;
+    // values are matched as they are exported
+    auto ValueMatches = [&](std::wstring &value) {
+        if (windows1251)
+            ConvertWindows1251ToUTF16(value);
+        if (!charmap.empty())
+            ApplyCharmap(value);
+        return std::regex_search(value, valueRegex);
+    };
+
+    // writes every hash shared by different keys to <output name>_collisions.csv
+    auto ReportCollisions = [&out, &fileType, failOnCollisions](CKeyCollisionIndex const &index) {
+        auto collisions = index.FindCollisions();
+        if (collisions.empty())
+            return true;
+        TextFileTable report;
+        report.AddRow({ L"Hash", L"Key", L"Row" });
+        for (auto const &collision : collisions) {
+            for (auto const &[name, row] : collision.keys)
+                report.AddRow({ std::to_wstring(collision.hash), name, row ? std::to_wstring(row) : L"generated" });
+        }
+        std::filesystem::path reportPath = out;
+        reportPath.replace_filename(out.stem().wstring() + L"_collisions.csv");
+        report.Write(reportPath, fileType[FILETYPE_CSV].separator, fileType[FILETYPE_CSV].encoding);
+        std::wstring message = Format(L"Key hash collisions: %d (see %s)", collisions.size(), reportPath.filename().c_str());
+        if (failOnCollisions)
+            return ErrorMessage(message);
+        InfoMessage(message);
+        return true;
+    };
+
+    // a .huf file which failed the checks on loading is reported with the reason
+    auto InputReadingError = [](std::initializer_list<CText const *> texts, std::wstring message) {
+        for (CText const *text : texts) {
+            if (!text->m_loadError.empty())
+                message += L"\n" + text->m_loadError;
+        }
+        return ErrorMessage(message);
+    };
+
+    // reads a file built from imported strings back; mismatching keys are written to <file name>_verify.csv.
+    // Files verified side by side pass parallel = false
+    auto VerifyImport = [&game, &fileType, windows1251](std::filesystem::path const &filePath, CTextStringArena const &strings,
+        CKeyCollisionIndex const &importKeys, std::wstring &message, bool parallel)
+    {
+        std::vector<TextDiffEntry> mismatches;
+        std::wstring loadError;
+        if (!CTextDiff::Verify(filePath.c_str(), game, strings, mismatches, loadError, parallel)) {
+            message = Format(L"Verification error: %s can't be read back", filePath.filename().c_str());
+            if (!loadError.empty())
+                message += L"\n" + loadError;
+            return false;
+        }
+        if (mismatches.empty())
+            return true;
+        std::map<unsigned int, std::wstring> names;
+        for (auto const &entry : mismatches)
+            names[entry.key];
+        importKeys.FindNames(names);
+        TextFileTable report;
+        report.AddRow({ L"Key", L"Status", L"Expected", L"Written" });
+        for (auto &entry : mismatches) {
+            std::wstring const &name = names[entry.key];
+            if (windows1251) {
+                ConvertWindows1251ToUTF16(entry.oldValue);
+                ConvertWindows1251ToUTF16(entry.newValue);
+            }
+            wchar_t const *status = (entry.status == TEXTDIFF_ADDED) ? L"added" : ((entry.status == TEXTDIFF_REMOVED) ? L"missing" : L"changed");
+            report.AddRow({ name.empty() ? (L"HASH#" + std::to_wstring(entry.key)) : name, status, entry.oldValue, entry.newValue });
+        }
+        std::filesystem::path reportPath = filePath;
+        reportPath.replace_filename(filePath.stem().wstring() + L"_verify.csv");
+        report.Write(reportPath, fileType[FILETYPE_CSV].separator, fileType[FILETYPE_CSV].encoding);
+        message = Format(L"Verification error: %d strings of %s don't match the input (see %s)", mismatches.size(),
+            filePath.filename().c_str(), reportPath.filename().c_str());
+        return false;
+    };
+
+    auto ResolveKeyNames = [&keysPath, &game](CText &text, std::map<unsigned int, std::wstring> &keys, CKeyCollisionIndex &collisions) {
+        if (!keysPath.empty()) {
+            TextFileTable keysFile;
+            if (keysFile.Read(keysPath)) {
+                std::vector<std::wstring> keyNames;
+                std::vector<unsigned int> keyRows;
+                keyNames.reserve(keysFile.NumRows());
+                keyRows.reserve(keysFile.NumRows());
+                for (unsigned int r = 0; r < keysFile.NumRows(); r++) {
+                    if (keysFile.NumColumns(r) > 0) {
+                        keyNames.emplace_back(keysFile.Cell(0, r));
+                        Trim(keyNames.back());
+                        keyRows.push_back(r + 1);
+                    }
+                }
+                keysFile.Clear();
+                std::vector<std::wstring_view> keyNameViews(keyNames.begin(), keyNames.end());
+                std::vector<unsigned int> keyHashes(keyNames.size());
+                CText::GetHashes(keyNameViews.data(), keyNameViews.size(), keyHashes.data());
+                // only names of strings present in the text are kept
+                for (size_t i = 0; i < keyNames.size(); i++) {
+                    if (text.FindStringHash(keyHashes[i])) {
+                        keys[keyHashes[i]] = keyNames[i];
+                        collisions.Add(keyHashes[i], keyNames[i], keyRows[i]);
+                    }
+                }
+            }
+            // generated keys are hashed as a shared prefix extended with a batch of suffixes
+            std::vector<unsigned int> suffixHashes;
+            std::vector<std::wstring_view> suffixViews;
+            auto AddTranslationKeys = [&text, &keys, &collisions, &suffixHashes, &suffixViews](std::wstring const &prefix,
+                std::vector<std::wstring> const &suffixes, size_t numSuffixes)
+            {
+                suffixViews.assign(suffixes.begin(), suffixes.begin() + numSuffixes);
+                suffixHashes.resize(numSuffixes);
+                CText::GetHashes(suffixViews.data(), numSuffixes, suffixHashes.data(), CText::GetHash(prefix));
+                for (size_t i = 0; i < numSuffixes; i++) {
+                    unsigned int hash = suffixHashes[i];
+                    if (text.FindStringHash(hash)) {
+                        std::wstring keyName = prefix + suffixes[i];
+                        collisions.Add(hash, keyName, 0);
+                        if (!keys.contains(hash))
+                            keys[hash] = keyName;
+                    }
+                }
+            };
+            std::vector<std::wstring> numbers, twoDigitNumbers, hexNumbers;
+            for (unsigned int i = 0; i <= 20000; i++)
+                numbers.push_back(Format(L"%d", i));
+            for (unsigned int i = 0; i <= 20; i++)
+                twoDigitNumbers.push_back(Format(L"%02d", i));
+            for (unsigned int clubIndex = 1; clubIndex <= 0x2100; clubIndex++)
+                hexNumbers.push_back(Format(L"%04X", clubIndex));
+            hexNumbers.push_back(L"FFFF");
+            if (game == GAME_TCM2005 || game == GAME_FM06)
+                AddTranslationKeys(L"TM_STR_", numbers, 20001);
+            if (game == GAME_FM06 || game == GAME_FM09) {
+                AddTranslationKeys(L"IDS_EA_MAIL_TITLE_", numbers, 3501);
+                AddTranslationKeys(L"IDS_EA_MAIL_TEXT_", numbers, 3501);
+                AddTranslationKeys(L"IDS_EA_MAIL_REMARK_", numbers, 3501);
+                for (unsigned int v = 0; v < 10; v++) {
+                    AddTranslationKeys(Format(L"IDS_EA_MAIL_TITLE_VAR_%d_", v), numbers, 3501);
+                    AddTranslationKeys(Format(L"IDS_EA_MAIL_TEXT_VAR_%d_", v), numbers, 3501);
+                }
+                for (unsigned int v = 0; v < 3; v++) {
+                    AddTranslationKeys(Format(L"IDS_EA_MAIL_ALT_%d_", v), numbers, 3501);
+                    AddTranslationKeys(Format(L"IDS_EA_MAIL_ANSWER_%d_", v), numbers, 3501);
+                }
+                AddTranslationKeys(L"IDS_CITYDESC_0000", { L"0000" }, 1);
+                for (unsigned int countryId = 1; countryId <= 207; countryId++)
+                    AddTranslationKeys(Format(L"IDS_CITYDESC_%04X", countryId), hexNumbers, hexNumbers.size());
+                for (unsigned int i = 0; i < 2000; i++)
+                    AddTranslationKeys(Format(L"IDS_WEBSITE_%05d_", i), numbers, 20);
+            }
+            if (game == GAME_FM09) {
+                for (unsigned int i = 0; i <= 5000; i++)
+                    AddTranslationKeys(Format(L"TM09_%06d_", i), twoDigitNumbers, twoDigitNumbers.size());
+                for (unsigned int i = 0; i <= 5000; i++)
+                    AddTranslationKeys(Format(L"TM09LIVE_%06d_", i), twoDigitNumbers, twoDigitNumbers.size());
+            }
+        }
+    };
+
+    if (opTypeStr == L"hufdiff" || opTypeStr == L"hufmerge") {
+        CText first, second, base;
+        if (!first.LoadTranslationsFile(in.c_str(), game, checkStrings) || !second.LoadTranslationsFile(withPath.c_str(), game, checkStrings) ||
+            (!basePath.empty() && !base.LoadTranslationsFile(basePath.c_str(), game, checkStrings)))
+        {
+            InputReadingError({ &first, &second, &base }, L"Input file reading error");
+            return ErrorType::INPUT_FILE_READING_ERROR;
+        }
+        std::vector<TextDiffEntry> entries;
+        std::map<unsigned int, std::wstring> keys;
+        CKeyCollisionIndex collisions;
+        std::filesystem::path reportPath = out;
+        bool written = true;
+        if (opTypeStr == L"hufdiff") {
+            entries = CTextDiff::Diff(first, second);
+            ResolveKeyNames(first, keys, collisions);
+            ResolveKeyNames(second, keys, collisions);
+        }
+        else {
+            std::map<unsigned int, std::wstring> merged;
+            entries = CTextDiff::Merge(basePath.empty() ? nullptr : &base, first, second, merged);
+            // conflict names have to be resolved while both sides are still loaded
+            if (!entries.empty()) {
+                ResolveKeyNames(first, keys, collisions);
+                ResolveKeyNames(second, keys, collisions);
+            }
+            base.Clear();
+            second.Clear();
+            CText mergedText;
+            mergedText.m_nLanguageID = first.m_game == GAME_FM09 ? first.m_nLanguageID : localeID;
+            first.Clear();
+            written = mergedText.LoadTranslationStrings(merged, game, shareSuffixes) && mergedText.WriteTranslationsFile(out.c_str());
+            reportPath.replace_filename(out.stem().wstring() + L"_conflicts.csv");
+        }
+        if (stats)
+            ::Message(Format(L"%s: %d", (opTypeStr == L"hufdiff") ? L"Differences" : L"Conflicts", entries.size()));
+        if (written && (opTypeStr == L"hufdiff" || !entries.empty())) {
+            if (!ReportCollisions(collisions))
+                return ErrorType::KEY_HASH_COLLISION;
+            wchar_t const *statusName[] = { L"added", L"removed", L"changed", L"conflict" };
+            TextFileTable report;
+            report.AddRow({ L"Key", L"Status", L"Old Text", L"New Text" });
+            for (auto const &entry : entries) {
+                auto it = keys.find(entry.key);
+                report.AddRow({ it != keys.end() ? it->second : (L"HASH#" + std::to_wstring(entry.key)),
+                    statusName[entry.status], entry.oldValue, entry.newValue });
+            }
+            auto sep = (separator == 0) ? fileType[FILETYPE_CSV].separator : separator;
+            written = report.Write(reportPath, sep, fileType[FILETYPE_CSV].encoding);
+        }
+        if (!written) {
+            ErrorMessage(L"Output file writing error");
+            return ErrorType::OUTPUT_FILE_WRITING_ERROR;
+        }
+        return ErrorType::NONE;
+    }
+
+    if (opTypeStr == L"hufsearch") {
+        // searches a .huf file, or every .huf file in a folder, in parallel; the trigram index of each file is kept in
+        // <file>.hufindex, built on the first search and rebuilt when the file changes, and only the strings which
+        // contain every trigram of the query are decoded
+        bool isRegex = cmd.HasArgument(L"regex");
+        std::wstring queryStr = cmd.GetArgumentString(isRegex ? L"regex" : L"find");
+        if (queryStr.empty()) {
+            ErrorMessage(L"Search query is not specified");
+            return ErrorType::ERROR_OTHER;
+        }
+        if (windows1251)
+            ConvertUTF16ToWindows1251(queryStr);
+        CTextSearchQuery query;
+        if (!query.Set(queryStr, isRegex, cmd.HasOption(L"ignorecase"))) {
+            ErrorMessage(L"Invalid regular expression");
+            return ErrorType::ERROR_OTHER;
+        }
+        std::vector<std::filesystem::path> files;
+        bool isFolder = std::filesystem::is_directory(in);
+        if (isFolder) {
+            std::error_code ec;
+            for (auto const &entry : std::filesystem::recursive_directory_iterator(in, ec)) {
+                if (entry.is_regular_file() && ToLower(entry.path().extension().c_str()) == L".huf")
+                    files.push_back(entry.path());
+            }
+            std::sort(files.begin(), files.end());
+        }
+        else
+            files.push_back(in);
+        std::vector<CText> texts(files.size());
+        std::vector<std::vector<std::pair<unsigned int, std::wstring>>> matches(files.size());
+        std::vector<char> searched(files.size(), 0);
+        ParallelFor(files.size(), [&](size_t begin, size_t end) {
+            for (size_t f = begin; f < end; f++) {
+                CTextCacheSource source;
+                if (!source.Read(files[f]))
+                    continue;
+                std::filesystem::path indexPath = files[f];
+                indexPath += L".hufindex";
+                CTextSearchIndex index;
+                bool loaded = false;
+                if (!index.Open(indexPath, source, game)) {
+                    if (!texts[f].LoadTranslationsFile(files[f].c_str(), game, checkStrings))
+                        continue;
+                    loaded = true;
+                    // an index which can't be written leaves a full scan
+                    if (CTextSearchIndex::Build(texts[f], indexPath, source, game))
+                        index.Open(indexPath, source, game);
+                }
+                std::vector<unsigned int> candidates;
+                if (index.IsOpen())
+                    index.FindCandidates(query.GetLiterals(), candidates);
+                else {
+                    candidates.resize(texts[f].m_nNumStringHashes);
+                    for (unsigned int i = 0; i < candidates.size(); i++)
+                        candidates[i] = i;
+                }
+                if (!candidates.empty()) {
+                    if (!loaded && !texts[f].LoadTranslationsFile(files[f].c_str(), game, checkStrings))
+                        continue;
+                    CTextSearchIndex::Search(texts[f], query, candidates, matches[f]);
+                }
+                searched[f] = 1;
+            }
+        }, 1);
+        std::map<unsigned int, std::wstring> keys;
+        CKeyCollisionIndex collisions;
+        TextFileTable report;
+        report.AddRow({ L"File", L"Key", L"Text" });
+        unsigned int numMatches = 0;
+        ErrorType error = ErrorType::NONE;
+        for (size_t f = 0; f < files.size(); f++) {
+            if (!searched[f]) {
+                InputReadingError({ &texts[f] }, Format(L"Input file reading error (%s)", files[f].c_str()));
+                error = ErrorType::INPUT_FILE_READING_ERROR;
+                continue;
+            }
+            if (matches[f].empty())
+                continue;
+            ResolveKeyNames(texts[f], keys, collisions);
+            std::wstring fileName = isFolder ? files[f].lexically_relative(in).wstring() : files[f].filename().wstring();
+            for (auto &[hash, str] : matches[f]) {
+                if (windows1251)
+                    ConvertWindows1251ToUTF16(str);
+                if (!charmap.empty())
+                    ApplyCharmap(str);
+                auto it = keys.find(hash);
+                report.AddRow({ fileName, it != keys.end() ? it->second : (L"HASH#" + std::to_wstring(hash)), str });
+            }
+            numMatches += (unsigned int)matches[f].size();
+        }
+        if (stats)
+            ::Message(Format(L"Matches: %d", numMatches));
+        auto sep = (separator == 0) ? fileType[FILETYPE_CSV].separator : separator;
+        if (!report.Write(out, sep, fileType[FILETYPE_CSV].encoding)) {
+            ErrorMessage(L"Output file writing error");
+            return ErrorType::OUTPUT_FILE_WRITING_ERROR;
+        }
+        return error;
+    }
+
+    if (opTypeStr == L"hufrecover") {
+        // guesses names for the hashes which the keys file doesn't resolve from templates of a -grammar file and
+        // from the resolved names with their numbers replaced by ranges; the output has the same layout as a keys
+        // file, so it can be checked and appended to it
+        CText text;
+        if (!text.LoadTranslationsFile(in.c_str(), game, checkStrings)) {
+            InputReadingError({ &text }, L"Input file reading error");
+            return ErrorType::INPUT_FILE_READING_ERROR;
+        }
+        std::map<unsigned int, std::wstring> keys;
+        CKeyCollisionIndex collisions;
+        ResolveKeyNames(text, keys, collisions);
+        std::vector<std::wstring> knownNames;
+        knownNames.reserve(keys.size());
+        for (auto const &[hash, name] : keys)
+            knownNames.push_back(name);
+        std::vector<unsigned int> unresolved;
+        for (unsigned int i = 0; i < text.m_nNumStringHashes; i++) {
+            if (!keys.contains(text.m_pStringHashes[i].key))
+                unresolved.push_back(text.m_pStringHashes[i].key);
+        }
+        CKeyRecovery recovery;
+        recovery.SetKnownNames(knownNames);
+        if (cmd.HasArgument(L"grammar") && !recovery.ReadGrammar(cmd.GetArgumentPath(L"grammar"))) {
+            ErrorMessage(L"Grammar file reading error");
+            return ErrorType::INPUT_FILE_READING_ERROR;
+        }
+        recovery.AddTemplatesFromKnownNames();
+        auto candidates = recovery.Recover(unresolved, (std::max)(cmd.GetArgumentInt(L"maxcandidates", 5), 1));
+        for (unsigned int t : recovery.GetSkippedTemplates())
+            InfoMessage(Format(L"Key template %d is too large and was skipped", t + 1));
+        TextFileTable report;
+        std::set<unsigned int> recovered;
+        for (auto const &candidate : candidates) {
+            report.AddRow({ candidate.name, std::to_wstring(candidate.hash), Format(L"%.3f", candidate.score) });
+            recovered.insert(candidate.hash);
+        }
+        if (stats)
+            ::Message(Format(L"Unresolved keys: %d, recovered: %d", unresolved.size(), recovered.size()));
+        auto sep = (separator == 0) ? fileType[FILETYPE_CSV].separator : separator;
+        if (!report.Write(out, sep, fileType[FILETYPE_CSV].encoding)) {
+            ErrorMessage(L"Output file writing error");
+            return ErrorType::OUTPUT_FILE_WRITING_ERROR;
+        }
+        return ErrorType::NONE;
+    }
+
+    // decoded strings of an exported .huf file are kept in <input>.hufcache when -cache is used
+    std::filesystem::path cachePath = in;
+    cachePath += L".hufcache";
+    CTextCacheSource cacheSource, cacheKeys;
+    CTextCache cache;
+    if (useCache && format.first == FILETYPE_HUF && format.second != FILETYPE_HUF && patchPath.empty()) {
+        if (cacheSource.Read(in) && (!std::filesystem::exists(keysPath) || cacheKeys.Read(keysPath)))
+            cache.Open(cachePath, cacheSource, cacheKeys, game);
+        else
+            useCache = false;
+    }
+    // the cache keeps all strings, a filtered export can read it but doesn't write it
+    if (filtered && !cache.IsOpen())
+        useCache = false;
+
+    if (opTypeStr == L"hufget") {
+        // looks up single keys without decoding the whole file
+        CText text;
+        if (!cache.IsOpen() && !text.LoadTranslationsFile(in.c_str(), game, checkStrings)) {
+            InputReadingError({ &text }, L"Input file reading error");
+            return ErrorType::INPUT_FILE_READING_ERROR;
+        }
+        std::wstring keyList = cmd.GetArgumentString(L"key");
+        // all values go out as one message, unformatted so that long values aren't cut
+        std::wstring output;
+        size_t keyStart = 0;
+        while (keyStart < keyList.size()) {
+            size_t keyEnd = keyList.find(L',', keyStart);
+            if (keyEnd == std::wstring::npos)
+                keyEnd = keyList.size();
+            std::wstring key = keyList.substr(keyStart, keyEnd - keyStart);
+            Trim(key);
+            unsigned int hash = 0;
+            if (!key.empty() && GetKeyHash(key, hash)) {
+                std::shared_ptr<std::wstring const> value;
+                if (cache.IsOpen()) {
+                    CTextCache::Entry const *entry = cache.Find(hash);
+                    if (entry)
+                        value = std::make_shared<std::wstring const>(cache.GetValue(*entry));
+                }
+                else
+                    value = text.GetShared(hash);
+                if (value) {
+                    std::wstring str = *value;
+                    if (windows1251)
+                        ConvertWindows1251ToUTF16(str);
+                    if (!charmap.empty())
+                        ApplyCharmap(str);
+                    output += key + L": " + str + L"\n";
+                }
+                else
+                    output += key + L": not found\n";
+            }
+            keyStart = keyEnd + 1;
+        }
+        if (!output.empty()) {
+            output.pop_back();
+            InfoMessage(output);
+        }
+        return ErrorType::NONE;
+    }
+
+    if (!locales.empty() && format.second == FILETYPE_HUF && format.first != FILETYPE_HUF) {
+        // a table with a key column and one value column per locale gives <output name>_<locale>.huf for each locale;
+        // keys are parsed, hashed, checked and sorted once, the locales are encoded in parallel
+        TextFileTable table;
+        unsigned int firstRow = 1;
+        if (format.first == FILETYPE_XLSX) {
+            xlnt::workbook wb;
+            wb.load(in.c_str());
+            xlnt::worksheet ws = wb.sheet_by_index(0);
+            xlnt::row_t last_row = ws.highest_row();
+            for (xlnt::row_t row = 2; row <= last_row; ++row) {
+                table.BeginRow();
+                for (xlnt::column_t::index_t column = 1; column <= locales.size() + 1; column++) {
+                    auto cell = ws.cell(xlnt::column_t(column), row);
+                    table.AddCell(cell.has_value() ? ToUTF16(cell.to_string()) : std::wstring());
+                }
+            }
+            firstRow = 2;
+        }
+        else if (!table.Read(in, (separator == 0) ? fileType[format.first].separator : separator)) {
+            ErrorMessage(L"Input file reading error");
+            return ErrorType::INPUT_FILE_READING_ERROR;
+        }
+        // (hash, row) of the first row of every key, sorted by hash
+        std::vector<std::pair<unsigned int, unsigned int>> keyRows;
+        CKeyCollisionIndex collisions;
+        keyRows.reserve(table.NumRows());
+        for (unsigned int r = 0; r < table.NumRows(); r++) {
+            unsigned int hash = 0;
+            if (table.NumColumns(r) >= 2 && GetKeyHash(table.Cell(0, r), hash)) {
+                collisions.Add(hash, table.Cell(0, r), r + firstRow);
+                keyRows.emplace_back(hash, r);
+            }
+        }
+        if (!ReportCollisions(collisions))
+            return ErrorType::KEY_HASH_COLLISION;
+        // the key names are kept for the verification report
+        if (!verify)
+            collisions.Clear();
+        std::stable_sort(keyRows.begin(), keyRows.end(), [](auto const &a, auto const &b) {
+            return a.first < b.first;
+        });
+        keyRows.erase(std::unique(keyRows.begin(), keyRows.end(), [](auto const &a, auto const &b) {
+            return a.first == b.first;
+        }), keyRows.end());
+        auto sep = (separator == 0) ? fileType[format.first].separator : separator;
+        std::vector<char> written(locales.size(), 0), verified(locales.size(), 1);
+        std::vector<std::wstring> localeStats(locales.size()), verifyMessages(locales.size());
+        ParallelFor(locales.size(), [&](size_t begin, size_t end) {
+            for (size_t l = begin; l < end; l++) {
+                // rows without a column for this locale are left out of its file
+                CTextStringArena strings;
+                size_t numCharacters = 0;
+                for (auto const &[hash, row] : keyRows)
+                    numCharacters += table.Cell(l + 1, row).size() + 1;
+                strings.Reserve(keyRows.size(), numCharacters);
+                std::wstring replaced;
+                for (auto const &[hash, row] : keyRows) {
+                    if (table.NumColumns(row) > l + 1) {
+                        if (sep == L'|')
+                            strings.Add(hash, tokensToSymbols.Apply(table.Cell(l + 1, row), replaced));
+                        else
+                            strings.Add(hash, table.Cell(l + 1, row));
+                    }
+                }
+                if (!charmap.empty())
+                    ApplyCharmap(strings.m_data);
+                if (windows1251)
+                    strings.TransformStrings(ConvertUTF16ToWindows1251);
+                CText localeText;
+                localeText.m_nLanguageID = locales[l];
+                std::vector<std::wstring_view> encodeOrder;
+                std::filesystem::path localePath = out;
+                localePath.replace_filename(out.stem().wstring() + L"_" + std::to_wstring(locales[l]) + out.extension().wstring());
+                written[l] = localeText.PrepareTranslationStrings(strings, game, shareSuffixes, encodeOrder) &&
+                    localeText.WriteTranslationsFile(localePath.c_str(), encodeOrder);
+                if (written[l] && verify)
+                    verified[l] = VerifyImport(localePath, strings, collisions, verifyMessages[l], false);
+                localeStats[l] = Format(L"Locale %d: %d strings, %d shared (%d unique)", locales[l], localeText.m_nNumStringHashes,
+                    localeText.m_nNumSharedStrings, localeText.m_nNumUniqueStrings);
+            }
+        }, 1);
+        ErrorType error = ErrorType::NONE;
+        for (size_t l = 0; l < locales.size(); l++) {
+            if (!written[l]) {
+                ErrorMessage(Format(L"Output file writing error (locale %d)", locales[l]));
+                error = ErrorType::OUTPUT_FILE_WRITING_ERROR;
+            }
+            else if (!verified[l]) {
+                ErrorMessage(verifyMessages[l]);
+                error = ErrorType::VERIFICATION_ERROR;
+            }
+            else if (stats)
+                ::Message(localeStats[l]);
+        }
+        return error;
+    }
 
     bool success = false;
     CText text;
     text.m_nLanguageID = localeID;
 
-    if (format.first == FILETYPE_HUF)
-        success = text.LoadTranslationsFile(in.c_str(), game);
-    else {
-        std::map<unsigned int, std::wstring> strings;
-        auto AddKeyAndValue = [&strings](std::wstring const &key, std::wstring const &value) {
-            unsigned int hash = 0;
-            bool hasPrefix = key.starts_with(L"HASH#");
-            if (hasPrefix || IsNumber(key)) {
-                try {
-                    hash = std::stoul(hasPrefix ? key.substr(5, key.size() - 5) : key);
+    // imported strings are kept until the output file is written, they are encoded straight into it
+    CTextStringArena importStrings;
+    CKeyCollisionIndex importKeys;
+    std::vector<std::wstring_view> encodeOrder;
+
+    if (format.first == FILETYPE_HUF) {
+        success = cache.IsOpen() || text.LoadTranslationsFile(in.c_str(), game, checkStrings);
+        if (success && !patchPath.empty()) {
+            // rows with a key and a value add or change a string, rows with a key only remove it
+            std::map<unsigned int, std::wstring> strings;
+            std::set<unsigned int> removedKeys;
+            TextFileTable patchFile;
+            auto patchExtension = ToLower(patchPath.extension().c_str());
+            auto sep = separator;
+            if (sep == 0)
+                sep = (patchExtension == L".tr") ? L'|' : ((patchExtension == L".txt" || patchExtension == L".tsv") ? L'\t' : L',');
+            success = patchFile.Read(patchPath, sep);
+            if (success) {
+                CKeyCollisionIndex collisions;
+                for (unsigned int r = 0; r < patchFile.NumRows(); r++) {
+                    auto key = patchFile.Cell(0, r);
+                    unsigned int hash = 0;
+                    if (key.empty() || !GetKeyHash(key, hash))
+                        continue;
+                    collisions.Add(hash, key, r + 1);
+                    if (patchFile.NumColumns(r) == 1)
+                        removedKeys.insert(hash);
+                    else {
+                        std::wstring replaced;
+                        std::wstring value((sep == L'|') ? tokensToSymbols.Apply(patchFile.Cell(1, r), replaced) : patchFile.Cell(1, r));
+                        if (!charmap.empty())
+                            ApplyCharmap(value);
+                        if (windows1251)
+                            ConvertUTF16ToWindows1251(value);
+                        strings[hash] = value;
+                    }
+                }
+                if (!ReportCollisions(collisions))
+                    return ErrorType::KEY_HASH_COLLISION;
+                bool rebuilt = false;
+                unsigned int numPatchedStrings = strings.size();
+                if (!text.PatchTranslationStrings(strings, removedKeys)) {
+                    // the alphabet has changed - decode everything and build a new file
+                    std::map<unsigned int, std::wstring> allStrings;
+                    std::vector<wchar_t> value(text.m_nMaxStringLength + 1);
+                    for (unsigned int i = 0; i < text.m_nNumStringHashes; ++i) {
+                        CStringHash const &entry = text.m_pStringHashes[i];
+                        if (!removedKeys.contains(entry.key) && !strings.contains(entry.key)) {
+                            text.DecodeString(entry.offset, value.data());
+                            allStrings[entry.key] = value.data();
+                        }
+                    }
+                    allStrings.merge(strings);
+                    success = text.LoadTranslationStrings(allStrings, game, shareSuffixes);
+                    rebuilt = true;
                 }
-                catch (...) {
-                    return;
+                if (stats) {
+                    ::Message(Format(L"Patched strings: %d, removed strings: %d%s", numPatchedStrings, removedKeys.size(),
+                        rebuilt ? L" (rebuilt)" : L""));
                 }
             }
-            else
-                hash = CText::GetHash(WtoA(key).c_str());
-            if (!strings.contains(hash))
-                strings[hash] = value;
+        }
+    }
+    else {
+        // the first value of a key wins - the arena keeps the first entry of each hash
+        auto AddKeyAndValue = [&importStrings, &importKeys, &GetKeyHash](std::wstring_view key, std::wstring_view value, unsigned int row) {
+            unsigned int hash = 0;
+            if (!GetKeyHash(key, hash))
+                return;
+            importKeys.Add(hash, key, row);
+            importStrings.Add(hash, value);
         };
         if (format.first == FILETYPE_XLSX) {
             xlnt::workbook wb;
@@ -217,7 +965,7 @@ int wmain(int argc, wchar_t *argv[]) {
                     valA = ToUTF16(cellA.to_string());
                 if (cellB.has_value())
                     valB = ToUTF16(cellB.to_string());
-                AddKeyAndValue(valA, valB);
+                AddKeyAndValue(valA, valB, row);
             }
             success = true;
         }
@@ -226,30 +974,44 @@ int wmain(int argc, wchar_t *argv[]) {
             auto sep = (separator == 0) ? fileType[format.first].separator : separator;
             success = textFile.Read(in, sep);
             if (success) {
-                for (auto const &row : textFile.Rows()) {
-                    if (row.size() >= 2)
-                        AddKeyAndValue(row[0], (sep == L'|') ? ReplaceAll(row[1], TokensToSymbols) : row[1]);
+                size_t numCharacters = 0;
+                for (unsigned int r = 0; r < textFile.NumRows(); r++)
+                    numCharacters += textFile.Cell(1, r).size() + 1;
+                importStrings.Reserve(textFile.NumRows(), numCharacters);
+                std::wstring replaced;
+                for (unsigned int r = 0; r < textFile.NumRows(); r++) {
+                    if (textFile.NumColumns(r) >= 2) {
+                        if (sep == L'|')
+                            AddKeyAndValue(textFile.Cell(0, r), tokensToSymbols.Apply(textFile.Cell(1, r), replaced), r + 1);
+                        else
+                            AddKeyAndValue(textFile.Cell(0, r), textFile.Cell(1, r), r + 1);
+                    }
                 }
             }
             textFile.Clear();
         }
+        if (success && !ReportCollisions(importKeys))
+            return ErrorType::KEY_HASH_COLLISION;
         if (success) {
-            if (!charmap.empty()) {
-                for (auto &[k, v] : strings)
-                    ApplyCharmap(v);
-            }
-            if (windows1251) {
-                for (auto &[k, v] : strings)
-                    ConvertUTF16ToWindows1251(v);
-            }
-            success = text.LoadTranslationStrings(strings, game);
-            if (stats) {
+            importStrings.SortAndDeduplicate();
+            if (!charmap.empty())
+                ApplyCharmap(importStrings.m_data);
+            if (windows1251)
+                importStrings.TransformStrings(ConvertUTF16ToWindows1251);
+            success = text.PrepareTranslationStrings(importStrings, game, shareSuffixes, encodeOrder);
+            if (success && stats) {
                 unsigned int numUniqueCharacters = 0;
-                for (unsigned int c = 0; c < 65536; c++) {
+                for (unsigned int c = 0; c < std::size(text.m_characterMap); c++) {
                     if (text.m_characterMap[c])
                         numUniqueCharacters++;
                 }
                 ::Message(Format(L"Number of unique characters: %d", numUniqueCharacters));
+                ::Message(Format(L"Shared strings: %d/%d (%d unique), %d bytes saved", text.m_nNumSharedStrings,
+                    text.m_nNumStringHashes, text.m_nNumUniqueStrings, (text.m_nNumSharedBits + 7) / 8));
+                if (shareSuffixes) {
+                    ::Message(Format(L"Suffix strings: %d/%d, %d bytes saved", text.m_nNumSuffixStrings,
+                        text.m_nNumUniqueStrings, (text.m_nNumSuffixBits + 7) / 8));
+                }
                 TextFileTable uniqueChars;
                 for (unsigned int c = 0; c < std::size(text.m_characterMap); c++) {
                     if (text.m_characterMap[c] > 0) {
@@ -274,75 +1036,101 @@ int wmain(int argc, wchar_t *argv[]) {
     ErrorType error = ErrorType::NONE;
 
     if (!success) {
-        ErrorMessage(L"Input file reading error");
+        InputReadingError({ &text }, L"Input file reading error");
         error = ErrorType::INPUT_FILE_READING_ERROR;
     }
     else {
         success = false;
-        if (format.second == FILETYPE_HUF)
+        if (format.second == FILETYPE_HUF && format.first != FILETYPE_HUF) {
+            success = text.WriteTranslationsFile(out.c_str(), encodeOrder);
+            std::wstring message;
+            if (success && verify && !VerifyImport(out, importStrings, importKeys, message, true)) {
+                ErrorMessage(message);
+                error = ErrorType::VERIFICATION_ERROR;
+            }
+            else if (success && verify && stats)
+                ::Message(Format(L"Verified strings: %d", importStrings.Size()));
+        }
+        else if (format.second == FILETYPE_HUF)
             success = text.WriteTranslationsFile(out.c_str());
         else {
+            // with a valid cache the strings are exported in the cached order - no decoding, key names or sorting
             std::map<unsigned int, std::wstring> keys;
-            if (!keysPath.empty()) {
-                TextFileTable keysFile;
-                if (keysFile.Read(keysPath)) {
-                    for (auto const &row : keysFile.Rows()) {
-                        if (!row.empty()) {
-                            auto key = row[0];
-                            Trim(key);
-                            keys[CText::GetHash(WtoA(key).c_str())] = key;
-                        }
-                    }
-                }
-                std::set<unsigned int> textHashes;
-                for (unsigned int i = 0; i < text.m_nNumStringHashes; ++i)
-                    textHashes.insert(text.m_pStringHashes[i].key);
-                auto AddTranslationKey = [&textHashes, &keys](std::wstring const &keyName) {
-                    unsigned int hash = CText::GetHash(WtoA(keyName).c_str());
-                    if (textHashes.contains(hash) && !keys.contains(hash))
-                        keys[hash] = keyName;
-                };
-                if (game == GAME_TCM2005 || game == GAME_FM06) {
-                    for (unsigned int i = 0; i <= 20000; i++)
-                        AddTranslationKey(Format(L"TM_STR_%d", i));
+            if (!cache.IsOpen()) {
+                CKeyCollisionIndex collisions;
+                ResolveKeyNames(text, keys, collisions);
+                if (!ReportCollisions(collisions))
+                    return ErrorType::KEY_HASH_COLLISION;
+            }
+            // the exported rows: indices in sortKeys in sorted order, or cache entries in cached order. Keys are filtered
+            // by hash and name first, the values of the remaining keys are decoded only for a value pattern; sort records
+            // are compact, names point into the keys map or into hashNames
+            std::vector<TranslationKey> sortKeys;
+            std::vector<unsigned int> order;
+            std::wstring hashNames;
+            if (!cache.IsOpen()) {
+                sortKeys.reserve(text.m_nNumStringHashes);
+                size_t numUnnamed = 0;
+                for (unsigned int i = 0; i < text.m_nNumStringHashes; ++i) {
+                    if (!keys.contains(text.m_pStringHashes[i].key))
+                        numUnnamed++;
                 }
-                if (game == GAME_FM06 || game == GAME_FM09) {
-                    for (unsigned int i = 0; i <= 3500; i++) {
-                        AddTranslationKey(Format(L"IDS_EA_MAIL_TITLE_%d", i));
-                        for (unsigned int v = 0; v < 10; v++)
-                            AddTranslationKey(Format(L"IDS_EA_MAIL_TITLE_VAR_%d_%d", v, i));
-                        AddTranslationKey(Format(L"IDS_EA_MAIL_TEXT_%d", i));
-                        for (unsigned int v = 0; v < 10; v++)
-                            AddTranslationKey(Format(L"IDS_EA_MAIL_TEXT_VAR_%d_%d", v, i));
-                        AddTranslationKey(Format(L"IDS_EA_MAIL_REMARK_%d", i));
-                        for (unsigned int v = 0; v < 3; v++)
-                            AddTranslationKey(Format(L"IDS_EA_MAIL_ALT_%d_%d", v, i));
-                        for (unsigned int v = 0; v < 3; v++)
-                            AddTranslationKey(Format(L"IDS_EA_MAIL_ANSWER_%d_%d", v, i));
-                    }
-                    AddTranslationKey(Format(L"IDS_CITYDESC_%08X", 0));
-                    for (unsigned int countryId = 1; countryId <= 207; countryId++) {
-                        for (unsigned int clubIndex = 1; clubIndex <= 0x2100; clubIndex++)
-                            AddTranslationKey(Format(L"IDS_CITYDESC_%08X", (countryId << 16) | clubIndex));
-                        AddTranslationKey(Format(L"IDS_CITYDESC_%08X", (countryId << 16) | 0xFFFF));
+                hashNames.reserve(numUnnamed * 16); // "HASH#4294967295" + terminator, never reallocated
+                for (unsigned int i = 0; i < text.m_nNumStringHashes; ++i) {
+                    CStringHash *entry = &text.m_pStringHashes[i];
+                    auto it = keys.find(entry->key);
+                    if (it != keys.end())
+                        sortKeys.emplace_back(it->second, entry);
+                    else {
+                        size_t offset = hashNames.size();
+                        hashNames += L"HASH#" + std::to_wstring(entry->key);
+                        sortKeys.emplace_back(std::wstring_view(hashNames.data() + offset, hashNames.size() - offset), entry);
+                        hashNames += L'\0';
                     }
-                    for (unsigned int i = 0; i < 2000; i++) {
-                        for (unsigned int v = 0; v < 20; v++)
-                            AddTranslationKey(Format(L"IDS_WEBSITE_%05d_%d", i, v));
+                    if (!keyFilter.Matches(sortKeys.back(), entry->key))
+                        sortKeys.pop_back();
+                }
+                if (hasValueRegex) {
+                    std::vector<char> selected(sortKeys.size(), 0);
+                    ParallelFor(sortKeys.size(), [&](size_t begin, size_t end) {
+                        std::vector<wchar_t> decoded(text.m_nMaxStringLength + 1);
+                        std::wstring value;
+                        for (size_t k = begin; k < end; k++) {
+                            value.assign(decoded.data(), text.DecodeString(sortKeys[k].hash->offset, decoded.data()));
+                            selected[k] = ValueMatches(value);
+                        }
+                    });
+                    size_t numSelected = 0;
+                    for (size_t k = 0; k < sortKeys.size(); k++) {
+                        if (selected[k])
+                            sortKeys[numSelected++] = std::move(sortKeys[k]);
                     }
+                    sortKeys.erase(sortKeys.begin() + numSelected, sortKeys.end());
                 }
-                if (game == GAME_FM09) {
-                    for (unsigned int i = 0; i <= 5000; i++) {
-                        for (unsigned int v = 0; v <= 20; v++)
-                            AddTranslationKey(Format(L"TM09_%06d_%02d", i, v));
+                TranslationKeyComparator::Sort(sortKeys, order);
+            }
+            else {
+                order.reserve(cache.NumEntries());
+                std::wstring name, value;
+                for (unsigned int i = 0; i < cache.NumEntries(); i++) {
+                    CTextCache::Entry const &entry = cache.GetEntry(i);
+                    if (!keyFilter.IsEmpty()) {
+                        name.assign(cache.GetName(entry));
+                        if (!keyFilter.Matches(TranslationKey(name, nullptr), entry.hash))
+                            continue;
                     }
-                    for (unsigned int i = 0; i <= 5000; i++) {
-                        for (unsigned int v = 0; v <= 20; v++)
-                            AddTranslationKey(Format(L"TM09LIVE_%06d_%02d", i, v));
+                    if (hasValueRegex) {
+                        value.assign(cache.GetValue(entry));
+                        if (!ValueMatches(value))
+                            continue;
                     }
+                    order.push_back(i);
                 }
             }
-            TextFileTable *textFile = nullptr;
+            unsigned int numStrings = (unsigned int)order.size();
+            if (stats && filtered)
+                ::Message(Format(L"Selected strings: %d/%d", numStrings, cache.IsOpen() ? cache.NumEntries() : text.m_nNumStringHashes));
+            TextFileRowWriter textFile;
             lxw_workbook *excelFile = nullptr;
             lxw_worksheet *excelSheet = nullptr;
             if (format.second == FILETYPE_XLSX) {
@@ -368,65 +1156,155 @@ int wmain(int argc, wchar_t *argv[]) {
                                 .style_type_number = 1,
                                 .columns = hashes ? columns3 : columns2,
                             };
-                            worksheet_add_table(excelSheet, 0, 0, text.m_nNumStringHashes, hashes ? 2 : 1, &options);
+                            worksheet_add_table(excelSheet, 0, 0, numStrings, hashes ? 2 : 1, &options);
                             success = true;
                         }
                     }
                 }
             }
-            else {
-                textFile = new TextFileTable;
-                success = textFile != nullptr;
-            }
+            else
+                success = textFile.Open(out, fileType[format.second].encoding);
             auto sep = (separator == 0) ? fileType[format.second].separator : separator;
             if (success) {
-                if (text.m_pStringHashes && text.m_nNumStringHashes != 0) {
-                    std::vector<TranslationKey> strings;
-                    for (unsigned int i = 0; i < text.m_nNumStringHashes; ++i) {
-                        CStringHash *entry = &text.m_pStringHashes[i];
-                        std::wstring key = keys.contains(entry->key) ? keys[entry->key] : (L"HASH#" + std::to_wstring(entry->key));
-                        strings.emplace_back(key, entry);
-                    }
-                    std::sort(strings.begin(), strings.end(), TranslationKeyComparator::Compare);
-                    unsigned int totalNamed = 0;
-                    unsigned int excelRow = 1;
-                    for (auto const &key : strings) {
-                        const wchar_t *valuePtr = text.GetByHashKey(key.hash->key);
-                        if (!valuePtr)
-                            continue;
-                        std::wstring value = valuePtr;
-                        if (windows1251)
-                            ConvertWindows1251ToUTF16(value);
-                        if (!charmap.empty())
-                            ApplyCharmap(value);
-                        if (excelFile) {
-                            worksheet_write_string(excelSheet, excelRow, 0, ToUTF8(key.name).c_str(), NULL);
-                            worksheet_write_string(excelSheet, excelRow, 1, ToUTF8(value).c_str(), NULL);
-                            if (hashes)
-                                worksheet_write_number(excelSheet, excelRow, 2, key.hash->key, NULL);
+                // rows are decoded and formatted in chunks on a worker thread while this thread writes the previous chunks
+                struct ExportChunk {
+                    std::string encoded; // text formats
+                    std::vector<std::string> cells; // xlsx: UTF-8 key and value of each row
+                    std::vector<unsigned int> hashes; // xlsx
+                };
+                // UTF-8 text rows are decoded straight into the chunk - values are transcoded and escaped by a per-character
+                // table; values with characters which need quotes or surrogates are formatted the regular way
+                eEncoding encoding = fileType[format.second].encoding;
+                bool fusedExport = !excelFile && !cache.IsOpen() && !useCache && !windows1251 &&
+                    (encoding == ENCODING_UTF8 || encoding == ENCODING_UTF8_BOM);
+                CTextUTF8Table utf8Table;
+                std::string encodedSeparator;
+                if (fusedExport) {
+                    utf8Table.Build(text.m_huffmanInfo, sep, (sep == L'|') ? symbolsToTokens.GetReplacements() : CTokenEscaper::Replacements(), charmap);
+                    TextFileRowWriter::Encode(encodedSeparator, std::wstring_view(&sep, 1), encoding);
+                }
+                const unsigned int CHUNK_ROWS = 4096;
+                CBoundedQueue<ExportChunk> chunks(4);
+                unsigned int totalNamed = 0;
+                CTextCacheWriter cacheWriter;
+                const unsigned int DECODE_BATCH = 64;
+                std::thread producer([&] {
+                    std::vector<wchar_t> decoded(cache.IsOpen() ? 0 : (text.m_nMaxStringLength + 1));
+                    // values of the regular path are decoded DECODE_BATCH at a time, several strings side by side
+                    unsigned int const stride = text.m_nMaxStringLength + 1;
+                    std::vector<wchar_t> batch((cache.IsOpen() || fusedExport) ? 0 : (size_t)DECODE_BATCH * stride);
+                    unsigned int batchOffsets[DECODE_BATCH];
+                    unsigned int batchLengths[DECODE_BATCH];
+                    unsigned int batchBegin = 0;
+                    std::wstring formatted;
+                    std::wstring value;
+                    std::wstring replaced;
+                    if (useCache && !cache.IsOpen())
+                        cacheWriter.Reserve(numStrings);
+                    for (unsigned int begin = 0; begin < numStrings; begin += CHUNK_ROWS) {
+                        unsigned int end = (numStrings - begin > CHUNK_ROWS) ? (begin + CHUNK_ROWS) : numStrings;
+                        ExportChunk chunk;
+                        formatted.clear();
+                        for (unsigned int i = begin; i < end; i++) {
+                            std::wstring_view name;
+                            unsigned int hash = 0;
+                            if (cache.IsOpen()) {
+                                CTextCache::Entry const &entry = cache.GetEntry(order[i]);
+                                name = cache.GetName(entry);
+                                hash = entry.hash;
+                                if (entry.flags & CTextCache::CACHE_ENTRY_NAMED)
+                                    totalNamed++;
+                                value.assign(cache.GetValue(entry));
+                            }
+                            else {
+                                TranslationKey const &key = sortKeys[order[i]];
+                                name = key.name;
+                                hash = key.hash->key;
+                                if (key.category != KEYCAT_HASH)
+                                    totalNamed++;
+                                if (fusedExport) {
+                                    TextFileRowWriter::AppendEncodedCell(chunk.encoded, name, sep, encoding);
+                                    chunk.encoded += encodedSeparator;
+                                    if (!text.DecodeStringUTF8(key.hash->offset, utf8Table, chunk.encoded)) {
+                                        value.assign(decoded.data(), text.DecodeString(key.hash->offset, decoded.data()));
+                                        if (!charmap.empty())
+                                            ApplyCharmap(value);
+                                        TextFileRowWriter::AppendEncodedCell(chunk.encoded, (sep == L'|') ? symbolsToTokens.Apply(value, replaced) : value, sep, encoding);
+                                    }
+                                    if (hashes) {
+                                        chunk.encoded += encodedSeparator;
+                                        chunk.encoded += std::to_string(hash);
+                                    }
+                                    chunk.encoded += "\r\n";
+                                    continue;
+                                }
+                                if (i == begin || i - batchBegin == DECODE_BATCH) {
+                                    batchBegin = i;
+                                    unsigned int batchEnd = (end - i > DECODE_BATCH) ? (i + DECODE_BATCH) : end;
+                                    for (unsigned int b = i; b < batchEnd; b++)
+                                        batchOffsets[b - i] = sortKeys[order[b]].hash->offset;
+                                    text.DecodeStrings(batchOffsets, batchEnd - i, batch.data(), batchLengths);
+                                }
+                                value.assign(batch.data() + (size_t)(i - batchBegin) * stride, batchLengths[i - batchBegin]);
+                                if (useCache)
+                                    cacheWriter.Add(hash, name, value, key.category != KEYCAT_HASH);
+                            }
+                            if (windows1251)
+                                ConvertWindows1251ToUTF16(value);
+                            if (!charmap.empty())
+                                ApplyCharmap(value);
+                            if (excelFile) {
+                                chunk.cells.push_back(ToUTF8(name));
+                                chunk.cells.push_back(ToUTF8(value));
+                                chunk.hashes.push_back(hash);
+                            }
+                            else if (hashes)
+                                TextFileRowWriter::AppendRow(formatted, { name, (sep == L'|') ? symbolsToTokens.Apply(value, replaced) : value, std::to_wstring(hash) }, sep);
+                            else
+                                TextFileRowWriter::AppendRow(formatted, { name, (sep == L'|') ? symbolsToTokens.Apply(value, replaced) : value }, sep);
                         }
-                        else if (textFile) {
+                        if (!excelFile)
+                            TextFileRowWriter::Encode(chunk.encoded, formatted, fileType[format.second].encoding);
+                        if (!chunks.Push(std::move(chunk)))
+                            break;
+                    }
+                    chunks.Close();
+                });
+                ExportChunk chunk;
+                unsigned int excelRow = 1;
+                while (chunks.Pop(chunk)) {
+                    if (excelFile) {
+                        for (size_t r = 0; r < chunk.hashes.size(); r++) {
+                            worksheet_write_string(excelSheet, excelRow, 0, chunk.cells[r * 2].c_str(), NULL);
+                            worksheet_write_string(excelSheet, excelRow, 1, chunk.cells[r * 2 + 1].c_str(), NULL);
                             if (hashes)
-                                textFile->AddRow({ key.name, (sep == L'|') ? ReplaceAll(value, SymbolsToTokens) : value, std::to_wstring(key.hash->key) });
-                            else
-                                textFile->AddRow({ key.name, (sep == L'|') ? ReplaceAll(value, SymbolsToTokens) : value });
+                                worksheet_write_number(excelSheet, excelRow, 2, chunk.hashes[r], NULL);
+                            excelRow++;
                         }
-                        if (key.category != KEYCAT_HASH)
-                            totalNamed++;
-                        excelRow++;
                     }
-                    if (stats) {
-                        ::Message(Format(L"Total named: %d/%d (%.2f%%)", totalNamed, text.m_nNumStringHashes,
-                            (float)totalNamed / (float)text.m_nNumStringHashes * 100.0f));
+                    else if (!textFile.WriteEncoded(chunk.encoded)) {
+                        success = false;
+                        chunks.Close();
                     }
                 }
+                producer.join();
+                if (numStrings == 0 && !excelFile) {
+                    // an empty table is written as one empty line
+                    std::string emptyLine;
+                    TextFileRowWriter::Encode(emptyLine, L"\r\n", fileType[format.second].encoding);
+                    success = textFile.WriteEncoded(emptyLine);
+                }
+                if (useCache && !cache.IsOpen() && success && !cacheWriter.Write(cachePath, cacheSource, cacheKeys, game))
+                    InfoMessage(L"Unable to write the cache file");
+                if (stats && numStrings != 0) {
+                    ::Message(Format(L"Total named: %d/%d (%.2f%%)", totalNamed, numStrings,
+                        (float)totalNamed / (float)numStrings * 100.0f));
+                }
             }
             if (excelFile)
                 workbook_close(excelFile);
-            if (textFile) {
-                success = textFile->Write(out, sep, fileType[format.second].encoding);
-                delete textFile;
-            }
+            else if (!textFile.Close())
+                success = false;
         }
         if (!success) {
             ErrorMessage(L"Output file writing error");
@@ -0,0 +1,105 @@
+// Times decoding every string of generated FM06 and FM09 files one string at a time with DecodeString and in
+// batches with DecodeStrings, which keeps DECODE_LANES strings in flight. FM06 is also decoded into 8-bit buffers.
+// Texts without canonical codes are timed too, they walk the tree in every path.
+// Not a part of the HufConverter project; built from the code folder with
+//   cl /std:c++20 /EHsc /O2 /I. tests\DecodeBenchmark.cpp Text.cpp utils.cpp message.cpp
+// and returns 0 when every path decodes the same strings.
+#include "Text.h"
+#include "utils.h"
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+static const unsigned int NUM_STRINGS = 300000;
+static const unsigned int NUM_RUNS = 9;
+
+// short strings with a skewed character distribution, like the strings of the game files
+static std::map<unsigned int, std::wstring> GenerateStrings(eGame game, unsigned int seed) {
+    std::mt19937 random(seed);
+    std::discrete_distribution<int> frequencies({ 40, 20, 10, 8, 6, 5, 4, 3, 2, 1, 1, 1 });
+    std::map<unsigned int, std::wstring> strings;
+    for (unsigned int i = 0; i < NUM_STRINGS; i++) {
+        std::wstring str(5 + random() % 50, L' ');
+        for (auto &c : str) {
+            int f = frequencies(random);
+            // the 8-bit formats take Latin-1 characters only
+            c = (game == GAME_FM09 && f > 9) ? (wchar_t)(0x400 + random() % 64) : (wchar_t)(L'a' + f * 2 + random() % 2);
+            if (random() % 7 == 0)
+                c = L' ';
+        }
+        strings[random()] = str;
+    }
+    return strings;
+}
+
+int main() {
+    std::filesystem::path path = std::filesystem::temp_directory_path() / L"HufConverterDecodeBenchmark.huf";
+    unsigned int numErrors = 0;
+    for (eGame game : { GAME_FM06, GAME_FM09 }) {
+        CText text;
+        if (!text.LoadTranslationStrings(GenerateStrings(game, 42), game) || !text.WriteTranslationsFile(path.c_str()) ||
+            !text.LoadTranslationsFile(path.c_str(), game, true))
+        {
+            printf("%s: writing the file failed\n", game == GAME_FM09 ? "FM09" : "FM06");
+            return 1;
+        }
+        for (bool canonical : { true, false }) {
+            if (!canonical)
+                text.m_huffmanInfo.m_canonical.Clear();
+            unsigned int const count = text.m_nNumStringHashes;
+            unsigned int const stride = text.m_nMaxStringLength + 1;
+            std::vector<unsigned int> offsets(count);
+            for (unsigned int i = 0; i < count; i++)
+                offsets[i] = text.m_pStringHashes[i].offset;
+            std::vector<wchar_t> single((size_t)count * stride), batch((size_t)count * stride);
+            std::vector<unsigned int> singleLengths(count), batchLengths(count);
+            std::vector<char> narrow(game == GAME_FM06 ? (size_t)count * stride : 0);
+            std::vector<unsigned int> narrowLengths(narrow.empty() ? 0 : count);
+            double singleTime = 0.0, batchTime = 0.0, narrowTime = 0.0;
+            for (unsigned int run = 0; run < NUM_RUNS; run++) {
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned int i = 0; i < count; i++)
+                    singleLengths[i] = text.DecodeString(offsets[i], &single[(size_t)i * stride]);
+                auto middle = std::chrono::steady_clock::now();
+                text.DecodeStrings(offsets.data(), count, batch.data(), batchLengths.data());
+                auto end = std::chrono::steady_clock::now();
+                double time1 = std::chrono::duration<double, std::milli>(middle - start).count();
+                double time2 = std::chrono::duration<double, std::milli>(end - middle).count();
+                singleTime = (run == 0) ? time1 : (std::min)(singleTime, time1);
+                batchTime = (run == 0) ? time2 : (std::min)(batchTime, time2);
+                if (!narrow.empty()) {
+                    text.DecodeStrings<GAME_FM06>(offsets.data(), count, narrow.data(), narrowLengths.data());
+                    double time3 = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - end).count();
+                    narrowTime = (run == 0) ? time3 : (std::min)(narrowTime, time3);
+                }
+            }
+            for (unsigned int i = 0; i < count; i++) {
+                if (singleLengths[i] != batchLengths[i] ||
+                    memcmp(&single[(size_t)i * stride], &batch[(size_t)i * stride], (singleLengths[i] + 1) * sizeof(wchar_t)))
+                {
+                    numErrors++;
+                }
+                if (!narrow.empty()) {
+                    char const *str = &narrow[(size_t)i * stride];
+                    if (narrowLengths[i] != singleLengths[i] || !std::equal(str, str + narrowLengths[i], &single[(size_t)i * stride],
+                        [](char c, wchar_t w) { return (wchar_t)(unsigned char)c == w; }))
+                    {
+                        numErrors++;
+                    }
+                }
+            }
+            printf("%s %s: %u strings, DecodeString %.1f ms, DecodeStrings %.1f ms", game == GAME_FM09 ? "FM09" : "FM06",
+                canonical ? "canonical" : "tree", count, singleTime, batchTime);
+            if (!narrow.empty())
+                printf(", 8-bit DecodeStrings %.1f ms", narrowTime);
+            printf("\n");
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    printf("%u errors\n", numErrors);
+    return numErrors == 0 ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+// Times the key hashing paths on a million generated keys: GetHash on a narrowed copy, as import used to hash,
+// GetHash on the wide string, GetHashes on the whole batch, and a key family built from a hashed prefix.
+// Not a part of the HufConverter project; built from the code folder with
+//   cl /std:c++20 /EHsc /O2 /I. tests\HashBenchmark.cpp Text.cpp utils.cpp message.cpp
+// and returns 0 when every path gives the same hashes.
+#include "Text.h"
+#include "utils.h"
+#include <cstdio>
+#include <chrono>
+#include <random>
+
+static const unsigned int NUM_KEYS = 1000000;
+static const unsigned int NUM_RUNS = 5;
+
+// the best of NUM_RUNS runs, in milliseconds
+template<typename F>
+static double Measure(F const &func) {
+    double best = 0.0;
+    for (unsigned int run = 0; run < NUM_RUNS; run++) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        double time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || time < best)
+            best = time;
+    }
+    return best;
+}
+
+int main() {
+    std::mt19937 random(33);
+    std::vector<std::wstring> keys(NUM_KEYS);
+    for (auto &key : keys) {
+        key = L"IDS_KEY_";
+        unsigned int length = random() % 24;
+        for (unsigned int i = 0; i < length; i++)
+            key += (wchar_t)(L'0' + random() % 40);
+    }
+    std::vector<std::wstring_view> views(keys.begin(), keys.end());
+    std::vector<unsigned int> narrowed(NUM_KEYS), wide(NUM_KEYS), batch(NUM_KEYS);
+    unsigned int numErrors = 0;
+
+    double narrowedTime = Measure([&] {
+        for (unsigned int i = 0; i < NUM_KEYS; i++)
+            narrowed[i] = CText::GetHash(WtoA(keys[i]).c_str());
+    });
+    double wideTime = Measure([&] {
+        for (unsigned int i = 0; i < NUM_KEYS; i++)
+            wide[i] = CText::GetHash(views[i]);
+    });
+    double batchTime = Measure([&] {
+        CText::GetHashes(views.data(), views.size(), batch.data());
+    });
+    if (wide != narrowed || batch != narrowed)
+        numErrors++;
+    printf("%u keys: WtoA + GetHash %.1f ms, GetHash %.1f ms, GetHashes %.1f ms\n", NUM_KEYS, narrowedTime, wideTime, batchTime);
+
+    // a key family with a fixed prefix and a numbered suffix, formatted whole or extended from the prefix hash
+    std::vector<std::wstring> suffixes(NUM_KEYS);
+    for (unsigned int i = 0; i < NUM_KEYS; i++)
+        suffixes[i] = Format(L"%d", i);
+    std::vector<std::wstring_view> suffixViews(suffixes.begin(), suffixes.end());
+    std::vector<unsigned int> formatted(NUM_KEYS), extended(NUM_KEYS);
+    double formatTime = Measure([&] {
+        for (unsigned int i = 0; i < NUM_KEYS; i++)
+            formatted[i] = CText::GetHash(WtoA(Format(L"IDS_CITYDESC_%d", i)).c_str());
+    });
+    double prefixTime = Measure([&] {
+        unsigned int prefixHash = CText::GetHash(std::wstring_view(L"IDS_CITYDESC_"));
+        CText::GetHashes(suffixViews.data(), suffixViews.size(), extended.data(), prefixHash);
+    });
+    if (extended != formatted)
+        numErrors++;
+    printf("%u family keys: Format + WtoA + GetHash %.1f ms, prefix hash + GetHashes %.1f ms\n", NUM_KEYS, formatTime, prefixTime);
+    printf("%u errors\n", numErrors);
+    return numErrors == 0 ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+// Checks the paths which rewrite or compare .huf files against simple references: patching a loaded file, the
+// three-way merge, encoding several locales at once with their verification, and the rejection of malformed files.
+// Not a part of the HufConverter project; built from the code folder with
+//   cl /std:c++20 /EHsc /O2 /I. tests\TextRegressionTest.cpp Text.cpp TextDiff.cpp utils.cpp message.cpp
+// and returns 0 when every check passes.
+#include "Text.h"
+#include "TextDiff.h"
+#include "utils.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <set>
+
+typedef std::map<unsigned int, std::wstring> StringMap;
+
+static unsigned int numErrors = 0;
+
+static void Check(bool condition, char const *what, int game) {
+    if (!condition) {
+        printf("Game %d: %s\n", game, what);
+        numErrors++;
+    }
+}
+
+static std::wstring RandomString(std::mt19937 &random, unsigned int maxLength, unsigned int alphabet) {
+    std::wstring str(random() % maxLength, L' ');
+    for (auto &c : str)
+        c = (wchar_t)(L'a' + random() % alphabet);
+    return str;
+}
+
+static bool HasStrings(CText const &text, StringMap const &strings) {
+    if (text.m_nNumStringHashes != strings.size())
+        return false;
+    for (auto const &[key, str] : strings) {
+        wchar_t const *decoded = text.GetByHashKey(key);
+        if (!decoded || str != decoded)
+            return false;
+    }
+    return true;
+}
+
+// rounds of replaced, added and removed strings on a loaded file, with and without shared suffixes
+static void TestPatch(std::filesystem::path const &folder) {
+    std::filesystem::path path = folder / L"patch.huf";
+    for (eGame game : { GAME_TCM2005, GAME_FM06, GAME_FM09 }) {
+        for (unsigned int seed = 0; seed < 4; seed++) {
+            std::mt19937 random(seed);
+            std::vector<std::wstring> endings;
+            for (unsigned int i = 0; i < 40; i++)
+                endings.push_back(RandomString(random, 10, 15));
+            StringMap strings;
+            for (unsigned int i = 0; i < 3000; i++) {
+                std::wstring str = (random() % 4 == 0) ? std::wstring() : RandomString(random, 20, 15);
+                strings[random()] = str + endings[random() % endings.size()];
+            }
+            CText source;
+            CText text;
+            Check(source.LoadTranslationStrings(strings, game, seed % 2 == 0) && source.WriteTranslationsFile(path.c_str()) &&
+                text.LoadTranslationsFile(path.c_str(), game, true), "writing the file to patch failed", game);
+            for (unsigned int round = 0; round < 4; round++) {
+                StringMap patch;
+                std::set<unsigned int> removed;
+                for (auto const &[key, str] : strings) {
+                    unsigned int change = random() % 10;
+                    if (change == 0)
+                        removed.insert(key);
+                    else if (change == 1)
+                        patch[key] = RandomString(random, 20, 15);
+                }
+                for (unsigned int i = 0; i < 50; i++)
+                    patch[random()] = RandomString(random, 30, 15);
+                Check(text.PatchTranslationStrings(patch, removed), "a patch was rejected", game);
+                for (unsigned int key : removed)
+                    strings.erase(key);
+                for (auto const &[key, str] : patch)
+                    strings[key] = str;
+                Check(HasStrings(text, strings), "the patched text has wrong strings", game);
+                CText patched;
+                Check(text.WriteTranslationsFile(path.c_str()) && patched.LoadTranslationsFile(path.c_str(), game, true) &&
+                    HasStrings(patched, strings), "the patched file has wrong strings", game);
+            }
+            // removing all but a few strings drops their bits
+            StringMap few;
+            std::set<unsigned int> removed;
+            for (auto const &[key, str] : strings) {
+                if (few.size() < 10)
+                    few[key] = str;
+                else
+                    removed.insert(key);
+            }
+            Check(text.PatchTranslationStrings({}, removed) && HasStrings(text, few) && text.m_mbStrings.m_bitOffset < 2000,
+                "removing strings didn't shrink the data", game);
+            // a character without a code fails and leaves the text as it was
+            unsigned int numBits = text.m_mbStrings.m_bitOffset;
+            Check(!text.PatchTranslationStrings({ { 5u, L"\x4E2D" } }, { few.begin()->first }) && numBits == text.m_mbStrings.m_bitOffset &&
+                HasStrings(text, few), "a failed patch changed the text", game);
+        }
+    }
+}
+
+// the merge against a per-key reference: a side which changed a string from the base wins, both sides changing
+// it differently is a conflict which keeps ours, and without a base theirs wins wherever it has the key
+static void TestMerge() {
+    for (unsigned int seed = 0; seed < 16; seed++) {
+        std::mt19937 random(seed);
+        StringMap base;
+        for (unsigned int i = 0; i < 3000; i++)
+            base[random() % 5000] = RandomString(random, 20, 20);
+        auto Change = [&random](StringMap strings, StringMap &patch, std::set<unsigned int> &removed) {
+            for (unsigned int i = 0; i < 300; i++) {
+                unsigned int key = random() % 5500;
+                if (random() % 3 == 0) {
+                    if (strings.erase(key))
+                        removed.insert(key);
+                    patch.erase(key);
+                }
+                else {
+                    strings[key] = patch[key] = RandomString(random, 20, 20);
+                    removed.erase(key);
+                }
+            }
+            return strings;
+        };
+        StringMap ourPatch, theirPatch;
+        std::set<unsigned int> ourRemoved, theirRemoved;
+        StringMap ours = Change(base, ourPatch, ourRemoved);
+        StringMap theirs = Change(base, theirPatch, theirRemoved);
+        bool useBase = seed % 4 != 3;
+        StringMap expected;
+        std::set<unsigned int> expectedConflicts, keys;
+        for (StringMap const *strings : { &base, &ours, &theirs }) {
+            for (auto const &[key, str] : *strings)
+                keys.insert(key);
+        }
+        for (unsigned int key : keys) {
+            bool inOurs = ours.contains(key), inTheirs = theirs.contains(key), inBase = useBase && base.contains(key);
+            if (!useBase && !inOurs && !inTheirs)
+                continue;
+            std::wstring ourValue = inOurs ? ours[key] : L"", theirValue = inTheirs ? theirs[key] : L"", baseValue = inBase ? base[key] : L"";
+            bool useTheirs = false;
+            if (inOurs != inTheirs || ourValue != theirValue) {
+                if (!useBase)
+                    useTheirs = inTheirs;
+                else {
+                    bool ourChange = inOurs != inBase || ourValue != baseValue;
+                    bool theirChange = inTheirs != inBase || theirValue != baseValue;
+                    if (ourChange && theirChange)
+                        expectedConflicts.insert(key);
+                    useTheirs = !ourChange;
+                }
+            }
+            if (useTheirs ? inTheirs : inOurs)
+                expected[key] = useTheirs ? theirValue : ourValue;
+        }
+        // patched texts share the tree of the base, so the merge compares their codes
+        CText baseText, ourText, theirText;
+        baseText.LoadTranslationStrings(base, GAME_FM09);
+        if (seed % 2 == 0) {
+            ourText.LoadTranslationStrings(base, GAME_FM09);
+            theirText.LoadTranslationStrings(base, GAME_FM09);
+            Check(ourText.PatchTranslationStrings(ourPatch, ourRemoved) && theirText.PatchTranslationStrings(theirPatch, theirRemoved),
+                "patching a side of the merge failed", GAME_FM09);
+        }
+        else {
+            ourText.LoadTranslationStrings(ours, GAME_FM09);
+            theirText.LoadTranslationStrings(theirs, GAME_FM09);
+        }
+        StringMap merged;
+        auto conflicts = CTextDiff::Merge(useBase ? &baseText : nullptr, ourText, theirText, merged);
+        std::set<unsigned int> conflictKeys;
+        for (auto const &entry : conflicts) {
+            conflictKeys.insert(entry.key);
+            Check(entry.oldValue == ours[entry.key] && entry.newValue == theirs[entry.key], "a conflict has wrong values", GAME_FM09);
+        }
+        Check(merged == expected && conflictKeys == expectedConflicts, "the merge differs from the reference", GAME_FM09);
+    }
+}
+
+// locales with the same keys are encoded side by side and each file is verified serially, as -locales does
+static void TestLocales(std::filesystem::path const &folder) {
+    for (eGame game : { GAME_FM06, GAME_FM09 }) {
+        static const unsigned int NUM_LOCALES = 6;
+        std::mt19937 random(game);
+        std::vector<unsigned int> keys(5000);
+        for (auto &key : keys)
+            key = random();
+        std::vector<CTextStringArena> locales(NUM_LOCALES);
+        for (unsigned int l = 0; l < NUM_LOCALES; l++) {
+            for (unsigned int key : keys)
+                locales[l].Add(key, RandomString(random, 40, 26 + l));
+            locales[l].SortAndDeduplicate();
+        }
+        // 8-bit formats can't store a Cyrillic string, the verification must report it
+        locales[1].Add(keys[0] ^ 1, L"\x0410\x0411");
+        locales[1].SortAndDeduplicate();
+        std::vector<char> written(NUM_LOCALES, 0);
+        ParallelFor(NUM_LOCALES, [&](size_t begin, size_t end) {
+            for (size_t l = begin; l < end; l++) {
+                CText text;
+                std::vector<std::wstring_view> encodeOrder;
+                std::filesystem::path path = folder / (L"locale" + std::to_wstring(l) + L".huf");
+                written[l] = text.PrepareTranslationStrings(locales[l], game, l % 2 == 0, encodeOrder) &&
+                    text.WriteTranslationsFile(path.c_str(), encodeOrder);
+            }
+        }, 1);
+        for (unsigned int l = 0; l < NUM_LOCALES; l++) {
+            std::filesystem::path path = folder / (L"locale" + std::to_wstring(l) + L".huf");
+            std::vector<TextDiffEntry> mismatches;
+            std::wstring loadError;
+            bool read = written[l] && CTextDiff::Verify(path.c_str(), game, locales[l], mismatches, loadError, false);
+            Check(read, "a locale file can't be read back", game);
+            bool expectMismatch = (l == 1 && game != GAME_FM09);
+            Check(mismatches.size() == (expectMismatch ? 1u : 0u), "a locale file has wrong mismatches", game);
+        }
+    }
+}
+
+// FM06 files broken in the ways Validate looks for; each must fail to load with a reason
+static void TestValidate(std::filesystem::path const &folder) {
+    std::filesystem::path path = folder / L"validate.huf";
+    std::mt19937 random(43);
+    StringMap strings;
+    for (unsigned int i = 0; i < 2000; i++)
+        strings[random()] = RandomString(random, 40, 7);
+    CText source;
+    source.LoadTranslationStrings(strings, GAME_FM06);
+    source.WriteTranslationsFile(path.c_str());
+    std::vector<char> good;
+    {
+        std::ifstream file(path, std::ios::binary);
+        good.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    // max length, number of hashes, the hashes, number of nodes, root node, the node array
+    unsigned int numHashes = *(unsigned int *)&good[4];
+    size_t treePos = 8 + 8 * (size_t)numHashes;
+    unsigned short numChunks = *(unsigned short *)&good[treePos];
+    unsigned short root = *(unsigned short *)&good[treePos + 2];
+    auto Chunk = [treePos](std::vector<char> &data, unsigned int index) {
+        return (CHuffChunk *)&data[treePos + 4 + 12 * (size_t)index];
+    };
+    auto Load = [&path](std::vector<char> const &data, bool checkStrings, CText &text) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), data.size());
+        return text.LoadTranslationsFile(path.c_str(), GAME_FM06, checkStrings);
+    };
+    auto ExpectRejected = [&](std::vector<char> const &data, bool checkStrings, char const *what) {
+        CText text;
+        Check(!Load(data, checkStrings, text) && !text.m_loadError.empty(), what, GAME_FM06);
+    };
+    unsigned short inner = Chunk(good, root)->LeftLeaf;
+    if (Chunk(good, inner)->IsLast())
+        inner = Chunk(good, root)->RightLeaf;
+    std::vector<char> data = good;
+    Chunk(data, root)->LeftLeaf = numChunks + 5;
+    ExpectRejected(data, false, "a child out of range was accepted");
+    data = good;
+    Chunk(data, inner)->LeftLeaf = root;
+    ExpectRejected(data, false, "a cycle was accepted");
+    data = good;
+    *(unsigned short *)&data[treePos + 2] = numChunks;
+    ExpectRejected(data, false, "a root out of range was accepted");
+    data = good;
+    *(unsigned short *)&data[treePos + 2] = inner;
+    ExpectRejected(data, false, "unreachable nodes were accepted");
+    data = good;
+    for (unsigned int i = 0; i < numChunks; i++) {
+        if (Chunk(data, i)->IsLast() && Chunk(data, i)->character == 0)
+            Chunk(data, i)->character = 1;
+    }
+    ExpectRejected(data, false, "a tree without a terminator was accepted");
+    // an offset past the data passes the tree checks, but not the string walk, and stays on the checked decoding
+    data = good;
+    *(unsigned int *)&data[8 + 4] = 0xFFFFFF00;
+    ExpectRejected(data, true, "an offset past the data was accepted");
+    CText text;
+    Check(Load(data, false, text) && !text.m_bValidated, "an unwalked file was marked validated", GAME_FM06);
+    Check(Load(good, true, text) && text.m_bValidated && HasStrings(text, strings), "a valid file was rejected", GAME_FM06);
+}
+
+int main() {
+    std::filesystem::path folder = std::filesystem::temp_directory_path() / L"HufConverterRegressionTest";
+    std::error_code ec;
+    std::filesystem::create_directories(folder, ec);
+    TestPatch(folder);
+    TestMerge();
+    TestLocales(folder);
+    TestValidate(folder);
+    std::filesystem::remove_all(folder, ec);
+    printf("%u errors\n", numErrors);
+    return numErrors == 0 ? 0 : 1;
+}
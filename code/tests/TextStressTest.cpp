@@ -0,0 +1,156 @@
+// Encodes and decodes several .huf files on many threads at once and checks the results against serial runs.
+// Every thread also reads the same loaded texts, so the const read paths of CText are shared between threads.
+// Not a part of the HufConverter project; built from the code folder with
+//   cl /std:c++20 /EHsc /O2 /I. tests\TextStressTest.cpp Text.cpp utils.cpp message.cpp
+// and returns 0 when every result matches.
+#include "Text.h"
+#include "utils.h"
+#include <cstdio>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+static const unsigned int NUM_FILES = 8;
+static const unsigned int NUM_STRINGS = 5000;
+static const unsigned int NUM_ROUNDS = 3;
+
+struct StressInput {
+    eGame game = GAME_NOTSET;
+    bool shareSuffixes = false;
+    std::map<unsigned int, std::wstring> strings;
+};
+
+static StressInput GenerateInput(unsigned int seed) {
+    static eGame const games[] = { GAME_TCM2005, GAME_FM06, GAME_FM09 };
+    StressInput input;
+    input.game = games[seed % std::size(games)];
+    input.shareSuffixes = (seed % 2) == 1;
+    std::mt19937 random(seed);
+    // the 8-bit formats take Latin-1 characters only
+    unsigned int alphabet = (input.game == GAME_FM09) ? 2000 : 90;
+    for (unsigned int i = 0; i < NUM_STRINGS; i++) {
+        std::wstring str(random() % 60, L' ');
+        for (auto &c : str)
+            c = (wchar_t)(L'!' + random() % alphabet);
+        // repeated strings and common endings make the shared string paths run too
+        if (i % 7 == 0 && !input.strings.empty())
+            str = input.strings.begin()->second;
+        else if (i % 5 == 0)
+            str += L" of the season";
+        input.strings[random()] = str;
+    }
+    return input;
+}
+
+// the files aren't compared byte by byte, the 8-bit formats keep the address of the strings data in the file
+static bool IsSameText(CText const &a, CText const &b) {
+    CTextHuffman const &treeA = a.m_huffmanInfo;
+    CTextHuffman const &treeB = b.m_huffmanInfo;
+    return a.m_nNumStringHashes == b.m_nNumStringHashes && a.m_nMaxStringLength == b.m_nMaxStringLength &&
+        !memcmp(a.m_pStringHashes, b.m_pStringHashes, a.m_nNumStringHashes * sizeof(CStringHash)) &&
+        treeA.m_nNumHuffmanChunks == treeB.m_nNumHuffmanChunks && treeA.m_nRootLeaf == treeB.m_nRootLeaf &&
+        !memcmp(treeA.m_pHuffChunks, treeB.m_pHuffChunks, treeA.m_nNumHuffmanChunks * sizeof(CHuffChunk)) &&
+        a.m_mbStrings.m_nDataSize == b.m_mbStrings.m_nDataSize &&
+        !memcmp(a.m_mbStrings.m_pData, b.m_mbStrings.m_pData, a.m_mbStrings.m_nDataSize);
+}
+
+static bool EncodeFile(StressInput const &input, std::filesystem::path const &path) {
+    CText text;
+    return text.LoadTranslationStrings(input.strings, input.game, input.shareSuffixes) && text.WriteTranslationsFile(path.c_str());
+}
+
+// compares every string of a loaded text with the input, through each of the read paths. A string returned by
+// GetByHashKey is compared again 31 calls later, when other threads have made their calls in between
+static unsigned int CheckStrings(CText const &text, StressInput const &input) {
+    unsigned int numErrors = 0;
+    std::vector<unsigned int> offsets;
+    std::vector<std::wstring const *> expected;
+    std::pair<wchar_t const *, std::wstring const *> recent[31] = {};
+    unsigned int numCalls = 0;
+    for (auto const &[key, str] : input.strings) {
+        wchar_t const *decoded = text.GetByHashKey(key);
+        auto shared = text.GetShared(key);
+        if (!decoded || str != decoded || !shared || *shared != str)
+            numErrors++;
+        auto &oldest = recent[numCalls++ % std::size(recent)];
+        if (oldest.first && *oldest.second != oldest.first)
+            numErrors++;
+        oldest = { decoded, &str };
+        if (CStringHash const *hash = text.FindStringHash(key)) {
+            offsets.push_back(hash->offset);
+            expected.push_back(&str);
+        }
+    }
+    if (offsets.size() != input.strings.size())
+        numErrors++;
+    unsigned int const stride = text.m_nMaxStringLength + 1;
+    std::vector<wchar_t> strs(offsets.size() * stride);
+    std::vector<unsigned int> lengths(offsets.size());
+    text.DecodeStrings(offsets.data(), (unsigned int)offsets.size(), strs.data(), lengths.data());
+    for (size_t i = 0; i < offsets.size(); i++) {
+        if (std::wstring_view(&strs[i * stride], lengths[i]) != *expected[i])
+            numErrors++;
+    }
+    return numErrors;
+}
+
+int main() {
+    std::filesystem::path folder = std::filesystem::temp_directory_path() / L"HufConverterStressTest";
+    std::error_code ec;
+    std::filesystem::create_directories(folder, ec);
+    auto FilePath = [&folder](unsigned int file, std::wstring const &suffix) {
+        return folder / (std::to_wstring(file) + L"_" + suffix + L".huf");
+    };
+
+    // serial runs
+    std::vector<StressInput> inputs;
+    std::vector<CText> sharedTexts(NUM_FILES);
+    for (unsigned int f = 0; f < NUM_FILES; f++) {
+        inputs.push_back(GenerateInput(f));
+        if (!EncodeFile(inputs[f], FilePath(f, L"serial")) ||
+            !sharedTexts[f].LoadTranslationsFile(FilePath(f, L"serial").c_str(), inputs[f].game, true) ||
+            CheckStrings(sharedTexts[f], inputs[f]) != 0)
+        {
+            printf("File %u: serial decoding failed\n", f);
+            return 1;
+        }
+    }
+
+    // every thread encodes and loads its own copies of the files and reads the shared texts in between
+    unsigned int numThreads = (std::max)(8u, std::thread::hardware_concurrency() * 2);
+    std::atomic<unsigned int> numErrors = 0;
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; t++) {
+        threads.emplace_back([&, t] {
+            for (unsigned int round = 0; round < NUM_ROUNDS; round++) {
+                for (unsigned int i = 0; i < NUM_FILES; i++) {
+                    unsigned int f = (t + i) % NUM_FILES;
+                    std::filesystem::path path = FilePath(f, std::to_wstring(t));
+                    CText text;
+                    if (!EncodeFile(inputs[f], path) || !text.LoadTranslationsFile(path.c_str(), inputs[f].game) ||
+                        !IsSameText(text, sharedTexts[f]))
+                    {
+                        printf("File %u, thread %u: the encoded file differs from the serial run\n", f, t);
+                        numErrors++;
+                    }
+                    else if (CheckStrings(text, inputs[f]) != 0) {
+                        printf("File %u, thread %u: decoding the own copy failed\n", f, t);
+                        numErrors++;
+                    }
+                    // the shared texts are read in the same order by every thread
+                    if (CheckStrings(sharedTexts[i], inputs[i]) != 0) {
+                        printf("File %u, thread %u: decoding the shared text failed\n", i, t);
+                        numErrors++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    std::filesystem::remove_all(folder, ec);
+    printf("%u threads, %u files, %u rounds: %u errors\n", numThreads, NUM_FILES, NUM_ROUNDS, (unsigned int)numErrors);
+    return numErrors == 0 ? 0 : 1;
+}
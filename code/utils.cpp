@@ -2,10 +2,10 @@
 #include <Windows.h>
 #include "utils.h"
 
-unsigned int FormattingUtils::currentBuf = 0;
-char FormattingUtils::buf[FormattingUtils::BUF_SIZE][4096];
-unsigned int FormattingUtils::currentBufW = 0;
-wchar_t FormattingUtils::bufW[FormattingUtils::BUF_SIZE][4096];
+thread_local unsigned int FormattingUtils::currentBuf = 0;
+thread_local char FormattingUtils::buf[FormattingUtils::BUF_SIZE][4096];
+thread_local unsigned int FormattingUtils::currentBufW = 0;
+thread_local wchar_t FormattingUtils::bufW[FormattingUtils::BUF_SIZE][4096];
 
 std::wstring AtoW(std::string const &str) {
     std::wstring result;
@@ -59,7 +59,7 @@ unsigned int Hash(std::string const &str) {
     return hash;
 }
 
-std::string ToUTF8(std::wstring const &wstr) {
+std::string ToUTF8(std::wstring_view wstr) {
     if (wstr.empty())
         return std::string();
     int size_needed = WideCharToMultiByte(CP_UTF8, 0, &wstr[0], (int)wstr.size(), NULL, 0, NULL, NULL);
@@ -95,7 +95,7 @@ void ConvertWindows1251ToUTF16(std::wstring &str) {
     MultiByteToWideChar(1251, 0, &mbStr[0], (int)mbStr.size(), &str[0], size_needed);
 }
 
-bool IsNumber(const std::wstring &str) {
+bool IsNumber(std::wstring_view str) {
     if (str.empty())
         return false;
     for (wchar_t c : str) {
@@ -105,9 +105,9 @@ bool IsNumber(const std::wstring &str) {
     return true;
 }
 
-std::wstring ReplaceAll(std::wstring const &input, std::vector<std::pair<std::wstring, std::wstring>> const &replacements) {
+std::wstring ReplaceAll(std::wstring_view input, std::vector<std::pair<std::wstring, std::wstring>> const &replacements) {
     if (replacements.empty())
-        return input;
+        return std::wstring(input);
     std::wstring output;
     output.reserve(input.size());
     size_t pos = 0;
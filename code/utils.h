@@ -1,7 +1,12 @@
 #pragma once
 #include <cstdio>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 std::wstring AtoW(std::string const &str);
 std::string WtoA(std::wstring const &str);
@@ -9,12 +14,12 @@ std::wstring ToUpper(std::wstring const &str);
 std::wstring ToLower(std::wstring const &str);
 void Trim(std::wstring &str);
 unsigned int Hash(std::string const &str);
-std::string ToUTF8(std::wstring const &wstr);
+std::string ToUTF8(std::wstring_view wstr);
 std::wstring ToUTF16(std::string const &str);
 void ConvertUTF16ToWindows1251(std::wstring &str);
 void ConvertWindows1251ToUTF16(std::wstring &str);
-bool IsNumber(const std::wstring &str);
-std::wstring ReplaceAll(std::wstring const &input, std::vector<std::pair<std::wstring, std::wstring>> const &replacements);
+bool IsNumber(std::wstring_view str);
+std::wstring ReplaceAll(std::wstring_view input, std::vector<std::pair<std::wstring, std::wstring>> const &replacements);
 
 template<typename T>
 T SafeConvertInt(std::wstring const &str, bool isHex = false) {
@@ -36,12 +41,76 @@ T SafeConvertInt(std::string const &str, bool isHex = false) {
     return result;
 }
 
+// Splits [0; count) into contiguous ranges and runs func(begin, end) for each range on its own thread
+template<typename Func>
+void ParallelFor(size_t count, Func func, size_t minItemsPerThread = 1024) {
+    size_t numThreads = std::thread::hardware_concurrency();
+    if (numThreads > count / minItemsPerThread)
+        numThreads = count / minItemsPerThread;
+    if (numThreads <= 1) {
+        func(size_t(0), count);
+        return;
+    }
+    std::vector<std::thread> threads;
+    size_t itemsPerThread = (count + numThreads - 1) / numThreads;
+    for (size_t begin = 0; begin < count; begin += itemsPerThread) {
+        size_t end = (begin + itemsPerThread < count) ? (begin + itemsPerThread) : count;
+        threads.emplace_back(func, begin, end);
+    }
+    for (auto &t : threads)
+        t.join();
+}
+
+// Fixed-capacity queue between producer and consumer threads: Push waits while the queue is full,
+// Pop waits while it is empty and returns false once the queue is closed and drained
+template<typename T>
+class CBoundedQueue {
+    std::deque<T> m_items;
+    size_t m_nCapacity;
+    bool m_bClosed = false;
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+public:
+    explicit CBoundedQueue(size_t capacity) : m_nCapacity(capacity ? capacity : 1) {}
+
+    // returns false if the queue was closed - the item is dropped
+    bool Push(T &&item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this] { return m_items.size() < m_nCapacity || m_bClosed; });
+        if (m_bClosed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    bool Pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_bClosed; });
+        if (m_items.empty())
+            return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    // wakes up all waiting threads
+    void Close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bClosed = true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+};
+
 class FormattingUtils {
     static const unsigned int BUF_SIZE = 10;
-    static unsigned int currentBuf;
-    static char buf[BUF_SIZE][4096];
-    static unsigned int currentBufW;
-    static wchar_t bufW[BUF_SIZE][4096];
+    static thread_local unsigned int currentBuf;
+    static thread_local char buf[BUF_SIZE][4096];
+    static thread_local unsigned int currentBufW;
+    static thread_local wchar_t bufW[BUF_SIZE][4096];
 public:
     template<typename T> static T const &Arg(T const &arg) { return arg; }
     static char const *Arg(std::string const &arg) { return arg.c_str(); }